@@ -211,9 +211,61 @@
  *
  *   * 2013-02-27: Put on github.
  *
+ *   * 2026-10-18:
+ *     - Targeted rescan of one target (-R): REPORT LUNS and sysfs
+ *       scan of just the new LUNs, which are the only ones named.
+ *     - Single device refresh (-D) for hotplug: Only the nodes and
+ *       aliases of one device are created, updated or sanitized.
+ *     - udev PROGRAM callout (-u): Print scsiname () and aliases for a
+ *       sysfs devpath. The alias file is compiled into rules (chained
+ *       per devtype) once instead of parsed while matching.
+ *     - Event daemon (-E): Listen for SCSI uevents, debounce bursts
+ *       into batches and only update the changed devices, keeping
+ *       reglist between batches. -U uses a local socket as source.
+ *     - Run lock in /dev/.scsidev/lock: Concurrent invocations wait
+ *       and a full scan started after their arrival satisfies them.
+ *     - All node operations relative to one dir fd for /dev/scsi
+ *       (*at() syscalls), no fixed size path buffers any more.
+ *     - DEVSCSI is read once into a hash table and all node decisions
+ *       are taken from there; only the needed changes are syscalls.
+ *     - Name index for the registered devices: O(1) lookups when
+ *       sanitizing and warnings on name collisions.
+ *     - Permissions of inactive nodes in /dev/.scsidev/perms instead of
+ *       .shadow. files (which are migrated).
+ *     - Staged rebuild (-S): New tree in /dev/.scsi.stage, swapped in
+ *       with renameat2 (RENAME_EXCHANGE).
+ *     - Changes to /dev/scsi are planned and applied at the end of the
+ *       run; --dry-run just prints them.
+ *     - Inventory of /dev/scsi and the registered devices in
+ *       /dev/.scsidev/inventory: Used instead of reading the dir when
+ *       that is unchanged, -v reports the changes since the last run.
+ *     - TESTDEV lives in /dev/.scsidev, probing leaves /dev/scsi alone.
+ *     - Renumbered devices: The old node is renamed (or exchanged with
+ *       the one in the way) instead of recreated, keeping its perms.
+ *     - --io-uring: Batch the metadata operations on /dev/scsi.
+ *     - Subdirs per host or type (-H), with symlinks for the flat names
+ *       used in /etc/fstab.
+ *     - Alias rules only look at the devices filed under their most
+ *       selective field (wwid, serial, hsvosid, c:i:l) in an index.
+ *     - Binary cache of the parsed alias file in /var/cache/scsidev.
+ *     - Glob and ~regex patterns for the string fields of alias rules,
+ *       compiled once; serial prefixes narrow the candidates.
+ *     - alias= templates (%{serial} etc.): One alias per matching device.
+ *     - group= rules: Numbered aliases in DEVSCSI/group/, the ordinals
+ *       are kept in /var/lib/scsidev/groups.
+ *     - All VPD 0x83 designators of the LU are kept (NAA 64/128 bit,
+ *       EUI-64, T10 vendor ID, SCSI name string) and can be matched
+ *       by naa=, eui64=, t10= and scsiname= alias keys.
+ *     - --aliases and the daemon (watching the alias file) only evaluate
+ *       the new and changed alias rules against the known devices.
+ *     - --early names the devices referred to by alias rules (pre-matched
+ *       on their sysfs identity) before the full scan, then creates
+ *       /dev/.scsidev/ready.
+ *     - --explain reports candidates, eliminating fields, comparisons,
+ *       time and result per alias rule.
+ *
  *     TODO:
- *           Change wwid to string type to handle T10 ...
- *           handle more identifiers to match devices
+ *           Match on the target port designators, too
  *
  */
 
@@ -234,6 +286,20 @@
 #include <string.h>
 #include <ctype.h>
 #include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/netlink.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <regex.h>
+#include <fnmatch.h>
+#include <sys/inotify.h>
+#ifndef RENAME_EXCHANGE
+# define RENAME_EXCHANGE (1 << 1)
+#endif
  
 static char rcsid[] ="$Id$";
 static char *versid = "scsidev " VERSION " 2013-02-27";
@@ -263,6 +329,12 @@ static char *copyright = "Copyright: GNU GPL  (see file COPYING)\n" \
 # include <scsi/sg.h>
 #endif
 
+/* --io-uring */
+#ifdef HAVE_LINUX_IO_URING_H
+# include <linux/io_uring.h>
+# include <linux/stat.h>
+#endif
+
 int use_symlink = 0;
 int use_scd = 0;
 int symlink_alias = 0;
@@ -271,12 +343,18 @@ int verbose = 0;
 int quiet = 0;
 int maxmiss = 8;
 int force = 0;
+int staged = 0;
+int dry_run = 0;
+int explain = 0;	/* report how the alias rules were matched */
+int early = 0;		/* name the devices in the alias file first */
+int reglist_full = 0;	/* all devices have been registered */
 int san_del = 0;
 int no_san = 0;
 int no_procscsi = 0;
 int no_sysfs = 0;
 int full_scan = 32;
 int nm_cbtu = 0;
+enum shard_t { SHARD_NONE = 0, SHARD_HOST, SHARD_TYPE } shard = SHARD_NONE;
 int supp_rmvbl = 0;
 int supp_multi = 0;
 int override_link_perm = 1;
@@ -284,15 +362,29 @@ char *no_serial = "No serial number";
 char *scsialias = "";
 const unsigned long long no_wwid = 0;
 const int no_hsv_os_id = -1;
+int devscsi_fd = -1;	/* all node operations are relative to this */
+int testdev_fd = -1;	/* STATEDIR, probing doesn't touch DEVSCSI */
 
 #define DEVSCSI "/dev/scsi"
-#define TESTDEV DEVSCSI "/testdev"
 #define PROCSCSI "/proc/scsi/scsi"
+#define SYSSCSIDEV "/sys/class/scsi_device"
+#define STATEDIR "/dev/.scsidev"
+#define TESTNM "testdev"
+#define TESTDEV STATEDIR "/" TESTNM
+#define LOCKFILE STATEDIR "/lock"
+#define PERMDB STATEDIR "/perms"
+#define INVENTORY STATEDIR "/inventory"
+#define STAGEDIR "/dev/.scsi.stage"
 #define SHADOW ".shadow."
+#define XCHGNM ".scsidev.xchg"
+#define ALIASCACHE "/var/cache/scsidev/alias.cache"
+#define GROUPDB "/var/lib/scsidev/groups"
+#define READYFILE STATEDIR "/ready"
 
 enum devtype_t { NONE=0, SG, SD, SR, ST, OSST, SCH, };
 char* devtp_nm[] = { "", "Generic", "Disk", "Rom", "Tape", "OnStreamTape", "Changer", };
 char* devtp_nm26[] = { "", "sg", "sd.", "sr", "st", "osst", "sch", };
+char* devtp_shard[] = { "", "sg", "sd", "sr", "st", "osst", "sch", };
 
 /*
  * This program builds entries in /dev/scsi that have names that are tied
@@ -319,6 +411,7 @@ typedef struct regnames
     char * rev;
     char * serial;
     unsigned long long wwid;
+    char * desigs;	// VPD 0x83 "type:value" strings, \0 separated, \0\0 at the end
     int  hsv_os_id;
     enum devtype_t devtp;
     char inq_devtp;
@@ -336,6 +429,8 @@ typedef struct regnames
     int  lun;
     struct regnames * alias; // TBR
     struct regnames * related;
+    char regd;		// on reglist (and in the name index)
+    unsigned int aliasrule;	// aliases: sig of the rule that made it
 } sname;
 
 /* The related pointer is new: For disks, tapes and CDRoms it points to
@@ -347,6 +442,18 @@ sname * reglist = NULL;
 void build_special();
 int inquiry (int, sname *);
 int get_hsv_os_id(int, sname *);
+int scsi_cmd(int, int, unsigned char*, int, unsigned char*, int,
+	     unsigned char*, int);
+int callout (const char *);
+char* getstr (char*, int, int);
+unsigned long long extract_wwid (unsigned char*);
+char * extract_desigs (unsigned char*, int);
+void alias_reset ();
+int alias_update ();
+char * alias_select (int, int, int, int, char *);
+sname * alias_unregister (int, int, int, int, const char *, sname *);
+int alias_refresh (char *, sname *);
+int prio_scan ();
 
 #ifndef SCSI_CHANGER_MAJOR
 # define SCSI_CHANGER_MAJOR 86
@@ -448,8 +555,9 @@ sname * sname_dup (sname * spnt)
 {
 	sname * spnt1 = malloc (sizeof (sname));
 	memcpy (spnt1, spnt, sizeof (sname));
+	spnt1->regd = 0;
 	spnt1->related = spnt; //spnt->related = spnt1;
-	//spnt1->next = reglist; reglist = spnt1;
+	//reg_add (spnt1);
 	return spnt1;
 }
 
@@ -464,6 +572,164 @@ int safe_strcmp (const char* str1, const char* str2)
 	else return strcmp (str1, str2);
 }
 
+/// qsort helper for arrays of pointers
+int cmp_ptr (const void *p1, const void *p2)
+{
+	const void * const *a = p1, * const *b = p2;
+	return (*a > *b) - (*a < *b);
+}
+
+/*************************** HASH TABLE ****************************/
+
+/* String keyed hash table with chaining; the keys are owned by the
+ * data. Grows when it gets too full. */
+struct hash_ent {
+	struct hash_ent *next;
+	const char *key;
+	void *data;
+};
+
+struct hash {
+	struct hash_ent **tbl;
+	unsigned int size, cnt;
+};
+
+unsigned int hash_str (const char *str)
+{
+	unsigned int h = 2166136261U;	/* FNV-1a */
+	while (*str)
+		h = (h ^ (unsigned char)*str++) * 16777619U;
+	return h;
+}
+
+void hash_init (struct hash *hash, unsigned int size)
+{
+	hash->size = size; hash->cnt = 0;
+	hash->tbl = calloc (size, sizeof (struct hash_ent*));
+}
+
+static void hash_grow (struct hash *hash)
+{
+	struct hash_ent **old = hash->tbl, *ent, *next;
+	unsigned int i, oldsize = hash->size, cnt = hash->cnt;
+	hash_init (hash, 2*oldsize);
+	hash->cnt = cnt;
+	for (i = 0; i < oldsize; ++i) {
+		for (ent = old[i]; ent; ent = next) {
+			struct hash_ent **slot = hash->tbl + hash_str (ent->key) % hash->size;
+			next = ent->next;
+			ent->next = *slot; *slot = ent;
+		}
+	}
+	free (old);
+}
+
+static struct hash_ent ** hash_slot (const struct hash *hash, const char *key)
+{
+	struct hash_ent **slot;
+	if (!hash->tbl)
+		return NULL;
+	slot = hash->tbl + hash_str (key) % hash->size;
+	while (*slot && strcmp ((*slot)->key, key))
+		slot = &(*slot)->next;
+	return slot;
+}
+
+void * hash_find (const struct hash *hash, const char *key)
+{
+	struct hash_ent **slot = hash_slot (hash, key);
+	return slot && *slot? (*slot)->data: NULL;
+}
+
+/* Add data under key; if key is there already, the old data
+ * is returned and nothing is changed */
+void * hash_add (struct hash *hash, const char *key, void *data)
+{
+	struct hash_ent **slot, *ent;
+	if (!hash->tbl)
+		hash_init (hash, 64);
+	slot = hash_slot (hash, key);
+	if (*slot)
+		return (*slot)->data;
+	ent = malloc (sizeof (struct hash_ent));
+	ent->key = key; ent->data = data; ent->next = NULL;
+	*slot = ent;
+	if (++hash->cnt > 2*hash->size)
+		hash_grow (hash);
+	return NULL;
+}
+
+/* Remove key, returns its data */
+void * hash_del (struct hash *hash, const char *key)
+{
+	struct hash_ent **slot = hash_slot (hash, key), *ent;
+	void *data;
+	if (!slot || !*slot)
+		return NULL;
+	ent = *slot; data = ent->data;
+	*slot = ent->next;
+	free (ent);
+	--hash->cnt;
+	return data;
+}
+
+/* Array with all data (in no particular order), to be freed by caller */
+void ** hash_list (const struct hash *hash)
+{
+	void **list = malloc ((hash->cnt + 1) * sizeof (void*));
+	struct hash_ent *ent;
+	unsigned int i, n = 0;
+	for (i = 0; i < hash->size; ++i)
+		for (ent = hash->tbl[i]; ent; ent = ent->next)
+			list[n++] = ent->data;
+	list[n] = NULL;
+	return list;
+}
+
+void hash_clear (struct hash *hash, void (*freedata)(void*))
+{
+	struct hash_ent *ent, *next;
+	unsigned int i;
+	for (i = 0; i < hash->size; ++i) {
+		for (ent = hash->tbl[i]; ent; ent = next) {
+			next = ent->next;
+			if (freedata)
+				freedata (ent->data);
+			free (ent);
+		}
+	}
+	free (hash->tbl);
+	hash->tbl = NULL; hash->size = hash->cnt = 0;
+}
+
+/// Designator lists
+int desigs_len (const char *desigs)
+{
+    const char *ptr = desigs;
+    if (!desigs)
+	return 0;
+    while (*ptr)
+	ptr += strlen (ptr) + 1;
+    return ptr - desigs;
+}
+
+int desigs_cmp (const char *d1, const char *d2)
+{
+    int ln = desigs_len (d1);
+    if (ln != desigs_len (d2))
+	return 1;
+    return ln && memcmp (d1, d2, ln);
+}
+
+/// Does the designator list contain desig?
+int desigs_has (const char *desigs, const char *desig)
+{
+    for (; desigs && *desigs; desigs += strlen (desigs) + 1)
+	if (!strcmp (desigs, desig))
+	    return 1;
+    return 0;
+}
+
 /// compare two sname entries
 char sname_cmp (sname *sp1, sname *sp2)
 {
@@ -485,9 +751,66 @@ char sname_cmp (sname *sp1, sname *sp2)
     if (safe_strcmp (sp1->serial, sp2->serial)) return 9;
     if (sp1->wwid != sp2->wwid) return 10;
     if (sp1->hsv_os_id != sp2->hsv_os_id) return 11;
+    if (desigs_cmp (sp1->desigs, sp2->desigs)) return 12;
     return 0;
 }
 
+/* Name index of everything on reglist (key: name without DEVSCSI) */
+struct hash regnames;
+
+static const char * reg_key (const sname *spnt)
+{
+    const int ln = strlen (DEVSCSI);
+    const char * ptr;
+    /* Relative to DEVSCSI, which may have subdirs (-H) */
+    if (!strncmp (spnt->name, DEVSCSI "/", ln + 1))
+	return spnt->name + ln + 1;
+    ptr = strrchr (spnt->name, '/');
+    return ptr? ptr + 1: spnt->name;
+}
+
+static void reg_index (sname * spnt)
+{
+    sname * other;
+    if (!spnt->name)
+	return;
+    other = hash_add (&regnames, reg_key (spnt), spnt);
+    if (other && other != spnt)
+	fprintf (stderr, "scsidev: Name collision: %s used for %s and %s\n",
+		 reg_key (spnt), other->oldname, spnt->oldname);
+}
+
+/// Put spnt on reglist and into the name index (once it has a name)
+void reg_add (sname * spnt)
+{
+    spnt->next = reglist; reglist = spnt;
+    spnt->regd = 1;
+    reg_index (spnt);
+}
+
+/// Remove spnt from the name index (before it's renamed or freed)
+void reg_unindex (sname * spnt)
+{
+    sname * other;
+    if (!spnt->name || hash_find (&regnames, reg_key (spnt)) != spnt)
+	return;
+    hash_del (&regnames, reg_key (spnt));
+    /* Rare: a colliding entry takes over the name */
+    for (other = reglist; other; other = other->next) {
+	if (other != spnt && other->regd && other->name
+	    && !strcmp (reg_key (other), reg_key (spnt))) {
+	    hash_add (&regnames, reg_key (other), other);
+	    break;
+	}
+    }
+}
+
+/// Return the registration for nm (the part behind DEVSCSI "/")
+sname * find_registered (const char *nm)
+{
+    return hash_find (&regnames, nm);
+}
+
 /// Used for alias registration 
 sname * register_dev (char * name, int major, int minor, enum devtype_t devtp,
 		      int hnum, int hid, int chan, int id,
@@ -506,7 +829,8 @@ sname * register_dev (char * name, int major, int minor, enum devtype_t devtp,
 	    spnt->oldname = strdup (oldname + 5);
 	else
 	    spnt->oldname = strdup (oldname);
-    }
+    } else
+	spnt->oldname = 0;
     spnt->partition = part;
     spnt->major = major;
     spnt->minor = minor;
@@ -520,22 +844,24 @@ sname * register_dev (char * name, int major, int minor, enum devtype_t devtp,
 	spnt->hostname = strdup (hostname); 
     else 
 	spnt->hostname = 0;
+    spnt->shorthostname = 0;
     spnt->alias = alias;
     spnt->related = rel;
     /*
      * Initialize this - they may be needed later.
      */
     spnt->model = spnt->manufacturer = spnt->serial = spnt->rev = NULL;
-    spnt->wwid = no_wwid;
+    spnt->wwid = no_wwid; spnt->desigs = NULL;
     spnt->hsv_os_id = no_hsv_os_id;
-    spnt->next = reglist; reglist = spnt;
+    spnt->aliasrule = 0;
+    reg_add (spnt);
     return spnt;
 }
 
 // Creates a /dev/scsi name from the info in sname
 char * scsiname (sname *spnt)
 {
-    char nm[64]; char *genpart;
+    char nm[96]; char *genpart;
     char app[8];
     char *dnm = 0;
     enum devtype_t tp = spnt->devtp;
@@ -573,6 +899,13 @@ char * scsiname (sname *spnt)
 		     spnt->major);
 	    abort ();
     }
+    /* -H: Subdir per host or per type */
+    if (shard == SHARD_HOST && nm_cbtu)
+	sprintf (nm + strlen (nm), "c%d/", spnt->hostnum);
+    else if (shard == SHARD_HOST)
+	sprintf (nm + strlen (nm), "h%d-%x/", spnt->hostnum, spnt->hostid);
+    else if (shard == SHARD_TYPE)
+	sprintf (nm + strlen (nm), "%s/", devtp_shard[tp]);
     strcat (nm, dnm);
     genpart = nm + strlen (nm);
     if (nm_cbtu) 
@@ -585,7 +918,12 @@ char * scsiname (sname *spnt)
 		 spnt->chan, spnt->id, spnt->lun);
     if (*app) 
 	strcat (genpart, app);
+    /* Keep the name index up to date if it's registered already */
+    if (spnt->regd)
+	reg_unindex (spnt);
     spnt->name = strdup (nm);
+    if (spnt->regd)
+	reg_index (spnt);
     return spnt->name;
 }
 
@@ -696,2227 +1034,6427 @@ void oldscsiname (sname *spnt)
 }
 
 
+/*************************** IO_URING ****************************/
+
+/* Optional backend for the metadata operations on DEVSCSI (--io-uring):
+ * Independent operations are queued to an io_uring and submitted in
+ * batches with one syscall. Only used for the opcodes the kernel has;
+ * mknod, chown and chmod have none and are always done synchronously.
+ * Raw syscalls, no liburing needed. */
+int use_uring = 0;
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(SYS_io_uring_setup)	/* { */
+#define URING_ENTRIES 256
+
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned queued;	/* not yet submitted */
+	unsigned inflight;	/* not yet completed */
+	unsigned char ops[IORING_OP_LAST];	/* supported opcodes */
+};
+
+struct uring ring = { -1, };
+
+/* Set up the ring; returns 0 if it can be used */
+int uring_open ()
+{
+	struct io_uring_params p;
+	struct io_uring_probe *probe;
+	size_t sqsz, cqsz, sqesz, probesz;
+	char *sq, *cq = MAP_FAILED;
+	int i;
+
+	if (ring.fd >= 0)
+		return 0;
+	memset (&p, 0, sizeof (p));
+	ring.fd = syscall (SYS_io_uring_setup, URING_ENTRIES, &p);
+	if (ring.fd < 0)
+		return -1;
+	sqsz = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	cqsz = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sqsz = cqsz = sqsz > cqsz? sqsz: cqsz;
+	sq = mmap (0, sqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		   ring.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else
+		cq = mmap (0, cqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			   ring.fd, IORING_OFF_CQ_RING);
+	if (cq == MAP_FAILED)
+		goto fail_sq;
+	sqesz = p.sq_entries * sizeof (struct io_uring_sqe);
+	ring.sqes = mmap (0, sqesz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		goto fail_cq;
+	ring.sq_head  = (unsigned *) (sq + p.sq_off.head);
+	ring.sq_tail  = (unsigned *) (sq + p.sq_off.tail);
+	ring.sq_mask  = (unsigned *) (sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *) (sq + p.sq_off.array);
+	ring.cq_head  = (unsigned *) (cq + p.cq_off.head);
+	ring.cq_tail  = (unsigned *) (cq + p.cq_off.tail);
+	ring.cq_mask  = (unsigned *) (cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	/* Which of our opcodes does the kernel know? */
+	probesz = sizeof (*probe) + IORING_OP_LAST * sizeof (struct io_uring_probe_op);
+	probe = malloc (probesz);
+	memset (probe, 0, probesz);
+	if (!syscall (SYS_io_uring_register, ring.fd, IORING_REGISTER_PROBE,
+		      probe, IORING_OP_LAST))
+		for (i = 0; i < probe->ops_len && i < IORING_OP_LAST; ++i)
+			ring.ops[i] = !!(probe->ops[i].flags & IO_URING_OP_SUPPORTED);
+	free (probe);
+	return 0;
+ fail_cq:
+	if (cq != sq)
+		munmap (cq, cqsz);
+ fail_sq:
+	munmap (sq, sqsz);
+ fail:
+	close (ring.fd);
+	ring.fd = -1;
+	return -1;
+}
+
+/* Can opcode op be used? */
+int uring_has (int op)
+{
+	if (use_uring && uring_open ()) {
+		if (verbose)
+			fprintf (stderr, "scsidev: no io_uring (%s), using syscalls\n",
+				 strerror (errno));
+		use_uring = 0;
+	}
+	return use_uring && op < IORING_OP_LAST && ring.ops[op];
+}
+
+/* Submit the queued entries and wait for (and handle) all completions */
+void uring_flush (void (*done) (void *data, int res))
+{
+	while (ring.inflight) {
+		unsigned head, tail;
+		int n = syscall (SYS_io_uring_enter, ring.fd, ring.queued, 1,
+				 IORING_ENTER_GETEVENTS, NULL, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror ("scsidev: io_uring_enter");
+			exit (1);
+		}
+		ring.queued -= n;
+		head = *ring.cq_head;
+		tail = __atomic_load_n (ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head, --ring.inflight) {
+			struct io_uring_cqe *cqe = ring.cqes + (head & *ring.cq_mask);
+			done ((void *) (unsigned long) cqe->user_data, cqe->res);
+		}
+		__atomic_store_n (ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+/* Get a cleared submission queue entry, flushing when the ring is full */
+struct io_uring_sqe * uring_get (void *data, void (*done) (void *data, int res))
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail = *ring.sq_tail, idx;
+	if (ring.inflight >= URING_ENTRIES) {
+		uring_flush (done);
+		tail = *ring.sq_tail;
+	}
+	idx = tail & *ring.sq_mask;
+	sqe = ring.sqes + idx;
+	memset (sqe, 0, sizeof (*sqe));
+	sqe->user_data = (unsigned long) data;
+	ring.sq_array[idx] = idx;
+	__atomic_store_n (ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++ring.queued; ++ring.inflight;
+	return sqe;
+}
+#else						/* }{ */
+int uring_has (int op)
+{
+	return 0;
+}
+
+void uring_flush (void (*done) (void *data, int res))
+{
+}
+#endif						/* } */
+
+
 /*************************** PERMISSIONS ****************************/
 
-/** Helper to copy perms */
-inline void cp_perm (struct stat *to, const struct stat *from)
+/* Snapshot of what's in DEVSCSI: Read in once and then kept up to
+ * date with our own changes, so we don't stat every node several times.
+ * Invalidated when we (re)gain the run lock. */
+struct devnode {
+	char *name;
+	struct stat st;		/* lstat */
+	char *linkto;		/* symlinks only */
+	char unverified;	/* from INVENTORY, perms may be outdated */
+	char claimed;		/* (re)created for a device in this run */
+};
+
+struct hash devnodes;
+int devnodes_valid = 0;
+
+/* Read the DEVSCSI entries through devscsi_fd */
+DIR * devscsi_opendir (const char *sub)
 {
-	to->st_uid  = from->st_uid;
-	to->st_gid  = from->st_gid;
-	to->st_mode = from->st_mode & ~S_IFMT;
+	int fd = openat (devscsi_fd, sub? sub: ".", O_RDONLY | O_DIRECTORY);
+	return fd < 0? NULL: fdopendir (fd);
 }
 
-/** Helper to apply perms */
-inline void apply_perm (const char* nm, const struct stat *st, int fmode)
+int group_known (const char *nm);
+
+/* Is nm a subdir created by -H (in either layout)? */
+int is_hshard_dir (const char *nm)
 {
-	chown (nm, st->st_uid, st->st_gid);
-	chmod (nm, st->st_mode | fmode);
+	unsigned int h, hid;
+	int i, n = 0;
+	if ((sscanf (nm, "h%u-%x%n", &h, &hid, &n) == 2 
+	     || sscanf (nm, "c%u%n", &h, &n) == 1) && !nm[n])
+		return 1;
+	for (i = SG; i <= SCH; ++i)
+		if (!strcmp (nm, devtp_shard[i]))
+			return 1;
+	return 0;
 }
 
-/** Helper to compare perms */
-inline int cmp_perm (const struct stat *p1, const struct stat *p2)
+/* Is nm a subdir created by -H or for a group alias? We only look 
+ * into (and remove) those. */
+int is_shard_dir (const char *nm)
 {
-	return (p1->st_uid  != p2->st_uid ||
-		p1->st_gid  != p2->st_gid ||
-		(p1->st_mode & ~S_IFMT) != (p2->st_mode & ~S_IFMT));
+	return is_hshard_dir (nm) || group_known (nm);
 }
 
-/* Construct .shadow. name */
-void mk_shadow_nm (char* buf, const char* nm)
+void node_free (void *data)
 {
-	const char *ptr = strrchr (nm, '/');
-	*buf = 0;
-	if (ptr) {
-		memcpy (buf, nm, ptr-nm+1);
-		buf[ptr-nm+1] = 0;
-	} else
-		ptr = nm;
-	strcat (buf, SHADOW);
-	strcat (buf, ++ptr);
+	struct devnode *node = data;
+	free (node->name);
+	free (node->linkto);
+	free (node);
 }
 
+void nodeloc_drop ();
 
-/** Make .shadow. file for backing up permissions */
-void backup_shadow (const char* nm, struct stat *stbuf)
+void snap_drop ()
 {
-	struct stat statbuf;
-	char shadow[64];
-	int status;
-	mk_shadow_nm (shadow, nm);
-	
-	status = stat (shadow, &statbuf);
-	if (!status && !cmp_perm (&statbuf, stbuf))
-		return;
-	
-	if (status) {
-		int fd = open (shadow, O_RDWR | O_CREAT | O_EXCL);
-		close (fd);
+	hash_clear (&devnodes, node_free);
+	devnodes_valid = 0;
+	nodeloc_drop ();
+}
+
+/* Register a node (replacing an old entry) */
+struct devnode * node_put (const char *nm, const struct stat *st, const char *linkto)
+{
+	struct devnode *node = hash_del (&devnodes, nm);
+	if (node)
+		node_free (node);
+	node = malloc (sizeof (struct devnode));
+	node->name = strdup (nm);
+	node->st = *st;
+	node->linkto = linkto? strdup (linkto): NULL;
+	node->unverified = 0;
+	node->claimed = 0;
+	hash_add (&devnodes, node->name, node);
+	return node;
+}
+
+/* Make sure the perms of node are current */
+struct devnode * node_verify (struct devnode *node)
+{
+	struct stat st;
+	if (node && node->unverified) {
+		if (!fstatat (devscsi_fd, node->name, &st, AT_SYMLINK_NOFOLLOW))
+			node->st = st;
+		node->unverified = 0;
 	}
-	apply_perm (shadow, stbuf, 0);
+	return node;
 }
 
-/** Remove the shadow file */
-void rm_shadow (const char *nm)
+/* Inventory: At the end of a run, the snapshot of DEVSCSI and the
+ * registered devices are saved to INVENTORY, together with the inode and
+ * mtime of DEVSCSI. If those still match next time, the snapshot is 
+ * taken from there instead of reading and stat'ing DEVSCSI. The nodes' 
+ * permissions may have been changed by others though, so they are 
+ * only stat'ed (node_verify) when we need their permissions. 
+ * The registrations of the last run are used for reporting changes
+ * and, with the signatures of the alias rules they were made with, for
+ * re-evaluating a changed alias file (inv_restore, alias_update). */
+struct invreg {
+	char *name;
+	char *ident;
+	int seq;		/* order on reglist */
+};
+
+struct hash lastregs;
+/* Signatures (%08x) of the alias rules: in INVENTORY, evaluated */
+struct hash lastrules, evalrules;
+
+void invreg_free (void *data)
 {
-	char shadow[64];
-	int fd;
-	mk_shadow_nm (shadow, nm);
-	fd = open (shadow, O_RDONLY);
-	if (fd > 0) {
-		close (fd);
-		unlink (shadow);
+	struct invreg *reg = data;
+	free (reg->name);
+	free (reg->ident);
+	free (reg);
+}
+
+/* Identity of a registered device as stored in INVENTORY (malloc'ed);
+ * it has all that's needed to match aliases against it (see inv_restore) */
+char * inv_ident (const sname *spnt)
+{
+	char *buf = NULL, *ptr;
+	size_t len;
+	FILE *f = open_memstream (&buf, &len);
+	if (!f)
+		return strdup ("");
+	fprintf (f, "%s\t%c%03x:%05x\t%d:%d:%d:%d\t%d\t%Lx\t%s\t%s\t%s\t%s"
+		  "\t%x\t%d\t%s\t%s\t%s\t",
+		  devtp_nm[(int)spnt->devtp], isblk (spnt->devtp)? 'b': 'c',
+		  spnt->major, spnt->minor, spnt->hostnum, spnt->chan, 
+		  spnt->id, spnt->lun, spnt->partition, spnt->wwid,
+		  spnt->manufacturer? spnt->manufacturer: "",
+		  spnt->model? spnt->model: "", spnt->rev? spnt->rev: "",
+		  spnt->serial && spnt->serial != no_serial? spnt->serial: "",
+		  spnt->hostid, spnt->hsv_os_id, 
+		  spnt->shorthostname? spnt->shorthostname: "",
+		  spnt->hostname? spnt->hostname: "", 
+		  spnt->oldname? spnt->oldname: "");
+	if (spnt->alias)
+		fprintf (f, "%08x", spnt->aliasrule);
+	for (ptr = spnt->desigs; ptr && *ptr; ptr += strlen (ptr) + 1)
+		fprintf (f, "\t%s", ptr);
+	fclose (f);
+	for (ptr = buf; *ptr; ++ptr)
+		if (*ptr == '\n')
+			*ptr = ' ';
+	return buf;
+}
+
+/* Split tab separated fields */
+static int inv_split (char *ln, char **fld, int maxfld)
+{
+	int n = 0;
+	ln[strcspn (ln, "\n")] = 0;
+	while (ln && n < maxfld)
+		fld[n++] = strsep (&ln, "\t");
+	return n;
+}
+
+/* Read INVENTORY; returns 0 if the nodes could be taken from it */
+int inv_load ()
+{
+	char *ln = NULL;
+	size_t lnsz = 0;
+	struct stat dst;
+	int valid = 0;
+	FILE *f;
+
+	hash_clear (&lastregs, invreg_free);
+	hash_clear (&lastrules, free);
+	f = fopen (INVENTORY, "r");
+	if (!f)
+		return -1;
+	if (fstat (devscsi_fd, &dst)) {
+		fclose (f);
+		return -1;
+	}
+	while (getline (&ln, &lnsz, f) > 0) {
+		char *fld[8];
+		int n;
+		if (!strncmp (ln, "R\t", 2)) {
+			/* The identity is the rest of the line */
+			struct invreg *reg;
+			char *ident = strchr (ln + 2, '\t');
+			if (!ident)
+				continue;
+			*ident++ = 0;
+			ident[strcspn (ident, "\n")] = 0;
+			reg = malloc (sizeof (struct invreg));
+			reg->name = strdup (ln + 2);
+			reg->ident = strdup (ident);
+			reg->seq = lastregs.cnt;
+			if (hash_add (&lastregs, reg->name, reg))
+				invreg_free (reg);
+			continue;
+		}
+		n = inv_split (ln, fld, 8);
+		if (*fld[0] == 'A' && n == 2) {
+			char *sig = strdup (fld[1]);
+			if (hash_add (&lastrules, sig, sig))
+				free (sig);
+		} else if (*fld[0] == 'D' && n == 4)
+			valid = strtoull (fld[1], 0, 10) == dst.st_ino
+				&& strtoll (fld[2], 0, 10) == dst.st_mtim.tv_sec
+				&& strtol (fld[3], 0, 10) == dst.st_mtim.tv_nsec;
+		else if (*fld[0] == 'S' && n == 5 && valid)
+			valid = !fstatat (devscsi_fd, fld[1], &dst, 0)
+				&& strtoull (fld[2], 0, 10) == dst.st_ino
+				&& strtoll (fld[3], 0, 10) == dst.st_mtim.tv_sec
+				&& strtol (fld[4], 0, 10) == dst.st_mtim.tv_nsec;
+		else if (*fld[0] == 'N' && n >= 6 && valid) {
+			struct stat st;
+			struct devnode *node;
+			memset (&st, 0, sizeof (st));
+			st.st_mode = strtoul (fld[2], 0, 8);
+			st.st_rdev = strtoull (fld[3], 0, 16);
+			st.st_uid = strtoul (fld[4], 0, 10);
+			st.st_gid = strtoul (fld[5], 0, 10);
+			node = node_put (fld[1], &st, n > 6 && *fld[6]? fld[6]: NULL);
+			node->unverified = 1;
+		}
 	}
+	free (ln);
+	fclose (f);
+	return valid? 0: -1;
 }
 
-/** Get permissions
- * Permissions:
- * (a) old permissions of nm (if it's not a symlink)
- * (b) permissions of shadow file
- * (c) permissions of file pointed to
- * (d) (new) filemode
- */
-void get_perm (const char *nm, const char *linkto, struct stat * stbuf, int cdrom)
+/* Write INVENTORY (after the plan has been applied) */
+void inv_save ()
 {
-	int status;
-	struct stat statbuf;
-	char shadow[64];
-	
-	status = lstat (nm, &statbuf);
-	if (!status && !S_ISLNK (statbuf.st_mode)) {
-		cp_perm (stbuf, &statbuf);
+	struct devnode ** nodes, ** np;
+	struct stat dst;
+	char *ident;
+	char ** sigs, ** sp;
+	sname * spnt;
+	FILE *f;
+
+	if (dry_run || !devnodes_valid || fstat (devscsi_fd, &dst))
 		return;
-	}
-	
-	mk_shadow_nm (shadow, nm);
-	//printf ("%s\n", shadow);
-	status = stat (shadow, &statbuf);
-	
-	if (!status) {
-		cp_perm (stbuf, &statbuf);
+	mkdir (STATEDIR, 0755);
+	f = fopen (INVENTORY ".new", "w");
+	if (!f) {
+		perror ("scsidev: can't write " INVENTORY);
 		return;
 	}
-	
-	if (linkto) {
-		status = stat (linkto, &statbuf);
-		if (!status) {
-			cp_perm (stbuf, &statbuf);
-			return;
+	fprintf (f, "# scsidev inventory of " DEVSCSI "\n");
+	fprintf (f, "D\t%llu\t%lld\t%ld\n", (unsigned long long) dst.st_ino,
+		 (long long) dst.st_mtim.tv_sec, (long) dst.st_mtim.tv_nsec);
+	nodes = (struct devnode **) hash_list (&devnodes);
+	/* The subdirs (-H) need to be unchanged as well */
+	for (np = nodes; *np; ++np)
+		if (S_ISDIR ((*np)->st.st_mode) && is_shard_dir ((*np)->name)
+		    && !fstatat (devscsi_fd, (*np)->name, &dst, 0))
+			fprintf (f, "S\t%s\t%llu\t%lld\t%ld\n", (*np)->name,
+				 (unsigned long long) dst.st_ino,
+				 (long long) dst.st_mtim.tv_sec, 
+				 (long) dst.st_mtim.tv_nsec);
+	for (np = nodes; *np; ++np)
+		fprintf (f, "N\t%s\t%o\t%llx\t%u\t%u\t%s\n", (*np)->name,
+			 (unsigned) (*np)->st.st_mode, 
+			 (unsigned long long) (*np)->st.st_rdev,
+			 (unsigned) (*np)->st.st_uid, (unsigned) (*np)->st.st_gid,
+			 (*np)->linkto? (*np)->linkto: "");
+	free (nodes);
+	if (reglist_full) {
+		for (spnt = reglist; spnt; spnt = spnt->next) {
+			if (!spnt->name || !spnt->regd)
+				continue;
+			ident = inv_ident (spnt);
+			fprintf (f, "R\t%s\t%s\n", reg_key (spnt), ident);
+			free (ident);
 		}
+	} else {
+		/* -D, -R: Only some devices were looked at */
+		struct invreg ** regs = (struct invreg **) hash_list (&lastregs), ** rp;
+		for (rp = regs; *rp; ++rp)
+			fprintf (f, "R\t%s\t%s\n", (*rp)->name, (*rp)->ident);
+		free (regs);
+	}
+	sigs = (char **) hash_list (&evalrules);
+	for (sp = sigs; *sp; ++sp)
+		fprintf (f, "A\t%s\n", *sp);
+	free (sigs);
+	if (fclose (f) || rename (INVENTORY ".new", INVENTORY)) {
+		perror ("scsidev: can't write " INVENTORY);
+		unlink (INVENTORY ".new");
 	}
-	
-	stbuf->st_uid = 0;
-	stbuf->st_gid = 0;
-	stbuf->st_mode = filemode;
-	if (cdrom)
-		stbuf->st_mode &= ~0222;
 }
-	
 
-/**
- * Check to see if a given entry exists.  If not, create it,
- * if it does make sure the major and minor numbers are correct
- * and save permissions and ownerships (in the .shadow. file) 
- * if this is the case.
- */
-void update_device (char* linkto, char * path, int fmode, int major, int minor)
+/* Add a node we stat'ed to the snapshot */
+static void snap_add (const char *nm, const struct stat *st)
 {
-	struct stat statbuf, statbuf2;
-	int recreate;
-	int newmode;
-	int status;
-
-	recreate = 0;
-	get_perm (path, linkto, &statbuf2, (major == SCSI_CDROM_MAJOR));
-	
-	newmode = fmode | statbuf2.st_mode;
-	
-	status = lstat (path, &statbuf);
-	if (status || S_ISLNK (statbuf.st_mode))
-		++recreate;
-	else if (statbuf.st_rdev != makedev (major, minor))
-		++recreate;
-	else if ((statbuf.st_mode & S_IFMT) != (fmode & S_IFMT))
-		++recreate;
-	/* Don't test permissions here, just set them later */
-	if (recreate) {
-		if (!status)
-			unlink (path);
-		status = mknod (path, newmode, makedev (major, minor));
-		//printf("Recreate maj %i min %i\n", major, minor);
-		if( status == -1 ) {
-			fprintf (stderr, "mknod (%s) failed\n", path);
-			exit (1);
-		}
-		apply_perm (path, &statbuf2, fmode);
-	} else 
-		if (cmp_perm (&statbuf, &statbuf2))
-			apply_perm (path, &statbuf2, fmode);
-	rm_shadow (path);
+	char linkto[PATH_MAX];
+	int n;
+	if (S_ISLNK (st->st_mode)) {
+		n = readlinkat (devscsi_fd, nm, linkto, PATH_MAX-1);
+		linkto[n > 0? n: 0] = 0;
+	}
+	node_put (nm, st, S_ISLNK (st->st_mode)? linkto: NULL);
 }
 
-/** Create a symlink to the real dev */
-void create_symlink (const char *linkto, const char* nm, int fmode, int major, int minor)
+#if defined(HAVE_LINUX_IO_URING_H) && defined(SYS_io_uring_setup)	/* { */
+struct snapent {
+	char *name;
+	struct statx stx;
+};
+
+static void snap_done (void *data, int res)
 {
-	struct stat statbuf;
-	struct stat statbuf2;
-	int status;
-	int recreate = 0;
-	
-	if (!quiet) 
-    		printf ("create_symlink(%s, %s, %o, %03x, %05x)\n",
-		        linkto, nm, fmode, major, minor);
-	get_perm (nm, linkto, &statbuf2, (major == SCSI_CDROM_MAJOR));
-	
-	status = lstat (nm, &statbuf);
-	if (status || !S_ISLNK (statbuf.st_mode))
-		++recreate;
-	else {
-		char realnm[64];
-		int n = readlink (nm, realnm, 63);
-		if (n != -1) {
-			realnm[n] = 0;
-			if (strcmp (linkto, realnm))
-				++recreate;
-		} else
-			++recreate;
+	struct snapent *ent = data;
+	struct stat st;
+	if (!res) {
+		memset (&st, 0, sizeof (st));
+		st.st_mode = ent->stx.stx_mode;
+		st.st_ino  = ent->stx.stx_ino;
+		st.st_uid  = ent->stx.stx_uid;
+		st.st_gid  = ent->stx.stx_gid;
+		st.st_rdev = makedev (ent->stx.stx_rdev_major, ent->stx.stx_rdev_minor);
+		snap_add (ent->name, &st);
 	}
-	
-	if (recreate) {
-		if (!status)
-			unlink (nm);
-		symlink (linkto, nm);
-	}
-	
-	/*
-	 * Now make sure that the device the symlink points to 
-	 * actually exists.  If not, then create that device.
-	 */
-	
-	status = stat (linkto, &statbuf);
-	if (status) {
-		int newmode = statbuf2.st_mode | fmode;
-		status = mknod (linkto, newmode,
-				makedev (major, minor));
-		fprintf (stderr, "Creating %s\n", linkto);
-		apply_perm (linkto, &statbuf2, fmode);
-	} else {
-		if (statbuf.st_rdev != makedev (major, minor)) {
-			fprintf (stderr, "scsidev: Inconsistency %s == %03x:%05x != %03x:%05x\n",
-				 linkto, major(statbuf.st_rdev), minor(statbuf.st_rdev),
-				 major, minor);
-			abort ();
-		}
-		if (cmp_perm (&statbuf, &statbuf2) && override_link_perm)
-			apply_perm (linkto, &statbuf2, fmode);
-	}
-	if (0 && override_link_perm)
-		rm_shadow (nm);
-	else
-		backup_shadow (nm, &statbuf2);
-}
-
-/** Create device node by making symlink or calling update_device() */
-void create_dev (sname *spnt, char symlink)
-{
-	char linkto[64];
-	int devtype = isblk (spnt->devtp)? S_IFBLK: S_IFCHR;;
-	strcpy (linkto, "/dev/");
-	strcat (linkto, spnt->oldname);
-	
-	if (symlink)
-		create_symlink (linkto, spnt->name, devtype, spnt->major, spnt->minor);
-	else
-		update_device (linkto, spnt->name, devtype, spnt->major, spnt->minor);
+	free (ent->name);
+	free (ent);
 }
 
-
-/*
- * We need to "fix" any device nodes that are currently not used because
- * it is a security risk to leave these laying around.  These are fixed
- * by storing a shadow file.  If these become active again,
- * we will be able to use them again because the minor number will be
- * set back again, and we are preserving the ownership and permissions.
- */
-void sanitize_sdev ()
+/* statx all entries through the ring */
+static void snap_load_uring (DIR *sdir, const char *prefix)
 {
-    struct dirent * de;
-    char filename[64];
-    DIR * sdir;
-    sname * spnt;
-    int status;
-
-    /*
-     * Next, delete all of the existing entries in the /dev/scsi directory.
-     * The idea is that if we have added/removed devices, the numbers might have
-     * changed.
-     */
-    sdir = opendir (DEVSCSI);
-    while (1) {
-	de = readdir (sdir);
-	if (de == NULL) 
-	    break;
-	if (*de->d_name == '.')
-	    continue;
-	/* If it's a .shadow. name, leave it alone */
-	//if (strlen (de->d_name) >= strlen (SHADOW) && !strcmp (de->d_name, SHADOW))
-	//    continue;
-	/*
-	 * OK, we have the name.  See whether this is something
-	 * we know about already.
-	 */
-	for( spnt = reglist; spnt; spnt = spnt->next ) {
-	    if( strcmp(de->d_name, strrchr (spnt->name, '/') + 1) == 0 )
-		break;
-	}
-	/* Didn't we find it? */
-	if (spnt == NULL) {
-	    struct stat statbuf;
-	    strcpy (filename, DEVSCSI); strcat (filename, "/");
-	    strcat (filename, de->d_name);
-	    status = stat (filename, &statbuf);
-	    if ( status == 0 && (S_ISLNK (statbuf.st_mode) ||
-				 S_ISCHR (statbuf.st_mode) || 
-				 S_ISBLK (statbuf.st_mode)) ) {
-		/*
-		 * OK, this one is something new that we have to do something
-		 * with.  No big deal, stat it so we get the particulars, then
-		 * create a new one with a safe minor number.
-		 */
-		unlink (filename);
-		if (!san_del)
-			backup_shadow (filename, &statbuf);
-	    }
+	struct dirent * de;
+	while ((de = readdir (sdir)) != NULL) {
+		struct io_uring_sqe *sqe;
+		struct snapent *ent;
+		if (!strcmp (de->d_name, ".") || !strcmp (de->d_name, ".."))
+			continue;
+		ent = malloc (sizeof (struct snapent));
+		ent->name = malloc (strlen (prefix) + strlen (de->d_name) + 1);
+		strcat (strcpy (ent->name, prefix), de->d_name);
+		sqe = uring_get (ent, snap_done);
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = devscsi_fd;
+		sqe->addr = (unsigned long) ent->name;
+		sqe->len = STATX_BASIC_STATS;
+		sqe->off = (unsigned long) &ent->stx;
+		sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
 	}
-    }
-    closedir (sdir);
+	uring_flush (snap_done);
 }
+#endif						/* } */
 
-
-/*
- * Next, delete all of the existing entries in the /dev/scsi directory.
- * The idea is that if we have added/removed devices, the numbers might have
- * changed.
- */
-void flush_sdev ()
+/* Read the entries of DEVSCSI or its subdir sub */
+static void snap_read_dir (const char *sub)
 {
 	struct dirent * de;
-	char filename[60];
-	struct stat stbuf; 
-	DIR * sdir;
-	
-	sdir = opendir (DEVSCSI);
-	while (1) {
-		de = readdir (sdir);
-		if (de == NULL) 
-			break;
-		if (de->d_name[0] == '.')
+	char prefix[NAME_MAX + 2] = "";
+	char nm[2 * NAME_MAX + 2];
+	DIR * sdir = devscsi_opendir (sub);
+	if (!sdir)
+		return;
+	if (sub)
+		snprintf (prefix, sizeof (prefix), "%s/", sub);
+#if defined(HAVE_LINUX_IO_URING_H) && defined(SYS_io_uring_setup)
+	if (uring_has (IORING_OP_STATX))
+		snap_load_uring (sdir, prefix);
+	else
+#endif
+	while ((de = readdir (sdir)) != NULL) {
+		struct stat st;
+		if (!strcmp (de->d_name, ".") || !strcmp (de->d_name, ".."))
 			continue;
-		//if (strlen (de->d_name >= strlen(SHADOW) && !strcmp (de->d_name+i, SHADOW))
-		//	continue;
-		//if (de->d_name[0] != 's' && de->d_name[0] != 'n') continue;
-		strcpy (filename, DEVSCSI); strcat (filename, "/");
-		strcat (filename, de->d_name);
-		stat (filename, &stbuf);
-		unlink (filename);
-		backup_shadow (filename, &stbuf);
+		if (fstatat (dirfd (sdir), de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+			continue;
+		snprintf (nm, sizeof (nm), "%s%s", prefix, de->d_name);
+		snap_add (nm, &st);
 	}
 	closedir (sdir);
-	if (!quiet) 
-		printf ("Flushed old " DEVSCSI " entries...\n");
-	
 }
 
-
-/** Remove trailing whitespace */
-int inline rmv_trail_ws (char* str)
+/* Read DEVSCSI (if not done already) */
+void snap_load ()
 {
-	int i = strlen (str);
-	int n = 0;
-	while (--i >= 0 && (str[i] == ' ' || str[i] == '\t' || str[i] == '\n'))
-		n++;
-	str[i+1] = 0;
-	return n;
+	struct devnode ** nodes, ** np;
+	if (devnodes_valid)
+		return;
+	devnodes_valid = 1;
+	if (!inv_load ()) {
+		if (verbose >= 2)
+			printf ("Took %i entries from " INVENTORY "\n", devnodes.cnt);
+		return;
+	}
+	snap_read_dir (NULL);
+	/* and the subdirs of -H */
+	nodes = (struct devnode **) hash_list (&devnodes);
+	for (np = nodes; *np; ++np)
+		if (S_ISDIR ((*np)->st.st_mode) && is_shard_dir ((*np)->name))
+			snap_read_dir ((*np)->name);
+	free (nodes);
+	if (verbose >= 2)
+		printf ("Read %i entries from " DEVSCSI "\n", devnodes.cnt);
 }
 
-/** Use ioctl to get hostnum, channel, id, lun tuple and hostid (ioport) */
-int getidlun (int fd, sname *spnt, int setidlun)
+/* Report what changed since the last run */
+void inv_report ()
 {
-	int status;
-	int id[2];
+	char *ident;
+	struct invreg ** regs, ** rp;
+	sname * spnt;
+	int nnew = 0, nchg = 0, ngone = 0;
 
-	id[0] = 0; id[1] = 0;
-	status = ioctl (fd, SCSI_IOCTL_GET_IDLUN, &id);
-	
-	if (status == -1)	{
-		if (verbose == 2)
-			fprintf (stderr, "idlun(%03x:%05x) returned %d (%d)\n",
-				 spnt->major, spnt->minor, status, errno);
-		close (fd);
-		return -2;
+	snap_load ();
+	for (spnt = reglist; spnt; spnt = spnt->next) {
+		struct invreg *reg;
+		if (!spnt->name || !spnt->regd)
+			continue;
+		reg = hash_find (&lastregs, reg_key (spnt));
+		ident = inv_ident (spnt);
+		if (!reg) {
+			printf ("New: %s\n", reg_key (spnt));
+			++nnew;
+		} else if (strcmp (reg->ident, ident)) {
+			printf ("Changed: %s\n", reg_key (spnt));
+			++nchg;
+		}
+		free (ident);
 	}
-	
-	if (setidlun) {
-		/* This unfortunately limits all the numbers to be <= 255 */
-		spnt->hostnum = id[0] >> 24 & 0xff;
-		spnt->chan    = id[0] >> 16 & 0xff;
-		spnt->lun     = id[0] >>  8 & 0xff;
-		spnt->id      = id[0]       & 0xff;
+	regs = (struct invreg **) hash_list (&lastregs);
+	for (rp = regs; *rp; ++rp) {
+		if (!find_registered ((*rp)->name)) {
+			printf ("Gone: %s\n", (*rp)->name);
+			++ngone;
+		}
 	}
-	spnt->hostid  = id[1];
-	
-	if (verbose == 2)
-		fprintf (stderr, "Found %03x:%05x with idlun %08x\n", 
-			 spnt->major, spnt->minor, id[0]);
+	free (regs);
+	printf ("Since last run: %i new, %i changed, %i gone\n", nnew, nchg, ngone);
+}
 
-	return status;
+static int invreg_seqcmp (const void *p1, const void *p2)
+{
+	return (*(struct invreg * const *) p2)->seq 
+		- (*(struct invreg * const *) p1)->seq;
 }
 
+static char * inv_str (const char *str)
+{
+	return *str? strdup (str): NULL;
+}
 
-/** Get long scsi host adapter name by ioctl */
-int getscsihostname (int fd, sname *spnt)
+/* Register the devices and aliases of the last run again from their
+ * identity in INVENTORY, without talking to them. Returns -1 if 
+ * there is nothing to restore or INVENTORY is from an older version. */
+int inv_restore ()
 {
-	int status;
-	char hostname[160];
-	*(int*)hostname = 159;
-	status = ioctl (fd, SCSI_IOCTL_PROBE_HOST, hostname);
-	hostname[159] = '\0';
-	
-	if (status == -1)	{
-		if (verbose == 2)
-			fprintf (stderr, "probe host (%03x:%05x) returned %d (%d)\n",
-				 spnt->major, spnt->minor, status, errno);
-		spnt->hostname = 0;
+	/* The oldname of an alias is its device relative to /dev */
+	const char *pfx = DEVSCSI "/" + 5;
+	const int ln = strlen (pfx);
+	struct invreg ** regs, ** rp;
+	char **fld, *ident, *ptr, scsidev[PATH_MAX];
+	char **sigs, **sp, *sig;
+	int pass, n, i, len, tp, major, minor, hnum, chan, id, lun;
+	sname * spnt, * match;
+
+	if (!lastregs.cnt)
 		return -1;
+	/* 15 fields and the designators; anything else is not ours */
+	regs = (struct invreg **) hash_list (&lastregs);
+	for (rp = regs; *rp; ++rp) {
+		for (n = 1, ptr = (*rp)->ident; *ptr; ++ptr)
+			n += *ptr == '\t';
+		if (n < 15) {
+			free (regs);
+			return -1;
+		}
 	}
-	spnt->hostname = hostname? strdup (hostname): 0;
-	rmv_trail_ws (spnt->hostname);
-	return status;
+	/* reglist is built backwards */
+	qsort (regs, lastregs.cnt, sizeof (struct invreg *), invreg_seqcmp);
+	/* The devices first, the aliases refer to them */
+	for (pass = 0; pass < 2; ++pass) {
+		for (rp = regs; *rp; ++rp) {
+			ident = strdup ((*rp)->ident);
+			for (n = 1, ptr = ident; *ptr; ++ptr)
+				n += *ptr == '\t';
+			fld = malloc (n * sizeof (char *));
+			n = inv_split (ident, fld, n);
+			for (tp = SCH; tp > 0 && strcmp (fld[0], devtp_nm[tp]); --tp)
+				;
+			if (!*fld[14] != !pass || !tp 
+			    || sscanf (fld[1] + 1, "%x:%x", &major, &minor) != 2
+			    || sscanf (fld[2], "%d:%d:%d:%d", &hnum, &chan, &id, &lun) != 4) {
+				free (fld); free (ident);
+				continue;
+			}
+			match = NULL;
+			if (pass && !strncmp (fld[13], pfx, ln))
+				match = find_registered (fld[13] + ln);
+			snprintf (scsidev, PATH_MAX, DEVSCSI "/%s", (*rp)->name);
+			spnt = register_dev (scsidev, major, minor, tp, hnum, 
+					     strtoul (fld[9], 0, 16), chan, id, lun, 
+					     atoi (fld[3]), *fld[12]? fld[12]: NULL, 
+					     fld[13], match, NULL);
+			/* Only needs to be set for an alias */
+			if (pass && !match)
+				spnt->alias = spnt;
+			spnt->wwid = strtoull (fld[4], 0, 16);
+			spnt->manufacturer = inv_str (fld[5]);
+			spnt->model = inv_str (fld[6]);
+			spnt->rev = inv_str (fld[7]);
+			spnt->serial = *fld[8]? strdup (fld[8]): no_serial;
+			spnt->hsv_os_id = atoi (fld[10]);
+			spnt->shorthostname = inv_str (fld[11]);
+			spnt->aliasrule = strtoul (fld[14], 0, 16);
+			if (n > 15) {
+				for (i = 15, len = 1; i < n; ++i)
+					len += strlen (fld[i]) + 1;
+				spnt->desigs = malloc (len);
+				for (i = 15, ptr = spnt->desigs; i < n; ++i)
+					ptr = strcpy (ptr, fld[i]) + strlen (fld[i]) + 1;
+				*ptr = 0;
+			}
+			free (fld); free (ident);
+		}
+	}
+	free (regs);
+	reglist_full = 1;
+	/* and the rules they were made with */
+	hash_clear (&evalrules, free);
+	sigs = (char **) hash_list (&lastrules);
+	for (sp = sigs; *sp; ++sp) {
+		sig = strdup (*sp);
+		hash_add (&evalrules, sig, sig);
+	}
+	free (sigs);
+	return 0;
 }
 
-/** Do hostname, idlun lookup, do inquiry and make name */
-int getscsiinfo (int fd, sname *spnt, int setidlun)
+struct devnode * node_get (const char *nm)
 {
-	int status;
-	
-	if ((status = getidlun (fd, spnt, setidlun)))
-		return status;
-	if ((status = getscsihostname (fd, spnt)) < 0)
-		return status;	
+	snap_load ();
+	return hash_find (&devnodes, nm);
+}
 
-	status = inquiry (fd, spnt);
-	get_hsv_os_id (fd, spnt);
-	scsiname (spnt);
-	if (setidlun)
-		oldscsiname (spnt);
-	return status;
+/* Create an entry for a node we created */
+void node_created (const char *nm, mode_t mode, dev_t rdev, const char *linkto)
+{
+	struct stat st;
+	memset (&st, 0, sizeof (st));
+	st.st_mode = mode; st.st_rdev = rdev;
+	st.st_uid = geteuid (); st.st_gid = getegid ();
+	node_put (nm, &st, linkto);
+}
 
+void node_gone (const char *nm)
+{
+	struct devnode *node = hash_del (&devnodes, nm);
+	if (node)
+		node_free (node);
 }
 
-/* Check whether disk number no matches host/chan/id/lun in spnt */
-int comparediskidlun(sname *spnt, int no)
+/* All nodes, to be freed by caller */
+struct devnode ** node_list ()
 {
-	int id[2];
-	int scsi_id, channel, lun, host;
-	int major, minor, res, fd;
-	
-	major = disknum_to_sd_major (no);
-	minor = (no & 0x0f) << 4;
-    
-	res = mknod (TESTDEV, 0600 | S_IFBLK,
-		makedev (major, minor));
-	fd = open (TESTDEV, O_RDONLY | O_NONBLOCK);
-	unlink (TESTDEV);
+	snap_load ();
+	return (struct devnode **) hash_list (&devnodes);
+}
 
-	if (fd < 0)
-		return 0;
-	res = ioctl (fd, SCSI_IOCTL_GET_IDLUN, id);
-	close (fd);
-	if (res < 0)
-		return 0;
+/* stat() the node, i.e. follow symlinks */
+int node_stat (const struct devnode *node, struct stat *st)
+{
+	if (S_ISLNK (node->st.st_mode))
+		return fstatat (devscsi_fd, node->name, st, 0);
+	*st = node_verify ((struct devnode *) node)->st;
+	return 0;
+}
 
-	host = id[0] >> 24;
-	channel = (id[0] >> 16) & 0xff;
-	lun = (id[0] >> 8 ) & 0xff;
-	scsi_id = id[0] & 0xff;
+/*
+ * Changes to DEVSCSI are not done right away, but planned: The snapshot
+ * is updated to the desired state and the operations needed to get 
+ * there are queued and executed by plan_apply (), in order. Undoing a
+ * planned unlink (e.g. after -f) cancels both operations. --dry-run
+ * only prints the plan.
+ */
+enum op_t { OP_NONE, OP_UNLINK, OP_MKNOD, OP_SYMLINK, OP_PERM, 
+	    OP_RENAME, OP_EXCHANGE, OP_MKDIR, OP_RMDIR };
+static const char * op_nm[] = { "none", "unlink", "mknod", "symlink", "perm",
+				"rename", "exchange", "mkdir", "rmdir" };
+
+struct nodeop {
+	struct nodeop *next;
+	enum op_t op;
+	char *name;		/* relative to devscsi_fd (or absolute) */
+	struct stat st;		/* UNLINK: the old node */
+	char *linkto;		/* SYMLINK (UNLINK: old target, 
+				 * RENAME/EXCHANGE: other name) */
+};
 
-	if (verbose >= 2) 
-		printf ("Scanning: %d==%d %d==%d %d==%d %d==%d \n",
-		host, spnt->hostnum, channel, spnt->chan,
-		scsi_id, spnt->id, lun, spnt->lun);
-	if (host == spnt->hostnum &&
-	    channel == spnt->chan &&
-	    scsi_id == spnt->id &&
-	    lun == spnt->lun) {
-		spnt->major = major;
-		spnt->minor = minor;
-		return 1;
-	}
-	return 0;
+struct nodeop *plan_head = NULL, **plan_tail = &plan_head;
+struct hash plan_unlinks;	/* pending unlinks by name */
+
+struct nodeop * plan_add (enum op_t op, const char *nm,
+			  const struct stat *st, const char *linkto)
+{
+	struct nodeop *nop = malloc (sizeof (struct nodeop));
+	memset (nop, 0, sizeof (struct nodeop));
+	nop->op = op;
+	nop->name = strdup (nm);
+	if (st)
+		nop->st = *st;
+	nop->linkto = linkto? strdup (linkto): NULL;
+	*plan_tail = nop; plan_tail = &nop->next;
+	return nop;
 }
 
-/* Find scsi disk high level device that points to the device
- * defined in spnt->hostnum, chan, id, lun; search all devs
- * lower than current disk no up to current+full_scan */
-void findscsidisk(sname * spnt, int no) 
+/* Is there a pending unlink of the same node we'd create? */
+static struct nodeop * plan_undo_unlink (const char *nm, mode_t mode, 
+					 dev_t rdev, const char *linkto)
 {
-	int i;
-	int searchln = no > full_scan? no: full_scan;
-	if (verbose >= 1) 
-		printf("Findscsidisk: %d\n",no);
-	/* Default values */
-	spnt->major = disknum_to_sd_major (no);
-	spnt->minor = (no << 4) & 0x0f;
-	/* only search up to full_scan devices may be a bad assumption, but 
-	 * scanning the whole list could take a long time */
-	unlink (TESTDEV);
+	struct nodeop *nop = hash_find (&plan_unlinks, nm);
+	if (!nop || (nop->st.st_mode & S_IFMT) != (mode & S_IFMT))
+		return NULL;
+	if (S_ISLNK (mode)? (!nop->linkto || strcmp (nop->linkto, linkto))
+	    : nop->st.st_rdev != rdev)
+		return NULL;
+	hash_del (&plan_unlinks, nm);
+	nop->op = OP_NONE;
+	return nop;
+}
 
-	if (comparediskidlun(spnt, no))
-		return;
-	for (i = 1; i <= searchln; ++i) {
-		if (no-i >=0 && comparediskidlun(spnt, no-i))
-			return;
-		if (comparediskidlun(spnt, no+i))
-			return;
-	}               
-	/* If we did not find a match, return a good guess.. */ 
+void plan_print (const struct nodeop *nop)
+{
+	const char *nm = nop->name;
+	printf ("%-9s%s%s", op_nm[nop->op], *nm == '/'? "": DEVSCSI "/", nm);
+	switch (nop->op) {
+	case OP_MKNOD:
+		printf (" %c %03x:%05x", S_ISBLK (nop->st.st_mode)? 'b': 'c',
+			major (nop->st.st_rdev), minor (nop->st.st_rdev));
+		break;
+	case OP_SYMLINK:
+		printf (" -> %s", nop->linkto);
+		break;
+	case OP_PERM:
+		printf (" %u:%u %04o", (unsigned) nop->st.st_uid,
+			(unsigned) nop->st.st_gid, (unsigned) nop->st.st_mode & 07777);
+		break;
+	case OP_RENAME:
+		printf (" <- %s", nop->linkto);
+		break;
+	case OP_EXCHANGE:
+		printf (" <-> %s", nop->linkto);
+		break;
+	default:
+		break;
+	}
+	printf ("\n");
+}
+
+/* Atomically exchange two names */
+static int renameat_exchange (int dfd, const char *nm1, const char *nm2)
+{
+#ifdef SYS_renameat2
+	return syscall (SYS_renameat2, dfd, nm1, dfd, nm2, RENAME_EXCHANGE);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static int plan_exec (const struct nodeop *nop)
+{
+	const char *nm = nop->name;
+	switch (nop->op) {
+	case OP_UNLINK:
+		if (unlinkat (devscsi_fd, nm, 0) && errno != ENOENT)
+			return -1;
+		return 0;
+	case OP_MKNOD:
+		if (mknodat (devscsi_fd, nm, nop->st.st_mode, nop->st.st_rdev)) {
+			fprintf (stderr, "mknod (%s) failed\n", nm);
+			exit (1);
+		}
+		/* umask */
+		return fchmodat (devscsi_fd, nm, nop->st.st_mode & 07777, 0);
+	case OP_SYMLINK:
+		return symlinkat (nop->linkto, devscsi_fd, nm);
+	case OP_PERM:
+		if (fchownat (devscsi_fd, nm, nop->st.st_uid, nop->st.st_gid, 0))
+			return -1;
+		return fchmodat (devscsi_fd, nm, nop->st.st_mode & 07777, 0);
+	case OP_RENAME:
+		return renameat (devscsi_fd, nop->linkto, devscsi_fd, nm);
+	case OP_EXCHANGE:
+		if (!renameat_exchange (devscsi_fd, nop->linkto, nm))
+			return 0;
+		if (errno != EINVAL && errno != ENOSYS)
+			return -1;
+		/* Not supported by the fs: Via a temporary name */
+		if (renameat (devscsi_fd, nm, devscsi_fd, XCHGNM))
+			return -1;
+		if (renameat (devscsi_fd, nop->linkto, devscsi_fd, nm))
+			return -1;
+		return renameat (devscsi_fd, XCHGNM, devscsi_fd, nop->linkto);
+	case OP_MKDIR:
+		if (mkdirat (devscsi_fd, nm, 0755) && errno != EEXIST)
+			return -1;
+		return 0;
+	case OP_RMDIR:
+		return unlinkat (devscsi_fd, nm, AT_REMOVEDIR);
+	default:
+		return 0;
+	}
+}
+
+static int plan_errs;
+struct hash plan_busy;		/* names with queued operations */
+
+static void plan_done (const struct nodeop *nop, int res)
+{
+	if (res < 0) {
+		fprintf (stderr, "scsidev: %s " DEVSCSI "/%s: %s\n",
+			 op_nm[nop->op], nop->name, strerror (-res));
+		++plan_errs;
+	} else if (verbose >= 2)
+		plan_print (nop);
+}
+
+/* Does nop touch a name with a queued operation? */
+static int plan_conflict (const struct nodeop *nop)
+{
+	/* The dir needs to be empty */
+	if (nop->op == OP_RMDIR)
+		return 1;
+	return hash_find (&plan_busy, nop->name)
+		|| ((nop->op == OP_RENAME || nop->op == OP_EXCHANGE)
+		    && hash_find (&plan_busy, nop->linkto));
+}
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(SYS_io_uring_setup)	/* { */
+static void plan_uring_done (void *data, int res)
+{
+	struct nodeop *nop = data;
+	if (nop->op == OP_UNLINK && res == -ENOENT)
+		res = 0;
+	/* No RENAME_EXCHANGE on this fs */
+	if (nop->op == OP_EXCHANGE && res == -EINVAL)
+		res = plan_exec (nop)? -errno: 0;
+	plan_done (nop, res);
+}
+
+/* Queue nop to the ring; returns 0 if done */
+static int plan_queue (struct nodeop *nop)
+{
+	struct io_uring_sqe *sqe;
+	int op;
+	switch (nop->op) {
+	case OP_UNLINK:
+		op = IORING_OP_UNLINKAT; break;
+	case OP_SYMLINK:
+		op = IORING_OP_SYMLINKAT; break;
+	case OP_RENAME:
+	case OP_EXCHANGE:
+		op = IORING_OP_RENAMEAT; break;
+	default:
+		return -1;
+	}
+	if (!uring_has (op))
+		return -1;
+	sqe = uring_get (nop, plan_uring_done);
+	sqe->opcode = op;
+	sqe->fd = devscsi_fd;
+	switch (nop->op) {
+	case OP_SYMLINK:
+		sqe->addr = (unsigned long) nop->linkto;
+		sqe->addr2 = (unsigned long) nop->name;
+		break;
+	case OP_RENAME:
+	case OP_EXCHANGE:
+		sqe->addr = (unsigned long) nop->linkto;
+		sqe->len = devscsi_fd;
+		sqe->addr2 = (unsigned long) nop->name;
+		sqe->rename_flags = nop->op == OP_EXCHANGE? RENAME_EXCHANGE: 0;
+		break;
+	default:
+		sqe->addr = (unsigned long) nop->name;
+		break;
+	}
+	hash_add (&plan_busy, nop->name, nop);
+	if (nop->op == OP_RENAME || nop->op == OP_EXCHANGE)
+		hash_add (&plan_busy, nop->linkto, nop);
+	return 0;
+}
+#else						/* }{ */
+static void plan_uring_done (void *data, int res)
+{
+}
+
+static int plan_queue (struct nodeop *nop)
+{
+	return -1;
+}
+#endif						/* } */
+
+/* Execute (or print) the planned operations. Operations on different
+ * names are independent; with --io-uring they are queued, we only 
+ * need to wait for them before the next operation on the same name. */
+int plan_apply ()
+{
+	struct nodeop *nop, *next;
+	int nops = 0;
+	plan_errs = 0;
+	for (nop = plan_head; nop; nop = nop->next) {
+		if (nop->op == OP_NONE)
+			continue;
+		++nops;
+		if (dry_run) {
+			plan_print (nop);
+			continue;
+		}
+		if (plan_conflict (nop)) {
+			uring_flush (plan_uring_done);
+			hash_clear (&plan_busy, NULL);
+		}
+		if (plan_queue (nop))
+			plan_done (nop, plan_exec (nop)? -errno: 0);
+	}
+	uring_flush (plan_uring_done);
+	hash_clear (&plan_busy, NULL);
+	for (nop = plan_head; nop; nop = next) {
+		next = nop->next;
+		free (nop->name); free (nop->linkto); free (nop);
+	}
+	plan_head = NULL; plan_tail = &plan_head;
+	hash_clear (&plan_unlinks, NULL);
+	if (dry_run)
+		printf ("%i operations planned\n", nops);
+	else if (verbose && nops)
+		printf ("%i operations on " DEVSCSI " done\n", nops);
+	return plan_errs? -1: nops;
+}
+
+/** Unlink node */
+void node_unlink (const char *nm)
+{
+	struct devnode *node = node_verify (hash_find (&devnodes, nm));
+	struct nodeop *nop = plan_add (OP_UNLINK, nm, node? &node->st: NULL,
+				       node? node->linkto: NULL);
+	hash_del (&plan_unlinks, nm);
+	hash_add (&plan_unlinks, nop->name, nop);
+	node_gone (nm);
+}
+
+/** Create the subdir (-H) of DEVSCSI nm is in, if needed */
+void node_mkparent (const char *nm)
+{
+	char dir[NAME_MAX + 1];
+	const char *sl = strrchr (nm, '/');
+	struct devnode *node;
+	if (*nm == '/' || !sl || sl - nm > NAME_MAX)
+		return;
+	memcpy (dir, nm, sl - nm);
+	dir[sl - nm] = 0;
+	node = node_get (dir);
+	if (node && S_ISDIR (node->st.st_mode))
+		return;
+	if (node)
+		node_unlink (dir);
+	plan_add (OP_MKDIR, dir, NULL, NULL);
+	node_created (dir, S_IFDIR | 0755, 0, NULL);
+}
+
+/** Remove the empty subdirs of -H */
+void node_rmdirs ()
+{
+	struct devnode ** nodes, ** np;
+	struct hash used;
+	char dir[NAME_MAX + 1];
+	const char *sl;
+
+	memset (&used, 0, sizeof (used));
+	nodes = node_list ();
+	for (np = nodes; *np; ++np) {
+		sl = strchr ((*np)->name, '/');
+		if (!sl || sl - (*np)->name > NAME_MAX)
+			continue;
+		memcpy (dir, (*np)->name, sl - (*np)->name);
+		dir[sl - (*np)->name] = 0;
+		if (!hash_find (&used, dir)) {
+			char *d = strdup (dir);
+			hash_add (&used, d, d);
+		}
+	}
+	for (np = nodes; *np; ++np) {
+		if (!S_ISDIR ((*np)->st.st_mode) || !is_shard_dir ((*np)->name)
+		    || hash_find (&used, (*np)->name))
+			continue;
+		plan_add (OP_RMDIR, (*np)->name, NULL, NULL);
+		node_gone ((*np)->name);
+	}
+	free (nodes);
+	hash_clear (&used, free);
+}
+
+/** Create device node */
+void node_mknod (const char *nm, mode_t mode, dev_t rdev)
+{
+	struct nodeop *nop = plan_undo_unlink (nm, mode, rdev, NULL);
+	if (nop) {
+		node_put (nm, &nop->st, NULL);
+		return;
+	}
+	node_mkparent (nm);
+	nop = plan_add (OP_MKNOD, nm, NULL, NULL);
+	nop->st.st_mode = mode; nop->st.st_rdev = rdev;
+	/* Only DEVSCSI is in the snapshot */
+	if (*nm != '/')
+		node_created (nm, mode, rdev, NULL);
+}
+
+/* Index of the device nodes in the snapshot by type and dev_t, to
+ * find the old name of a renumbered device. Entries may be outdated,
+ * the snapshot needs to be checked. */
+struct nodeloc {
+	char key[24];
+	char *name;
+};
+
+struct hash nodelocs;
+int nodelocs_valid = 0;
+
+void nodeloc_free (void *data)
+{
+	struct nodeloc *loc = data;
+	if (!loc)
+		return;
+	free (loc->name);
+	free (loc);
+}
+
+static void nodeloc_key (char *key, mode_t mode, dev_t rdev)
+{
+	sprintf (key, "%c%llx", S_ISBLK (mode)? 'b': 'c', 
+		 (unsigned long long) rdev);
+}
+
+static void nodeloc_put (const struct devnode *node)
+{
+	struct nodeloc *loc = malloc (sizeof (struct nodeloc));
+	nodeloc_key (loc->key, node->st.st_mode, node->st.st_rdev);
+	loc->name = strdup (node->name);
+	nodeloc_free (hash_del (&nodelocs, loc->key));
+	hash_add (&nodelocs, loc->key, loc);
+}
+
+void nodeloc_drop ()
+{
+	hash_clear (&nodelocs, nodeloc_free);
+	nodelocs_valid = 0;
+}
+
+static void nodeloc_load ()
+{
+	struct devnode ** nodes, ** np;
+	if (nodelocs_valid)
+		return;
+	nodelocs_valid = 1;
+	nodes = node_list ();
+	for (np = nodes; *np; ++np)
+		if (S_ISCHR ((*np)->st.st_mode) || S_ISBLK ((*np)->st.st_mode))
+			nodeloc_put (*np);
+	free (nodes);
+}
+
+/** Move an unclaimed node for rdev to nm (instead of recreating it),
+ *  so it keeps its perms. A node in the way is exchanged with it and
+ *  may be moved on the same way. Returns 1 if done. */
+int node_move (const char *nm, mode_t mode, dev_t rdev)
+{
+	struct devnode *from, *to, *node;
+	struct nodeloc *loc;
+	struct stat st;
+	char key[24];
+
+	if (*nm == '/')
+		return 0;
+	nodeloc_load ();
+	nodeloc_key (key, mode, rdev);
+	loc = hash_find (&nodelocs, key);
+	if (!loc || !strcmp (loc->name, nm) || find_registered (loc->name))
+		return 0;
+	from = node_verify (hash_find (&devnodes, loc->name));
+	if (!from || from->claimed || (from->st.st_mode & S_IFMT) != (mode & S_IFMT)
+	    || from->st.st_rdev != rdev)
+		return 0;
+	to = node_verify (hash_find (&devnodes, nm));
+	st = from->st;
+	node_mkparent (nm);
+	if (to && (S_ISCHR (to->st.st_mode) || S_ISBLK (to->st.st_mode))) {
+		plan_add (OP_EXCHANGE, nm, NULL, loc->name);
+		node = node_put (loc->name, &to->st, NULL);
+		nodeloc_put (node);
+	} else {
+		if (to)
+			node_unlink (nm);
+		plan_add (OP_RENAME, nm, NULL, loc->name);
+		node_gone (loc->name);
+	}
 	if (verbose)
-		printf("No matching disk found for %i:%i:%i:%i in 0 .. %i\n",
+		printf ("Move " DEVSCSI "/%s to %s\n", loc->name, nm);
+	node_put (nm, &st, NULL);
+	return 1;
+}
+
+/** nm belongs to a device now, don't move it away */
+void node_claim (const char *nm)
+{
+	struct devnode *node = hash_find (&devnodes, nm);
+	if (node)
+		node->claimed = 1;
+}
+
+/** Start over, no node belongs to a device yet */
+void node_unclaim_all ()
+{
+	struct devnode ** nodes, ** np;
+	nodes = node_list ();
+	for (np = nodes; *np; ++np)
+		(*np)->claimed = 0;
+	free (nodes);
+}
+
+/** Create symlink */
+void node_symlink (const char *linkto, const char *nm)
+{
+	struct nodeop *nop = plan_undo_unlink (nm, S_IFLNK, 0, linkto);
+	if (nop) {
+		node_put (nm, &nop->st, linkto);
+		return;
+	}
+	node_mkparent (nm);
+	plan_add (OP_SYMLINK, nm, NULL, linkto);
+	node_created (nm, S_IFLNK | 0777, 0, linkto);
+}
+
+/** Name relative to devscsi_fd (other absolute paths are used as is) */
+const char * devscsi_rel (const char *nm)
+{
+	const int ln = strlen (DEVSCSI);
+	if (!strncmp (nm, DEVSCSI, ln) && nm[ln] == '/')
+		return nm + ln + 1;
+	return nm;
+}
+
+/** Helper to copy perms */
+inline void cp_perm (struct stat *to, const struct stat *from)
+{
+	to->st_uid  = from->st_uid;
+	to->st_gid  = from->st_gid;
+	to->st_mode = from->st_mode & ~S_IFMT;
+}
+
+/** Helper to apply perms (planned; only if they differ) */
+inline void apply_perm (const char* nm, const struct stat *st, int fmode)
+{
+	struct devnode *node = node_verify (hash_find (&devnodes, nm));
+	struct stat want;
+	want.st_uid = st->st_uid; want.st_gid = st->st_gid;
+	want.st_mode = (st->st_mode | fmode) & 07777;
+	if (node && !S_ISLNK (node->st.st_mode)) {
+		if (node->st.st_uid == want.st_uid && node->st.st_gid == want.st_gid
+		    && (node->st.st_mode & 07777) == want.st_mode)
+			return;
+		node->st.st_uid = want.st_uid;
+		node->st.st_gid = want.st_gid;
+		node->st.st_mode = (node->st.st_mode & S_IFMT) | want.st_mode;
+	}
+	plan_add (OP_PERM, nm, &want, NULL);
+}
+
+/** Helper to compare perms */
+inline int cmp_perm (const struct stat *p1, const struct stat *p2)
+{
+	return (p1->st_uid  != p2->st_uid ||
+		p1->st_gid  != p2->st_gid ||
+		(p1->st_mode & ~S_IFMT) != (p2->st_mode & ~S_IFMT));
+}
+
+/* The permissions of inactive nodes are kept in PERMDB, one line
+ * "name uid gid mode" per node. It used to be a .shadow.<name> file 
+ * per node in DEVSCSI; those are migrated. The DB is read once after
+ * we got the run lock and written back (atomically) when we release it. */
+struct permrec {
+	char *name;
+	struct stat st;		/* only uid, gid, mode */
+};
+
+struct hash perms;
+int perms_valid = 0, perms_dirty = 0, perms_migrate = 0;
+
+void perm_free (void *data)
+{
+	struct permrec *rec = data;
+	free (rec->name);
+	free (rec);
+}
+
+void perm_drop ()
+{
+	hash_clear (&perms, perm_free);
+	perms_valid = perms_dirty = perms_migrate = 0;
+}
+
+/* The name relative to DEVSCSI, without a -H subdir (the names in 
+ * there are unique anyway, so the perms survive switching layouts) */
+static const char * perm_key (const char *nm)
+{
+	char dir[NAME_MAX + 1];
+	const char *ptr;
+	nm = devscsi_rel (nm);
+	ptr = strchr (nm, '/');
+	if (*nm == '/' || !ptr || ptr - nm > NAME_MAX)
+		return nm;
+	memcpy (dir, nm, ptr - nm); dir[ptr - nm] = 0;
+	return is_hshard_dir (dir)? ptr + 1: nm;
+}
+
+static void perm_put (const char *nm, const struct stat *st)
+{
+	struct permrec *rec = hash_find (&perms, nm);
+	if (!rec) {
+		rec = malloc (sizeof (struct permrec));
+		memset (rec, 0, sizeof (struct permrec));
+		rec->name = strdup (nm);
+		hash_add (&perms, rec->name, rec);
+	}
+	cp_perm (&rec->st, st);
+}
+
+void perm_load ()
+{
+	struct devnode ** nodes, ** np;
+	char lnbuf[PATH_MAX + 64], nm[PATH_MAX];
+	FILE *f;
+	if (perms_valid)
+		return;
+	perms_valid = 1;
+	f = fopen (PERMDB, "r");
+	if (f) {
+		while (fgets (lnbuf, sizeof (lnbuf), f)) {
+			struct stat st;
+			unsigned int uid, gid, mode;
+			if (*lnbuf == '#')
+				continue;
+			if (sscanf (lnbuf, "%s %u %u %o", nm, &uid, &gid, &mode) != 4) {
+				fprintf (stderr, "scsidev: " PERMDB ": can't parse %s", lnbuf);
+				continue;
+			}
+			st.st_uid = uid; st.st_gid = gid; st.st_mode = mode;
+			perm_put (nm, &st);
+		}
+		fclose (f);
+	}
+	/* Migrate .shadow. files (they win, they are newer) */
+	nodes = node_list ();
+	for (np = nodes; *np; ++np) {
+		const char *shnm = (*np)->name;
+		if (strncmp (shnm, SHADOW, strlen (SHADOW)) || !shnm[strlen (SHADOW)])
+			continue;
+		perm_put (shnm + strlen (SHADOW), &node_verify (*np)->st);
+		perms_dirty = perms_migrate = 1;
+	}
+	free (nodes);
+}
+
+/* Write PERMDB and remove the migrated .shadow. files */
+void perm_save ()
+{
+	struct permrec ** recs, ** rp;
+	FILE *f;
+	if (!perms_dirty || dry_run)
+		return;
+	mkdir (STATEDIR, 0755);
+	f = fopen (PERMDB ".new", "w");
+	if (!f) {
+		perror ("scsidev: can't write " PERMDB);
+		return;
+	}
+	fprintf (f, "# scsidev: permissions of inactive " DEVSCSI " nodes\n");
+	recs = (struct permrec **) hash_list (&perms);
+	for (rp = recs; *rp; ++rp)
+		fprintf (f, "%s %u %u %04o\n", (*rp)->name,
+			 (unsigned) (*rp)->st.st_uid, (unsigned) (*rp)->st.st_gid,
+			 (unsigned) (*rp)->st.st_mode & 07777);
+	free (recs);
+	if (fflush (f) || fsync (fileno (f)) || fclose (f)
+	    || rename (PERMDB ".new", PERMDB)) {
+		perror ("scsidev: can't write " PERMDB);
+		unlink (PERMDB ".new");
+		return;
+	}
+	perms_dirty = 0;
+	if (perms_migrate) {
+		struct devnode ** nodes = node_list (), ** np;
+		for (np = nodes; *np; ++np)
+			if (!strncmp ((*np)->name, SHADOW, strlen (SHADOW)))
+				node_unlink ((*np)->name);
+		free (nodes);
+		perms_migrate = 0;
+	}
+}
+
+/** Back up permissions of an inactive node */
+void backup_shadow (const char* nm, struct stat *stbuf)
+{
+	struct permrec *rec;
+	perm_load ();
+	rec = hash_find (&perms, perm_key (nm));
+	if (rec && !cmp_perm (&rec->st, stbuf))
+		return;
+	perm_put (perm_key (nm), stbuf);
+	perms_dirty = 1;
+}
+
+/** Forget the backed up permissions */
+void rm_shadow (const char *nm)
+{
+	perm_load ();
+	if (hash_find (&perms, perm_key (nm))) {
+		perm_free (hash_del (&perms, perm_key (nm)));
+		perms_dirty = 1;
+	}
+}
+
+/** Get permissions
+ * Permissions:
+ * (a) old permissions of nm (if it's not a symlink)
+ * (b) backed up permissions
+ * (c) permissions of file pointed to
+ * (d) (new) filemode
+ */
+void get_perm (const char *nm, const char *linkto, struct stat * stbuf, int cdrom)
+{
+	int status;
+	struct stat statbuf;
+	struct devnode *node;
+	struct permrec *rec;
+	
+	node = node_verify (node_get (nm));
+	if (node && !S_ISLNK (node->st.st_mode)) {
+		cp_perm (stbuf, &node->st);
+		return;
+	}
+	/* -H: Still in the flat layout? */
+	if (perm_key (nm) != devscsi_rel (nm)) {
+		node = node_verify (node_get (perm_key (nm)));
+		if (node && !S_ISLNK (node->st.st_mode)) {
+			cp_perm (stbuf, &node->st);
+			return;
+		}
+	}
+	
+	perm_load ();
+	rec = hash_find (&perms, perm_key (nm));
+	if (rec) {
+		cp_perm (stbuf, &rec->st);
+		return;
+	}
+	
+	if (linkto) {
+		status = fstatat (devscsi_fd, linkto, &statbuf, 0);
+		if (!status) {
+			cp_perm (stbuf, &statbuf);
+			return;
+		}
+	}
+	
+	stbuf->st_uid = 0;
+	stbuf->st_gid = 0;
+	stbuf->st_mode = filemode;
+	if (cdrom)
+		stbuf->st_mode &= ~0222;
+}
+	
+
+/* -H: The flat DEVSCSI names that /etc/fstab uses are kept as
+ * symlinks into the subdirs */
+struct hash compat;
+int compat_valid = 0;
+
+void compat_load ()
+{
+	char ln[1024];
+	const int dln = strlen (DEVSCSI);
+	FILE *f;
+	compat_valid = 1;
+	f = fopen ("/etc/fstab", "r");
+	if (!f)
+		return;
+	while (fgets (ln, sizeof (ln), f)) {
+		char *dev = ln + strspn (ln, " \t");
+		dev[strcspn (dev, " \t\n")] = 0;
+		if (!strncmp (dev, DEVSCSI "/", dln + 1) && dev[dln + 1]
+		    && !strchr (dev + dln + 1, '/') && !hash_find (&compat, dev + dln + 1)) {
+			char *nm = strdup (dev + dln + 1);
+			hash_add (&compat, nm, nm);
+		}
+	}
+	fclose (f);
+}
+
+/** Symlink the flat name to nm if needed */
+void compat_link (const char *nm)
+{
+	const char *base = strrchr (nm, '/');
+	struct devnode *node;
+	if (!shard || *nm == '/' || !base)
+		return;
+	if (!compat_valid)
+		compat_load ();
+	if (!hash_find (&compat, ++base))
+		return;
+	node = node_get (base);
+	if (!node || !S_ISLNK (node->st.st_mode) || strcmp (node->linkto, nm)) {
+		if (node)
+			node_unlink (base);
+		node_symlink (nm, base);
+	}
+	node_claim (base);
+}
+
+/**
+ * Check to see if a given entry exists.  If not, create it,
+ * if it does make sure the major and minor numbers are correct
+ * and save permissions and ownerships (in the .shadow. file) 
+ * if this is the case.
+ */
+void update_device (char* linkto, char * path, int fmode, int major, int minor)
+{
+	struct stat statbuf, statbuf2;
+	struct devnode *node;
+	const char *nm = devscsi_rel (path);
+	int recreate;
+	int newmode;
+	int status;
+
+	recreate = 0;
+	node = node_get (nm);
+	status = node? 0: -1;
+	if (node)
+		statbuf = node->st;
+	if (status || S_ISLNK (statbuf.st_mode))
+		++recreate;
+	else if (statbuf.st_rdev != makedev (major, minor))
+		++recreate;
+	else if ((statbuf.st_mode & S_IFMT) != (fmode & S_IFMT))
+		++recreate;
+	/* An existing node keeps its perms, so there is no need to look
+	 * at them (and to stat it, if it came from the INVENTORY) */
+	/* Renumbered device: Move its old node here */
+	if (recreate && node_move (nm, fmode, makedev (major, minor)))
+		recreate = 0;
+	if (recreate) {
+		get_perm (nm, linkto, &statbuf2, (major == SCSI_CDROM_MAJOR));
+		newmode = fmode | statbuf2.st_mode;
+		if (!status)
+			node_unlink (nm);
+		node_mknod (nm, newmode, makedev (major, minor));
+		//printf("Recreate maj %i min %i\n", major, minor);
+		apply_perm (nm, &statbuf2, fmode);
+	}
+	node_claim (nm);
+	rm_shadow (nm);
+	compat_link (nm);
+}
+
+/** Create a symlink to the real dev */
+void create_symlink (const char *linkto, const char* path, int fmode, int major, int minor)
+{
+	struct stat statbuf;
+	struct stat statbuf2;
+	struct devnode *node;
+	const char *nm = devscsi_rel (path);
+	int status;
+	int recreate = 0;
+	
+	if (!quiet) 
+    		printf ("create_symlink(%s, %s, %o, %03x, %05x)\n",
+		        linkto, path, fmode, major, minor);
+	get_perm (nm, linkto, &statbuf2, (major == SCSI_CDROM_MAJOR));
+	
+	node = node_get (nm);
+	status = node? 0: -1;
+	if (!node || !S_ISLNK (node->st.st_mode))
+		++recreate;
+	else if (!node->linkto || strcmp (linkto, node->linkto))
+		++recreate;
+	
+	if (recreate) {
+		if (!status)
+			node_unlink (nm);
+		node_symlink (linkto, nm);
+	}
+	
+	/*
+	 * Now make sure that the device the symlink points to 
+	 * actually exists.  If not, then create that device.
+	 */
+	
+	status = fstatat (devscsi_fd, linkto, &statbuf, 0);
+	if (status) {
+		int newmode = statbuf2.st_mode | fmode;
+		node_mknod (linkto, newmode, makedev (major, minor));
+		fprintf (stderr, "Creating %s\n", linkto);
+		apply_perm (linkto, &statbuf2, fmode);
+	} else {
+		if (statbuf.st_rdev != makedev (major, minor)) {
+			fprintf (stderr, "scsidev: Inconsistency %s == %03x:%05x != %03x:%05x\n",
+				 linkto, major(statbuf.st_rdev), minor(statbuf.st_rdev),
+				 major, minor);
+			abort ();
+		}
+		if (cmp_perm (&statbuf, &statbuf2) && override_link_perm)
+			apply_perm (linkto, &statbuf2, fmode);
+	}
+	if (0 && override_link_perm)
+		rm_shadow (nm);
+	else
+		backup_shadow (nm, &statbuf2);
+	node_claim (nm);
+	compat_link (nm);
+}
+
+/** Create device node by making symlink or calling update_device() */
+void create_dev (sname *spnt, char symlink)
+{
+	char linkto[PATH_MAX];
+	int devtype = isblk (spnt->devtp)? S_IFBLK: S_IFCHR;;
+	snprintf (linkto, PATH_MAX, "/dev/%s", spnt->oldname);
+	
+	if (symlink)
+		create_symlink (linkto, spnt->name, devtype, spnt->major, spnt->minor);
+	else
+		update_device (linkto, spnt->name, devtype, spnt->major, spnt->minor);
+}
+
+
+/* Remove an unused dev node, keeping its permissions in PERMDB */
+void sanitize_node (const char *nm, struct stat *stbuf)
+{
+	if (!san_del)
+		backup_shadow (nm, stbuf);
+	node_unlink (nm);
+}
+
+/*
+ * We need to "fix" any device nodes that are currently not used because
+ * it is a security risk to leave these laying around.  These are fixed
+ * by storing a shadow file.  If these become active again,
+ * we will be able to use them again because the minor number will be
+ * set back again, and we are preserving the ownership and permissions.
+ */
+void sanitize_sdev ()
+{
+    struct devnode ** nodes, ** np;
+    sname * spnt;
+    int status;
+
+    /*
+     * Next, delete all of the existing entries in the /dev/scsi directory.
+     * The idea is that if we have added/removed devices, the numbers might have
+     * changed.
+     */
+    nodes = node_list ();
+    for (np = nodes; *np; ++np) {
+	const char *nm = (*np)->name;
+	if (*nm == '.')
+	    continue;
+	/* If it's a .shadow. name, leave it alone */
+	//if (strlen (de->d_name) >= strlen (SHADOW) && !strcmp (de->d_name, SHADOW))
+	//    continue;
+	/*
+	 * OK, we have the name.  See whether this is something
+	 * we know about already.
+	 */
+	spnt = find_registered (nm);
+	/* Didn't we find it? (Or is it a compat link of -H?) */
+	if (spnt == NULL && !(*np)->claimed) {
+	    struct stat statbuf;
+	    status = node_stat (*np, &statbuf);
+	    if ( status == 0 && (S_ISLNK (statbuf.st_mode) ||
+				 S_ISCHR (statbuf.st_mode) || 
+				 S_ISBLK (statbuf.st_mode)) ) {
+		/*
+		 * OK, this one is something new that we have to do something
+		 * with.  No big deal, stat it so we get the particulars, then
+		 * create a new one with a safe minor number.
+		 */
+		sanitize_node (nm, &statbuf);
+	    }
+	}
+    }
+    free (nodes);
+    node_rmdirs ();
+}
+
+/* Find the SCSI device, i.e. the last H:C:T:L component, in a sysfs 
+ * path. Returns the length of the path up to it or 0 */
+int sysfs_path_hctl (const char *path, int *hnum, int *chan, int *id, int *lun)
+{
+	const char *ptr = path + strlen (path);
+	while (ptr > path) {
+		const char *comp = ptr;
+		while (comp > path && comp[-1] != '/')
+			--comp;
+		if (sscanf (comp, "%d:%d:%d:%d", hnum, chan, id, lun) == 4)
+			return ptr - path;
+		ptr = comp - 1;
+	}
+	return 0;
+}
+
+/* Find host:chan:id:lun of a dev node maj:min through /sys/dev */
+int sysfs_devt_to_hctl (char blk, int major, int minor,
+			int *hnum, int *chan, int *id, int *lun)
+{
+	char nm[64], path[PATH_MAX];
+	sprintf (nm, "/sys/dev/%s/%d:%d", blk? "block": "char", major, minor);
+	if (!realpath (nm, path))
+		return -1;
+	return sysfs_path_hctl (path, hnum, chan, id, lun)? 0: -1;
+}
+
+/* Parse host:chan:id:lun from a name created by scsiname ().
+ * Returns -1 if nm is not such a name (e.g. an alias) */
+int parse_scsiname (const char *nm, int *hnum, int *chan, int *id, int *lun)
+{
+	const char *base = strrchr (nm, '/');
+	const char *ptr;
+	int n = 0, part;
+
+	base = base? base+1: nm;
+	for (ptr = base; *ptr && !isdigit (*ptr); ++ptr);
+	if (ptr == base || !*ptr)
+		return -1;
+	--ptr;
+	if (*ptr == 'c') {
+		if (sscanf (ptr, "c%db%dt%du%d%n", hnum, chan, id, lun, &n) < 4)
+			return -1;
+	} else if (*ptr == 'h') {
+		/* The hex hostid may contain c's, so try each one */
+		if (sscanf (ptr, "h%d-", hnum) < 1)
+			return -1;
+		for (ptr = strchr (ptr, '-'); (ptr = strchr (ptr, 'c')); ++ptr) {
+			n = 0;
+			if (sscanf (ptr, "c%di%dl%d%n", chan, id, lun, &n) == 3)
+				break;
+		}
+		if (!ptr)
+			return -1;
+	} else
+		return -1;
+	ptr += n;
+	if (!*ptr)
+		return 0;
+	n = 0;
+	if (sscanf (ptr, "p%d%n", &part, &n) == 1 && !ptr[n])
+		return 0;
+	return -1;
+}
+
+/* 
+ * Sanitize the nodes of the single SCSI device host:chan:id:lun that are
+ * not registered (any more): Names created by scsiname () for it, and
+ * aliases pointing to the same device or link target as those.
+ */
+void sanitize_hctl (int hnum, int chan, int id, int lun)
+{
+    struct devnode ** nodes, ** np;
+    dev_t *stale_dev = NULL;
+    char **stale_lnk = NULL;
+    int nstale = 0, maxstale = 0, pass, i;
+
+    /* 1st pass: our own names, 2nd pass: aliases */
+    for (pass = 0; pass < 2; ++pass) {
+	nodes = node_list ();
+	for (np = nodes; *np; ++np) {
+	    struct stat statbuf;
+	    const char *nm = (*np)->name;
+	    const char *linkto = (*np)->linkto? (*np)->linkto: "";
+	    int h, c, t, l, isours, dangling;
+
+	    if (*nm == '.' || find_registered (nm) || (*np)->claimed)
+		continue;
+	    isours = !parse_scsiname (nm, &h, &c, &t, &l);
+	    if (pass == 0 && !(isours && h == hnum && c == chan && t == id && l == lun))
+		continue;
+	    if (pass == 1 && (isours || !nstale))
+		continue;
+
+	    if (!S_ISLNK ((*np)->st.st_mode) && !S_ISCHR ((*np)->st.st_mode)
+		&& !S_ISBLK ((*np)->st.st_mode))
+		continue;
+	    dangling = node_stat (*np, &statbuf);
+	    if (dangling)
+		statbuf = (*np)->st;
+
+	    if (pass == 0) {
+		if (nstale == maxstale) {
+		    maxstale = maxstale? 2*maxstale: 64;
+		    stale_dev = realloc (stale_dev, maxstale * sizeof (dev_t));
+		    stale_lnk = realloc (stale_lnk, maxstale * sizeof (char *));
+		}
+		stale_dev[nstale] = (S_ISCHR (statbuf.st_mode) || S_ISBLK (statbuf.st_mode))?
+		    statbuf.st_rdev: 0;
+		stale_lnk[nstale++] = strdup (linkto);
+	    } else {
+		for (i = 0; i < nstale; ++i) {
+		    if (*linkto && !strcmp (linkto, stale_lnk[i]))
+			break;
+		    if (stale_dev[i] && stale_dev[i] == statbuf.st_rdev &&
+			(S_ISCHR (statbuf.st_mode) || S_ISBLK (statbuf.st_mode)))
+			break;
+		}
+		if (i == nstale)
+		    continue;
+		/* The kernel might have handed the dev to another device by now */
+		if (!sysfs_devt_to_hctl (S_ISBLK (statbuf.st_mode),
+					 major (statbuf.st_rdev), minor (statbuf.st_rdev),
+					 &h, &c, &t, &l)
+		    && !(h == hnum && c == chan && t == id && l == lun))
+		    continue;
+	    }
+	    if (verbose)
+		printf ("Sanitize " DEVSCSI "/%s\n", nm);
+	    if (dangling)
+		node_unlink (nm);
+	    else
+		sanitize_node (nm, &statbuf);
+	}
+	free (nodes);
+    }
+    for (i = 0; i < nstale; ++i)
+	free (stale_lnk[i]);
+    free (stale_lnk);
+    free (stale_dev);
+    node_rmdirs ();
+}
+
+
+/*
+ * Next, delete all of the existing entries in the /dev/scsi directory.
+ * The idea is that if we have added/removed devices, the numbers might have
+ * changed.
+ */
+void flush_sdev ()
+{
+	struct devnode ** nodes, ** np;
+	struct stat stbuf; 
+	
+	nodes = node_list ();
+	for (np = nodes; *np; ++np) {
+		const char *nm = (*np)->name;
+		if (nm[0] == '.' || S_ISDIR ((*np)->st.st_mode))
+			continue;
+		//if (strlen (de->d_name >= strlen(SHADOW) && !strcmp (de->d_name+i, SHADOW))
+		//	continue;
+		//if (de->d_name[0] != 's' && de->d_name[0] != 'n') continue;
+		if (!node_stat (*np, &stbuf))
+			backup_shadow (nm, &stbuf);
+		node_unlink (nm);
+	}
+	free (nodes);
+	if (!quiet) 
+		printf ("Flushed old " DEVSCSI " entries...\n");
+	
+}
+
+/*
+ * Staged rebuild (-S): The new tree is built in STAGEDIR, starting out
+ * empty, and then exchanged with DEVSCSI in one rename, so readers never
+ * see a half populated DEVSCSI. The permissions of the live nodes are
+ * carried forward via PERMDB.
+ */
+int stage_live_fd = -1;
+
+static int exchange_dirs (const char *dir1, const char *dir2)
+{
+	return renameat_exchange (AT_FDCWD, dir1, dir2);
+}
+
+/* Remove the entries of the directory at dfd (and of its subdirs)
+ * and the dir itself (if given) */
+void rm_dir_tree (int dfd, const char *dir)
+{
+	struct dirent * de;
+	DIR * sdir = fdopendir (dfd);
+	if (!sdir)
+		return;
+	while ((de = readdir (sdir)) != NULL) {
+		if (!strcmp (de->d_name, ".") || !strcmp (de->d_name, ".."))
+			continue;
+		if (unlinkat (dirfd (sdir), de->d_name, 0) && errno == EISDIR) {
+			/* subdir of -H */
+			int fd = openat (dirfd (sdir), de->d_name, 
+					 O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			if (fd >= 0)
+				rm_dir_tree (fd, NULL);
+			unlinkat (dirfd (sdir), de->d_name, AT_REMOVEDIR);
+		}
+	}
+	closedir (sdir);
+	if (dir)
+		rmdir (dir);
+}
+
+int stage_begin ()
+{
+	struct devnode ** nodes, ** np;
+	struct stat st;
+	int fd = open (STAGEDIR, O_RDONLY | O_DIRECTORY);
+	/* Leftover from an interrupted run? */
+	if (fd >= 0)
+		rm_dir_tree (fd, STAGEDIR);
+	if (fstat (devscsi_fd, &st)) {
+		perror ("scsidev: stat " DEVSCSI);
+		return -1;
+	}
+	if (mkdir (STAGEDIR, st.st_mode & 07777)) {
+		perror ("scsidev: mkdir " STAGEDIR);
+		return -1;
+	}
+	/* The swapped in tree must look like the live one */
+	if (chown (STAGEDIR, st.st_uid, st.st_gid)
+	    || chmod (STAGEDIR, st.st_mode & 07777)) {
+		perror ("scsidev: chown/chmod " STAGEDIR);
+		rmdir (STAGEDIR);
+		return -1;
+	}
+	fd = open (STAGEDIR, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		perror ("scsidev: open " STAGEDIR);
+		return -1;
+	}
+	/* Carry the live permissions forward */
+	nodes = node_list ();
+	for (np = nodes; *np; ++np) {
+		if (S_ISCHR ((*np)->st.st_mode) || S_ISBLK ((*np)->st.st_mode))
+			backup_shadow ((*np)->name, &node_verify (*np)->st);
+	}
+	free (nodes);
+	stage_live_fd = devscsi_fd; devscsi_fd = fd;
+	snap_drop ();
+	if (verbose)
+		printf ("Building new " DEVSCSI " in " STAGEDIR "\n");
+	return 0;
+}
+
+/* Move what we don't own over and swap the staged tree in */
+int stage_commit ()
+{
+	struct dirent * de;
+	DIR * ldir;
+	int fd;
+
+	if (plan_apply () < 0)
+		return -1;
+	fd = openat (stage_live_fd, ".", O_RDONLY | O_DIRECTORY);
+
+	ldir = fd < 0? NULL: fdopendir (fd);
+	while (ldir && (de = readdir (ldir)) != NULL) {
+		struct stat st;
+		const char *nm = de->d_name;
+		if (!strcmp (nm, ".") || !strcmp (nm, "..")
+		    || !strncmp (nm, SHADOW, strlen (SHADOW)) || node_get (nm))
+			continue;
+		if (fstatat (stage_live_fd, nm, &st, AT_SYMLINK_NOFOLLOW))
+			continue;
+		/* Stale nodes stay behind (sanitized) unless -n, 
+		 * with -f everything does */
+		if (force || ((S_ISCHR (st.st_mode) || S_ISBLK (st.st_mode) 
+			       || S_ISLNK (st.st_mode)) && !no_san)
+		    || (S_ISDIR (st.st_mode) && is_shard_dir (nm))) {
+			if (S_ISDIR (st.st_mode))
+				continue;
+			if (san_del)
+				rm_shadow (nm);
+			else if (verbose)
+				printf ("Sanitize " DEVSCSI "/%s\n", nm);
+			continue;
+		}
+		if (renameat (stage_live_fd, nm, devscsi_fd, nm))
+			fprintf (stderr, "scsidev: can't move " DEVSCSI "/%s: %s\n",
+				 nm, strerror (errno));
+		else if (S_ISLNK (st.st_mode)) {
+			char lnk[PATH_MAX];
+			ssize_t ln = readlinkat (devscsi_fd, nm, lnk, sizeof (lnk) - 1);
+			lnk[ln > 0? ln: 0] = 0;
+			node_put (nm, &st, lnk);
+		} else
+			node_put (nm, &st, NULL);
+	}
+	if (ldir)
+		closedir (ldir);
+
+	if (exchange_dirs (STAGEDIR, DEVSCSI)) {
+		/* Not supported by the fs: There's a short gap */
+		if (errno != EINVAL && errno != ENOSYS) {
+			perror ("scsidev: exchange " STAGEDIR " and " DEVSCSI);
+			return -1;
+		}
+		if (rename (DEVSCSI, STAGEDIR ".old") 
+		    || rename (STAGEDIR, DEVSCSI)) {
+			perror ("scsidev: rename " STAGEDIR " to " DEVSCSI);
+			return -1;
+		}
+		rm_dir_tree (stage_live_fd, STAGEDIR ".old");
+	} else
+		rm_dir_tree (stage_live_fd, STAGEDIR);
+	stage_live_fd = -1;
+	if (!quiet)
+		printf ("Swapped in new " DEVSCSI "\n");
+	return 0;
+}
+
+
+/** Remove trailing whitespace */
+int inline rmv_trail_ws (char* str)
+{
+	int i = strlen (str);
+	int n = 0;
+	while (--i >= 0 && (str[i] == ' ' || str[i] == '\t' || str[i] == '\n'))
+		n++;
+	str[i+1] = 0;
+	return n;
+}
+
+/** Use ioctl to get hostnum, channel, id, lun tuple and hostid (ioport) */
+int getidlun (int fd, sname *spnt, int setidlun)
+{
+	int status;
+	int id[2];
+
+	id[0] = 0; id[1] = 0;
+	status = ioctl (fd, SCSI_IOCTL_GET_IDLUN, &id);
+	
+	if (status == -1)	{
+		if (verbose == 2)
+			fprintf (stderr, "idlun(%03x:%05x) returned %d (%d)\n",
+				 spnt->major, spnt->minor, status, errno);
+		close (fd);
+		return -2;
+	}
+	
+	if (setidlun) {
+		/* This unfortunately limits all the numbers to be <= 255 */
+		spnt->hostnum = id[0] >> 24 & 0xff;
+		spnt->chan    = id[0] >> 16 & 0xff;
+		spnt->lun     = id[0] >>  8 & 0xff;
+		spnt->id      = id[0]       & 0xff;
+	}
+	spnt->hostid  = id[1];
+	
+	if (verbose == 2)
+		fprintf (stderr, "Found %03x:%05x with idlun %08x\n", 
+			 spnt->major, spnt->minor, id[0]);
+
+	return status;
+}
+
+
+/** Get long scsi host adapter name by ioctl */
+int getscsihostname (int fd, sname *spnt)
+{
+	int status;
+	char hostname[160];
+	*(int*)hostname = 159;
+	status = ioctl (fd, SCSI_IOCTL_PROBE_HOST, hostname);
+	hostname[159] = '\0';
+	
+	if (status == -1)	{
+		if (verbose == 2)
+			fprintf (stderr, "probe host (%03x:%05x) returned %d (%d)\n",
+				 spnt->major, spnt->minor, status, errno);
+		spnt->hostname = 0;
+		return -1;
+	}
+	spnt->hostname = hostname? strdup (hostname): 0;
+	rmv_trail_ws (spnt->hostname);
+	return status;
+}
+
+/** Do hostname, idlun lookup, do inquiry and make name */
+int getscsiinfo (int fd, sname *spnt, int setidlun)
+{
+	int status;
+	
+	if ((status = getidlun (fd, spnt, setidlun)))
+		return status;
+	if ((status = getscsihostname (fd, spnt)) < 0)
+		return status;	
+
+	status = inquiry (fd, spnt);
+	get_hsv_os_id (fd, spnt);
+	scsiname (spnt);
+	if (setidlun)
+		oldscsiname (spnt);
+	return status;
+
+}
+
+/* Create TESTDEV for major:minor and open it; returns fd or -1 */
+int open_testdev (char blk, int major, int minor, int mode)
+{
+	int fd;
+	unlinkat (testdev_fd, TESTNM, 0);
+	if (mknodat (testdev_fd, TESTNM, 0600 | (blk? S_IFBLK: S_IFCHR),
+		   makedev (major, minor)))
+		return -1;
+	fd = openat (testdev_fd, TESTNM, mode);
+	unlinkat (testdev_fd, TESTNM, 0);
+	return fd;
+}
+
+/* Check whether disk number no matches host/chan/id/lun in spnt */
+int comparediskidlun(sname *spnt, int no)
+{
+	int id[2];
+	int scsi_id, channel, lun, host;
+	int major, minor, res, fd;
+	
+	major = disknum_to_sd_major (no);
+	minor = (no & 0x0f) << 4;
+    
+	res = mknodat (testdev_fd, TESTNM, 0600 | S_IFBLK,
+		makedev (major, minor));
+	fd = openat (testdev_fd, TESTNM, O_RDONLY | O_NONBLOCK);
+	unlinkat (testdev_fd, TESTNM, 0);
+
+	if (fd < 0)
+		return 0;
+	res = ioctl (fd, SCSI_IOCTL_GET_IDLUN, id);
+	close (fd);
+	if (res < 0)
+		return 0;
+
+	host = id[0] >> 24;
+	channel = (id[0] >> 16) & 0xff;
+	lun = (id[0] >> 8 ) & 0xff;
+	scsi_id = id[0] & 0xff;
+
+	if (verbose >= 2) 
+		printf ("Scanning: %d==%d %d==%d %d==%d %d==%d \n",
+		host, spnt->hostnum, channel, spnt->chan,
+		scsi_id, spnt->id, lun, spnt->lun);
+	if (host == spnt->hostnum &&
+	    channel == spnt->chan &&
+	    scsi_id == spnt->id &&
+	    lun == spnt->lun) {
+		spnt->major = major;
+		spnt->minor = minor;
+		return 1;
+	}
+	return 0;
+}
+
+/* Find scsi disk high level device that points to the device
+ * defined in spnt->hostnum, chan, id, lun; search all devs
+ * lower than current disk no up to current+full_scan */
+void findscsidisk(sname * spnt, int no) 
+{
+	int i;
+	int searchln = no > full_scan? no: full_scan;
+	if (verbose >= 1) 
+		printf("Findscsidisk: %d\n",no);
+	/* Default values */
+	spnt->major = disknum_to_sd_major (no);
+	spnt->minor = (no << 4) & 0x0f;
+	/* only search up to full_scan devices may be a bad assumption, but 
+	 * scanning the whole list could take a long time */
+	unlinkat (testdev_fd, TESTNM, 0);
+
+	if (comparediskidlun(spnt, no))
+		return;
+	for (i = 1; i <= searchln; ++i) {
+		if (no-i >=0 && comparediskidlun(spnt, no-i))
+			return;
+		if (comparediskidlun(spnt, no+i))
+			return;
+	}               
+	/* If we did not find a match, return a good guess.. */ 
+	if (verbose)
+		printf("No matching disk found for %i:%i:%i:%i in 0 .. %i\n",
+			spnt->hostnum, spnt->chan, spnt->id, spnt->lun,
+			no+searchln);
+}
+
+
+/* Create dev entries for a disk */
+int build_disk (sname * spnt, int no)
+{
+    int minor; int fd; int status;
+    sname * spnt1 = sname_dup (spnt);
+    findscsidisk(spnt1, no);
+    spnt->partition = -1;
+    spnt1->devtp = SD;
+    scsiname (spnt1); oldscsiname (spnt1);
+    reg_add (spnt1);
+    create_dev (spnt1, use_symlink);
+    spnt->related = spnt1;
+    /* Check if device is there (i.e. medium inside) */
+    fd =  open_testdev (isblk (spnt1->devtp), spnt1->major, spnt1->minor,
+			O_RDONLY | O_NONBLOCK);
+    /* No access to medium / part. table */
+    if (fd < 0) {
+	spnt1->unsafe = 1;
+	/* If it is a removable device, we can't do much more than 
+	 * trusting it or not support it at all */
+	if (spnt1->rmvbl && supp_rmvbl) 
+	    return 0;
+	fprintf (stderr, "Can't access %sremovable %s, which should "
+		 "be equal to %s!\n", (spnt1->rmvbl? "": "NON-"), 
+		 strrchr (spnt1->name, '/') + 1,
+		 strrchr (spnt->name, '/') + 1);
+	/* We don't unlink spnt1->name! Let sanitize take care of it ... */
+	reglist = spnt1->next; reg_unindex (spnt1);
+	free (spnt1->name); 
+	spnt->related = 0; free (spnt1);
+	return 1;
+    }
+	
+    /* Sanity checks */
+    status = getscsiinfo (fd, spnt1, 1);
+    close (fd);
+    if (status) 
+	fprintf (stderr, "scsidev: Strange: Could not get info from %s\n",
+		 strrchr (spnt1->name, '/') + 1);
+    if (sname_cmp (spnt, spnt1)) {
+	fprintf (stderr, "scsidev: What's going on? Dev %s is different from %s\n", 
+		 strrchr (spnt1->name, '/') + 1, strrchr (spnt->name, '/') + 1);
+	spnt -> related = 0; spnt1 -> related = 0;
+	/* And now ? */
+	reglist = spnt1->next; reg_unindex (spnt1);
+	free (spnt1->name); 
+	spnt->related = 0; free (spnt1);
+	return 1;
+    }
+    /* Now do a partition scan ... */
+    spnt = spnt1;
+    for (minor = spnt1->minor+1; minor % 16; minor++) {
+	unlinkat (testdev_fd, TESTNM, 0);
+	    
+	mknodat (testdev_fd, TESTNM, 0600 | S_IFBLK,
+		 makedev (spnt1->major, minor) );
+	fd = openat (testdev_fd, TESTNM, O_RDONLY | O_NONBLOCK);
+	unlinkat (testdev_fd, TESTNM, 0);
+	if (fd < 0) 
+	    continue;
+	// TODO: Add sanity checks here ??
+	close (fd);
+	spnt1 = sname_dup (spnt);
+	spnt1->partition = minor % 16;
+	spnt1->minor = minor;
+	scsiname (spnt1); oldscsiname (spnt1);
+	reg_add (spnt1);
+	create_dev (spnt1, use_symlink);
+    }
+    return 0;
+}
+
+int build_tape (sname * spnt, int no)
+{
+    int fd; int status;
+    sname * spnt1 = sname_dup (spnt);
+    spnt1->major = SCSI_TAPE_MAJOR;
+    spnt1->minor = no;
+    spnt1->devtp = ST;
+    scsiname (spnt1); oldscsiname (spnt1);
+    reg_add (spnt1);
+    create_dev (spnt1, use_symlink);
+    /* Check if device is there (i.e. medium inside) */
+    fd =  open_testdev (isblk (spnt1->devtp), spnt1->major, spnt1->minor,
+			O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+	/* Tapes are always accessible, as they are char devices */
+	fprintf (stderr, "Can't access tape %s, which should "
+		 "be equal to %s!\n", strrchr (spnt1->name, '/') + 1,
+		 strrchr (spnt->name, '/') + 1);
+	/* We don't unlink spnt1->name! Let sanitize take care of it ... */
+	reglist = spnt1->next; reg_unindex (spnt1);
+	free (spnt1->name); 
+	spnt->related = 0; free (spnt1);
+	return 1;
+    }
+    /* Do a sanity check here */
+    status = getscsiinfo (fd, spnt1, 1);
+    close (fd);
+    if (status) 
+	fprintf (stderr, "scsidev: Strange: Could not get info from %s\n",
+		 strrchr (spnt1->name, '/') + 1);
+    if (sname_cmp (spnt, spnt1)) {
+	fprintf (stderr, "scsidev: What's going on? Dev %s is different from %s\n", 
+		 strrchr (spnt1->name, '/') + 1, strrchr (spnt->name, '/') + 1);
+	spnt -> related = 0; spnt1 -> related = 0;
+	/* And now ? */
+	reglist = spnt1->next; reg_unindex (spnt1);
+	free (spnt1->name); 
+	spnt->related = 0; free (spnt1);
+	return 1;
+    }
+    /* And create the no-rewind alias */
+    spnt1 = sname_dup (spnt1);
+    spnt1->minor |= 0x80;
+    scsiname (spnt1); oldscsiname (spnt1);
+    reg_add (spnt1);
+    create_dev (spnt1, use_symlink);
+	
+    return 0;
+}
+
+/* Create non-rew. alternative for a tape */
+void create_ntape (sname * spnt)
+{
+	sname * spnt1 = sname_dup (spnt);
+	spnt1->minor |= 0x80;
+	scsiname (spnt1); oldscsiname (spnt1);
+	create_dev (spnt1, use_symlink);
+	reg_add (spnt1);
+}
+
+int build_os_tape (sname * spnt, int no)
+{
+    int fd; int status;
+    sname * spnt1 = sname_dup (spnt);
+    spnt1->major = OSST_MAJOR;
+    spnt1->minor = no;
+    spnt1->devtp = OSST;
+    scsiname (spnt1); oldscsiname (spnt1);
+    reg_add (spnt1);
+    create_dev (spnt1, use_symlink);
+    /* Check if device is there (i.e. medium inside) */
+    fd =  open_testdev (isblk (spnt1->devtp), spnt1->major, spnt1->minor,
+			O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+	/* OnStream tapes are NOT always accessible, as they have a heavy open() function */
+	spnt1->unsafe = 1;
+	if (!quiet || !supp_rmvbl) 
+	    fprintf (stderr, "Can't access tape %s, which should "
+		     "be equal to %s!\n", strrchr (spnt1->name, '/') + 1,
+		     strrchr (spnt->name, '/') + 1);
+	if (supp_rmvbl) 
+	    goto osst_force_success;
+	/* We don't unlink spnt1->name! Let sanitize take care of it ... */
+	reglist = spnt1->next; reg_unindex (spnt1);
+	free (spnt1->name); 
+	spnt->related = 0; free (spnt1);
+	return 1;
+    }
+    /* Do a sanity check here */
+    status = getscsiinfo (fd, spnt1, 1);
+    close (fd);
+    if (status) 
+	fprintf (stderr, "scsidev: Strange: Could not get info from %s\n",
+		 strrchr (spnt1->name, '/') + 1);
+    if (sname_cmp (spnt, spnt1)) {
+	fprintf (stderr, "scsidev: What's going on? Dev %s is different from %s\n", 
+		 strrchr (spnt1->name, '/') + 1, strrchr (spnt->name, '/') + 1);
+	spnt -> related = 0; spnt1 -> related = 0;
+	/* And now ? */
+	reglist = spnt1->next; reg_unindex (spnt1);
+	free (spnt1->name); 
+	spnt->related = 0; free (spnt1);
+	return 1;
+    }
+ osst_force_success:
+    /* And create the no-rewind alias */
+    spnt1 = sname_dup (spnt1);
+    spnt1->minor |= 0x80;
+    scsiname (spnt1);
+    reg_add (spnt1);
+    create_dev (spnt1, use_symlink);
+	
+    return 0;
+}
+
+int build_cdrom (sname * spnt, int no)
+{
+    int fd; int status;
+    sname * spnt1 = sname_dup (spnt);
+    spnt1->major = SCSI_CDROM_MAJOR;
+    spnt1->minor = no;
+    spnt1->devtp = SR;	
+    scsiname (spnt1); oldscsiname (spnt1);
+    reg_add (spnt1);
+    create_dev (spnt1, use_symlink);
+    fd =  open_testdev (isblk (spnt1->devtp), spnt1->major, spnt1->minor,
+			O_RDONLY | O_NONBLOCK);
+    /* No access to medium / part. table */
+    if (fd < 0) {
+	spnt1->unsafe = 1;
+	/* Removable block devs are hairy! */
+	if (spnt1->rmvbl && supp_rmvbl) 
+	    return 0;
+	fprintf (stderr, "Can't access %sremovable %s, which should "
+		 "be equal to %s!\n", (spnt1->rmvbl? "": "NON-"), 
+		 strrchr (spnt1->name, '/') + 1,
+		 strrchr (spnt->name, '/') + 1);
+	/* We don't unlink spnt1->name! Let sanitize take care of it ... */
+	reglist = spnt1->next; reg_unindex (spnt1);
+	free (spnt1->name); 
+	spnt->related = 0; free (spnt1);
+	return 1;
+    }
+	
+    /* Do a sanity check */
+    status = getscsiinfo (fd, spnt1, 1);
+    close (fd);
+    if (status) 
+	fprintf (stderr, "scsidev: Strange: Could not get info from %s\n",
+		 strrchr (spnt1->name, '/') + 1);
+    if (sname_cmp (spnt, spnt1)) {
+	fprintf (stderr, "scsidev: What's going on? Dev %s is different from %s\n", 
+		 strrchr (spnt1->name, '/') + 1, strrchr (spnt->name, '/') + 1);
+	/* And now ? */
+	reglist = spnt1->next; reg_unindex (spnt1);
+	free (spnt1->name); 
+	spnt->related = 0; free (spnt1);
+	return 1;
+    }
+    return 0;
+}
+
+int build_changer (sname * spnt, int no)
+{
+    int fd; int status;
+    sname * spnt1 = sname_dup (spnt);
+    spnt1->major = SCSI_CHANGER_MAJOR;
+    spnt1->minor = no;
+    spnt1->devtp = SCH;
+    scsiname (spnt1); oldscsiname (spnt1);
+    reg_add (spnt1);
+    create_dev (spnt1, use_symlink);
+    fd =  open_testdev (isblk (spnt1->devtp), spnt1->major, spnt1->minor,
+			O_RDONLY | O_NONBLOCK);
+    /* No access to medium / part. table */
+    if (fd < 0) {
+	spnt1->unsafe = 1;
+	/* Removable block devs are hairy! */
+	if (spnt1->rmvbl && supp_rmvbl) 
+	    return 0;
+	fprintf (stderr, "Can't access %sremovable %s, which should "
+		 "be equal to %s!\n", (spnt1->rmvbl? "": "NON-"), 
+		 strrchr (spnt1->name, '/') + 1,
+		 strrchr (spnt->name, '/') + 1);
+	/* We don't unlink spnt1->name! Let sanitize take care of it ... */
+	reglist = spnt1->next; reg_unindex (spnt1);
+	free (spnt1->name); 
+	spnt->related = 0; free (spnt1);
+	return 1;
+    }
+
+    /* Do a sanity check */
+    status = getscsiinfo (fd, spnt1, 1);
+    close (fd);
+    if (status) 
+	fprintf (stderr, "scsidev: Strange: Could not get info from %s\n",
+		 strrchr (spnt1->name, '/') + 1);
+    if (sname_cmp (spnt, spnt1)) {
+	fprintf (stderr, "scsidev: What's going on? Dev %s is different from %s\n",
+		 strrchr (spnt1->name, '/') + 1, strrchr (spnt->name, '/') + 1);
+	/* And now ? */
+	reglist = spnt1->next; reg_unindex (spnt1);
+	free (spnt1->name); 
+	spnt->related = 0; free (spnt1);
+	return 1;
+    }
+    return 0;
+}
+
+/* Use /proc/partitions to scan for partitions */
+void create_partitions (sname * spnt)
+{
+	char pline[128]; char *ptr;
+	FILE *pf = fopen ("/proc/partitions", "r");
+	if (!pf) {
+		fprintf (stderr, "scsidev: Couldn't read /proc/partitions: %s\n",
+			 strerror (errno));
+		return;
+	}
+	while (!feof (pf)) {
+		unsigned int maj, min, blk;
+		char nm[64], nm2[64];
+		ptr = fgets (pline, 128, pf);
+		if (!ptr)
+			break;
+		if (sscanf (pline, " %d %d %d %8s", &maj, &min, &blk, nm) < 4)
+			continue;
+		
+		/* Strip part */
+		strcpy (nm2, nm);
+		if (isdigit (nm2[strlen(nm2)-1])) {
+			for (ptr = nm2+strlen(nm2)-1; isdigit(*ptr); --ptr);
+			*(++ptr) = 0;
+		}
+		ptr = nm + strlen(nm2);
+		if (!strcmp (nm2, spnt->oldname)) {
+			/* Found it ! */
+			if (maj != spnt->major || (min & ~0x0f) != (spnt->minor)) {
+				fprintf (stderr, "scsidev: Inconsistency found: /proc/partitions reports "
+					 " %s as %03x:%05x\n whereas we have %03x:%05x\n",
+					 nm2, maj, min & ~0x0f, spnt->major, spnt->minor);
+				dumpentry (spnt);
+				abort ();
+			}
+			if (isdigit (*ptr)) {
+				int part = atoi (ptr);
+				sname * spnt1 = sname_dup (spnt);
+				spnt1->minor |= part; spnt1->partition = part;
+				scsiname (spnt1); 
+				spnt1->oldname = strdup (nm);
+				create_dev (spnt1, use_symlink);
+				reg_add (spnt1);
+			}
+		}
+	}
+	fclose (pf);
+}
+	
+
+
+void build_sgdevlist ()
+{
+    int fd; 
+    int status;
+    sname * spnt;
+    int disks = 0, tapes = 0, cdroms = 0, changers = 0;
+    int miss = 0;	
+    int minor = 0;
+    int major = SCSI_GENERIC_MAJOR; 
+    int mode = O_RDWR | O_NONBLOCK;
+    //    int devtype = (SCSI_BLK_MAJOR(major)? S_IFBLK: S_IFCHR);
+    enum devtype_t devtp;
+    
+    if (devscsi_fd < 0)
+	return;
+
+    unlinkat (testdev_fd, TESTNM, 0);
+
+    if (verbose >= 1)
+	fprintf (stderr, "Building list for sg (%s dev major %03x)\n",
+		 "char", major);
+
+    while (minor <= 255) {
+	errno = 0;
+	status = mknodat (testdev_fd, TESTNM, 0600 | S_IFCHR, 
+			 makedev (major, minor) );
+	if (status) { 
+	    perror ("scsidev: mknod"); 
+	    exit (3); 
+	}
+	fd = openat (testdev_fd, TESTNM, mode);
+	unlinkat (testdev_fd, TESTNM, 0);
+	if (fd == -1) {
+	    if (verbose == 2)
+		fprintf (stderr, "open(%03x:%05x) returned %d (%d)\n",
+			 major, minor, fd, errno);
+	    miss++;
+	    if (miss > maxmiss) 
+		break;
+	    else { 
+		minor++; continue; 
+	    }
+	}
+	spnt = (sname*) malloc (sizeof (sname));
+	memset (spnt, 0, sizeof (sname));
+	spnt->major = major;   spnt->minor = minor;
+	spnt->devtp = SG;
+	spnt->name  = TESTDEV; spnt->partition = -1;
+	status = getscsiinfo (fd, spnt, 1);
+	close (fd);
+
+	if (status) { 
+		free (spnt); miss++;
+		if (miss > maxmiss) 
+		    break;
+		else { 
+		    minor++; continue; 
+		}
+	}
+	//scsiname (spnt) called by getscsiinfo();
+
+	reg_add (spnt);
+	create_dev (spnt, use_symlink);
+
+	devtp = inq_devtp_to_devtp (spnt->inq_devtp, spnt);
+
+	if (!quiet) 
+	    printf ("Found %s (Type %02x) %c on %s \n", spnt->name,
+		    spnt->inq_devtp, (spnt->rmvbl? 'R' : ' '),
+		    spnt->hostname);
+
+	/* Now register cdroms, tapes, and disks as well */
+	switch (devtp) {
+	    case SD:
+		if (!build_disk (spnt, disks)) 
+			disks++;
+		/* This shouldn't happen, we search already in findscsidisk() 
+		else if (!build_disk (spnt, disks+1)) 
+			disks += 2;
+		 */	
+		break;
+	    case ST:
+		if (!build_tape (spnt, tapes)) 
+			tapes++;
+		else if (!build_tape (spnt, tapes+1)) 
+			tapes += 2;
+		break;
+	    case OSST:
+		if (!build_os_tape (spnt, tapes)) 
+			tapes++;
+		else if (!build_os_tape (spnt, tapes+1)) 
+			tapes += 2;
+		break;
+	    case SR:
+		if (!build_cdrom (spnt, cdroms)) 
+			cdroms++;
+		else if (!build_cdrom (spnt, cdroms+1)) 
+			cdroms += 2;
+		break;
+	    case SCH:
+		if (!build_changer (spnt, changers)) 
+			changers++;
+		else if (!build_cdrom (spnt, changers+1)) 
+			changers += 2;
+		break;
+		
+	    default:
+		;/* nothing to be done */
+	}
+	minor += 1;
+    }
+    //unlinkat (testdev_fd, TESTNM, 0);
+}
+
+char fourlnbuf[4][128];
+/* Fill fourlnbuf with the next record from /proc/scsi/scsi */
+int procscsi_readrecord (FILE* f)
+{
+	int c; char *ptr;
+	fourlnbuf[0][0] = 0; fourlnbuf[1][0] = 0;
+	fourlnbuf[2][0] = 0; fourlnbuf[3][0] = 0;
+	do {
+		ptr = fgets (fourlnbuf[0], 128, f);
+		if (!ptr || feof (f))
+			return -1;
+	} while (memcmp (fourlnbuf[0], "Host:", 5));
+	ptr = fgets (fourlnbuf[1], 128, f);
+	ptr = fgets (fourlnbuf[2], 128, f);
+	/* Test for extensions ... */
+	c = fgetc (f);
+	if (c != EOF) {
+		ungetc (c, f);
+		if (c != 'H') {
+			ptr = fgets (fourlnbuf[3], 128, f);
+			c = fgetc (f);
+			if (c != EOF) 
+				ungetc (c, f);
+		}
+	}
+#ifdef DEBUG
+	printf ("procscsi_readrecord:\n");
+	printf ("%s", fourlnbuf[0]); printf ("%s", fourlnbuf[1]);
+	printf ("%s", fourlnbuf[2]); printf ("%s", fourlnbuf[3]);
+	printf ("%i\n", fourlnbuf[3][0]);
+#endif
+	return 0;
+}
+
+/* This is a copy of 
+ * const char *const scsi_device_types[MAX_SCSI_DEVICE_CODE]
+ * from linux/drivers/scsi/scsi.c
+ */
+#define MAX_SCSI_DEVICE_CODE 15
+const char *const scsi_device_types[MAX_SCSI_DEVICE_CODE] =
+{
+	"Direct-Access",
+	"Sequential-Access",
+	"Printer",
+	"Processor",
+	"WORM",
+	"CD-ROM",
+	"Scanner",
+	"Optical Device",
+	"Medium Changer",
+	"Communications",
+	"Unknown",
+	"Unknown",
+	"RAID",
+	"Enclosure",
+	"Direct-Access-RBC",
+};
+
+
+char linux_to_devtp (const char* tp)
+{
+	int idx;
+	if (!strcmp (tp, "Unknown"))
+		return 0x1f;
+	for (idx = 0; idx < MAX_SCSI_DEVICE_CODE; ++idx)
+		if (!strcmp (tp, scsi_device_types[idx]))
+			return idx;
+	fprintf (stderr, "Linux kernel reports new device type \"%s\". Mail author!\n",
+		 tp);
+	return 0x1f;
+}
+
+/* Parse contents of fourlnbuf */
+int procscsi_parse (sname *spnt)
+{
+	char vendor[9];
+	char product[17];
+	char rev[5];
+	char devtype[21];
+	char hldev0[16], hldev1[16], hldev2[16], hldev3[16];
+	int ansi;
+	
+	sscanf (fourlnbuf[0], "Host: scsi%i Channel: %d Id: %d Lun: %d",
+		&spnt->hostnum, &spnt->chan, &spnt->id, &spnt->lun);
+	sscanf (fourlnbuf[1], "  Vendor: %8c Model: %16c Rev: %4c",
+		vendor, product, rev);
+	vendor[8] = 0; product[16] = 0; rev[4] = 0;
+	rmv_trail_ws (vendor); rmv_trail_ws (product); rmv_trail_ws (rev);
+	spnt->manufacturer = strdup (vendor);
+	spnt->model = strdup (product);
+	spnt->rev = strdup (rev);
+	sscanf (fourlnbuf[2], "  Type: %20c ANSI SCSI revision: %d",
+		devtype, &ansi);
+	devtype [20] = 0; rmv_trail_ws (devtype);
+	spnt->inq_devtp = linux_to_devtp (devtype);
+	if (!fourlnbuf[3][0])
+		return 0;
+	return sscanf (fourlnbuf[3], "  Attached drivers: %16s %16s %16s %16s",
+		       hldev0, hldev1, hldev2, hldev3);
+}
+
+int procscsiext_parse (sname *spnt, int idx)
+{
+	char hldev[4][16];
+	char* hdev; char* devptr;
+	char tp;
+	int n = sscanf (fourlnbuf[3], "  Attached drivers: %16s %16s %16s %16s",
+			hldev[0], hldev[1], hldev[2], hldev[3]);
+	if (idx >= n) {
+	    return -1;
+	} else
+		hdev = hldev[idx];
+	
+	for (devptr = hdev; *devptr != '(' && *devptr != 0; ++devptr);
+	*devptr++ = 0;
+	spnt->oldname = strdup (hdev);
+
+	sscanf (devptr, "%c:%x:%x)", &tp, &spnt->major, &spnt->minor);
+	
+	// We don't use tp (which can be 'b' or 'c')
+	
+	if (!memcmp (hdev, "sg", 2))
+		spnt->devtp = SG;
+	else
+		spnt->devtp = inq_devtp_to_devtp (spnt->inq_devtp, spnt);
+
+	scsiname (spnt);	
+	return 0;
+}
+
+char* find_scsihostname (int hnum)
+{
+	struct dirent *sde;
+	DIR * sdir;
+	char path[64];
+	char num[8];
+	char* const phost = path + strlen("/proc/scsi/");
+	
+	strcpy (path, "/proc/scsi/");
+	sprintf (num, "/%d", hnum);
+	
+	sdir = opendir ("/proc/scsi");
+	if (!sdir) {
+		fprintf (stderr, "can't read /proc/scsi/: %s\n",
+			 strerror (errno));
+		abort ();
+	}
+	while (1) {
+		int fd;
+		sde = readdir (sdir);
+		if (!sde)
+			break;
+		if (!strcmp (sde->d_name, "scsi") || *sde->d_name == '.')
+			continue;
+		strcpy (phost, sde->d_name);
+		strcat (phost, num);
+		fd = open (path, O_RDONLY);
+		if (fd > 0) {
+			char * nm = strdup (sde->d_name);
+			close (fd);
+			closedir (sdir);
+			return nm;
+		}
+	}
+	closedir (sdir);
+	return 0;
+}
+
+unsigned int find_ioport (const char* nm)
+{
+	unsigned char lnbuf[128];
+	char nm2[64]; char *nmptr;
+	char * buf;
+	FILE * iop = fopen ("/proc/ioports", "r");
+	if (!iop)
+		return 0;
+	/* nm2 = to_lower (nm); */
+	strcpy (nm2, nm);
+	for (nmptr = nm2; *nmptr; ++nmptr)
+		*nmptr = tolower (*nmptr);
+	
+	while (!feof (iop)) {
+		unsigned int io1, io2;
+		char name[64];
+		buf = fgets (lnbuf, 128, iop);
+		if (!buf)
+			break;
+		sscanf (lnbuf, " %x-%x : %s", &io1, &io2, name);
+		if (!strcmp (name, "PCI"))
+			continue;
+		/* name = to_lower (name); */
+		for (nmptr = name; *nmptr; ++nmptr)
+			*nmptr = tolower (*nmptr);
+		if (!strcmp (nm2, name)) {
+			fclose (iop);
+			return io1;
+		}
+	}
+	fclose (iop);
+	return 0;
+}
+
+char* sysfs_findhostname (sname *sdev)
+{
+	char buf[128]; FILE* f; char* ptr;
+	strcpy (buf, "/sys/class/scsi_host/");
+	sprintf (buf+strlen(buf), "host%d/", sdev->hostnum);
+	ptr = buf+strlen(buf);
+	strcat (buf, "unique_id");
+	f = fopen (buf, "r");
+	if (!f) {
+		fprintf (stderr, "Could not open \"%s\"!\n", buf);
+		return 0;
+	}
+	fscanf (f, "%i", &sdev->hostid);
+	fclose (f);
+	*ptr = 0;
+	strcat (buf, "name");	// used to be device/name
+	f = fopen (buf, "r");
+	if (f) {
+		char buf2[128];
+		fgets (buf2, 127, f);
+		if (buf2[strlen(buf2)-1] == '\n')
+			buf2[strlen(buf2)-1] = 0;
+		sdev->hostname = strdup (buf2);
+		fclose (f);
+	}
+	*ptr = 0; 
+	strcat (buf, "proc_name");
+	f = fopen (buf, "r");
+	if (!f) {
+		fprintf (stderr, "Could not open \"%s\"!\n", buf);
+		return 0;
+	}
+	fgets (buf, 127, f);
+	fclose (f);
+	if (buf[strlen(buf)-1] == '\n')
+		buf[strlen(buf)-1] = 0;
+	return strdup (buf);
+}
+
+/* Fill in the host adapter name and id (hostnum set) */
+int find_host (sname * spnt)
+{
+	spnt->shorthostname = find_scsihostname (spnt->hostnum);
+	if (!spnt->shorthostname) 
+		spnt->shorthostname = sysfs_findhostname (spnt);
+	if (!spnt->shorthostname) {
+		fprintf (stderr, "scsidev: warning: could not deduce hostname & hostid\n");
+		return -1;
+	}
+	if (!spnt->hostname)
+		spnt->hostname = strdup (spnt->shorthostname);
+	if (!spnt->hostid)
+		spnt->hostid = find_ioport (spnt->shorthostname);
+	return 0;
+}
+
+void fill_in_proc (sname * spnt)
+{
+	int fd;
+	if (find_host (spnt))
+		return;
+
+	/* Don't overwrite device type! It should have been filled correctly
+	 * and with matching major/minor before. */
+	// spnt->devtp = inq_devtp_to_devtp (spnt->inq_devtp, spnt);/
+
+	unlinkat (testdev_fd, TESTNM, 0);
+	fd = mknodat (testdev_fd, TESTNM, 0600 | (isblk(spnt->devtp)? S_IFBLK: S_IFCHR),
+		    makedev (spnt->major, spnt->minor));
+	if (fd) {
+		fprintf (stderr, "scsidev: Can't mknod " TESTDEV ": %s\n",
+			 strerror (errno));
+		return;
+	}
+	fd = openat (testdev_fd, TESTNM, O_RDWR | O_NONBLOCK);
+	unlinkat (testdev_fd, TESTNM, 0);
+	if (fd == -1) {
+	    char buf[64];
+            sprintf(buf, "open %s %03x:%05x",
+		   isblk(spnt->devtp)? "b": "c", spnt->major, spnt->minor); 
+	    perror(buf);
+	    return;
+	}
+	inquiry (fd, spnt);
+	get_hsv_os_id(fd, spnt);
+	close (fd);
+	//scsiname (spnt);
+}
+		
+
+void fill_in_sg (sname * spnt)
+{
+	int status; int fd;
+
+	errno = 0;
+	unlinkat (testdev_fd, TESTNM, 0);
+	status = mknodat (testdev_fd, TESTNM, 0600 | S_IFCHR,
+			makedev (spnt->major, spnt->minor));
+	if (status) { 
+		perror ("scsidev: mknod"); 
+		exit (3); 
+	}
+	fd = openat (testdev_fd, TESTNM, O_RDWR);
+	unlinkat (testdev_fd, TESTNM, 0);
+	getscsiinfo (fd, spnt, 0);
+	close (fd);
+	spnt->shorthostname = find_scsihostname (spnt->hostnum);
+	if (spnt->hostid == 0 && spnt->shorthostname)
+		spnt->hostid = find_ioport (spnt->shorthostname);
+}
+
+
+
+/* Create device nodes etc. */
+void dev_specific_setup (sname * spnt)
+{
+	if (verbose >= 2) {
+		printf ("dev_specific_setup () for %s\n",
+			spnt->name);
+		dumpentry (spnt);
+	}
+	create_dev (spnt, use_symlink);
+	switch (spnt->devtp) {
+	    case SG:
+	    case SR:
+	    case SCH:
+		break;
+	    case ST:
+	    case OSST:
+		create_ntape (spnt);
+		break;
+	    case SD:
+		spnt->partition = -1;
+		create_partitions (spnt);
+		break;
+	    default: 
+		fprintf (stderr, "scsidev: Unset dev type! Oops!\n");
+		dumpentry (spnt);
+		abort ();
+	}
+}
+
+/* access a dev that's unlikely to exist to trigger module loads
+ * with a minimum of side effects */
+void trigger_one_mod (char blk, int major, int minor)
+{
+	int fd;
+	fd = mknodat (testdev_fd, TESTNM, blk? S_IFBLK: S_IFCHR, makedev (major, minor));
+	if (fd)
+		return;
+	fd = openat (testdev_fd, TESTNM, O_RDWR | O_NONBLOCK);
+	if (fd > 0)
+		close (fd);
+	unlinkat (testdev_fd, TESTNM, 0);
+}
+
+void trigger_module_loads ()
+{
+	unlinkat (testdev_fd, TESTNM, 0);
+	/* sd */
+	trigger_one_mod (1, SCSI_DISK0_MAJOR, 255);
+	/* sr */
+	trigger_one_mod (1, SCSI_CDROM_MAJOR, 255);
+	/* osst */
+	trigger_one_mod (0, OSST_MAJOR, 255);
+	/* st */
+	trigger_one_mod (0, SCSI_TAPE_MAJOR, 255);
+	/* sch */
+	trigger_one_mod (0, SCSI_CHANGER_MAJOR, 255);
+	/* sg */
+	trigger_one_mod (0, SCSI_GENERIC_MAJOR, 255);
+}
+
+struct sysfsdev {
+	int maj, min;
+	char nm[23];
+	char blk;
+};
+
+struct sysfsdev sysfsdevs[2];
+
+
+/* Strip /dev part from nm and readlink the device name */
+void sysfs_get_dev_nm (char* nm, struct sysfsdev* sysfsdevptr)
+{
+	char buf[128];
+	char* ptr = strrchr (nm, '/');
+	int ln;
+	*ptr = 0;
+	ln = readlink (nm, buf, 128);
+	buf[ln] = 0;
+	ptr = strrchr (buf, '/');
+	strcpy (sysfsdevptr->nm, ptr+1);
+}
+
+void sysfs_get_generic_nm (char* nm, struct sysfsdev* sysfsdevptr)
+{
+	char buf[128]; char *ptr;
+	int ln;
+	ln = readlink (nm, buf, 128);
+	buf[ln] = 0;
+	ptr = strrchr (buf, '/');
+	strcpy (sysfsdevptr->nm, ptr+1);
+}
+
+FILE* sysfs_fopen_pattern(const char* basenm, const char* pat, char* nm)
+{
+	DIR *dir = opendir(basenm);
+	struct dirent *dent;
+	const ssize_t ln = strlen(pat);
+	if (!dir)
+		return NULL;
+	while (dent = readdir(dir)) {
+		if (0 == memcmp(pat, dent->d_name, ln)) {
+			strcpy(nm, basenm);
+			strcat(nm, dent->d_name);
+			strcat(nm, "/dev");
+			return fopen(nm, "r");
+		}
+	}
+	return NULL;
+}
+
+int sysfs_read_devinfo(char* basenm, struct sysfsdev* sysfsptr, 
+		       sname * spnt, char* suffix, char blk)
+{
+	FILE* f;
+	char nm[128];
+	strcpy(nm, basenm);
+	strcat(nm, suffix);
+	strcat(nm, "/dev");
+	f = fopen(nm, "r");
+	if (!f) {
+		f = sysfs_fopen_pattern(basenm, suffix, nm);
+		if (!f)
+			return 0;
+	}
+	sysfsptr->blk = blk;
+	fscanf(f, "%i:%i", &sysfsptr->maj, &sysfsptr->min);
+	sysfs_get_dev_nm(nm, sysfsptr);
+	if (verbose > 1)
+		printf ("sysfs_read_devinfo %d:%d:%d:%d -> %s(%c %x:%x)\n",
+			spnt->hostnum, spnt->chan, spnt->id, spnt->lun,
+			sysfsptr->nm, blk? 'b': 'c',
+			sysfsptr->maj, sysfsptr->min);
+	fclose(f);
+	return 1;
+}
+
+
+int sysfs_getinfo (sname * spnt)
+{
+	char nm[128]; 
+	int dev = 0;
+	int inq_devtp;
+	FILE* f;
+
+	strcpy (nm, "/sys/class/scsi_device/");
+	sprintf (nm+strlen(nm), "%d:%d:%d:%d",
+		 spnt->hostnum, spnt->chan, spnt->id, spnt->lun);
+	strcat (nm, "/device/");
+	/* sysfs devs */
+	dev += sysfs_read_devinfo(nm, sysfsdevs+dev, spnt, "block", 1);
+	dev += sysfs_read_devinfo(nm, sysfsdevs+dev, spnt, "tape", 0);
+	dev += sysfs_read_devinfo(nm, sysfsdevs+dev, spnt, "generic", 0);
+	
+	strcat (nm, "type");
+	f = fopen (nm, "r");
+	if (!f)
+		return 0;
+	fscanf (f, "%i", &inq_devtp);
+	spnt->inq_devtp = inq_devtp;
+	/* TODO: Use much more info from sysfs, e.g. driver */
+	fclose (f);
+	
+	return dev;
+}	
+
+void sysfs_parse (sname *spnt, int idx)
+{	
+	char nm[23];
+	char *p1 = sysfsdevs[idx].nm, *p2 = nm;
+	
+	while (!isdigit(*p1) && *p1)
+		*p2++ = *p1++;
+	*p2 = 0;
+	spnt->oldname = strdup(sysfsdevs[idx].nm);
+	spnt->major   = sysfsdevs[idx].maj;
+	spnt->minor   = sysfsdevs[idx].min;
+	//spnt->blk     = sysfsdevs[idx].blk;
+	/* Note: We need to handle generic here, thus can't rely on inq_devtp */
+	//spnt->devtp   = inq_devtp_to_devtp(spnt->inq_devtp, spnt);
+	spnt->devtp   = nm26_to_devtp(nm);
+
+	if (verbose >= 1) {
+		dumpentry(spnt);
+		printf("Names %s, %s\n", spnt->oldname, nm);
+	}
+	scsiname(spnt);
+}
+	
+
+/* Register the hl_per_dev high level devices attached to the SCSI device
+ * spnt (which is already on reglist), fill in the missing information and
+ * create the dev nodes. The HL devs are taken from the /proc/scsi/scsi
+ * extensions in fourlnbuf or from sysfsdevs. Returns no of HL devs. */
+int setup_hl_devs (sname * spnt, int hl_per_dev)
+{
+	int hl;
+	sname *sgpnt = 0;
+
+	if (verbose > 1)
+		printf ("dev %d:%d:%d:%d: %i drivers\n",
 			spnt->hostnum, spnt->chan, spnt->id, spnt->lun,
-			no+searchln);
+			hl_per_dev);
+	for (hl = 0; hl < hl_per_dev; ++hl) {
+		if (hl) {
+			spnt = sname_dup (spnt);
+			spnt->major = 0;
+		}
+		spnt->partition = -1;
+		procscsiext_parse (spnt, hl);
+		if (spnt->major == 0)
+			sysfs_parse (spnt, hl);
+		/* Only now it has its own name */
+		if (hl)
+			reg_add (spnt);
+		if (spnt->devtp == SG)
+			sgpnt = spnt;
+	}
+	/* Fill in missing information (inquiry, host adapter name ...) */
+	if (sgpnt)
+		fill_in_sg (sgpnt);
+	if (!spnt->shorthostname)
+		fill_in_proc (spnt);
+	if (!sgpnt)
+	    sgpnt = spnt;
+	/* Copy info to the colleagues
+	 * and do special stuff depending on dev types. Such as the non-rew.
+	 * variant for tapes or the partitions on disks
+	 */
+	for (hl = 0; hl < hl_per_dev; ++hl, spnt = spnt->next) {
+		if (spnt != sgpnt) {
+			if (sgpnt->serial)
+				spnt->serial = strdup (sgpnt->serial);
+			spnt->wwid = sgpnt->wwid;
+			spnt->desigs = sgpnt->desigs;
+			spnt->rmvbl = sgpnt->rmvbl;
+			//spnt->unsafe = sgpnt->unsafe;
+			spnt->hostid = sgpnt->hostid;
+			if (sgpnt->hostname)
+				spnt->hostname = strdup (sgpnt->hostname);
+			if (sgpnt->shorthostname)
+				spnt->shorthostname = strdup (sgpnt->shorthostname);
+			spnt->related = sgpnt;
+		}
+#if 1
+		/* This does the handling of the dev nodes */
+		dev_specific_setup (spnt);
+#endif
+	}
+	return hl_per_dev;
+}
+
+/* Build device list by reading /proc/scsi/scsi with extensions from scsi-many or sysfs */
+void build_sgdevlist_procscsi ()
+{
+	FILE* scsifile;
+	sname * spnt;
+	int rdevs = 0, hdevs = 0;
+
+	if (devscsi_fd < 0)
+		return;
+
+	unlinkat (testdev_fd, TESTNM, 0);
+	
+	if (verbose >= 1)
+		fprintf (stderr, "Building device list using " PROCSCSI "\n");
+	
+	scsifile = fopen (PROCSCSI, "r");
+	if (!scsifile) {
+		fprintf (stderr, "scsidev: could not open " PROCSCSI ": %s\n",
+			 strerror (errno));
+		return;
+	}
+	fclose (scsifile);
+    
+	scsifile = fopen (PROCSCSI, "r");
+	/* parse /proc/scsi */
+	while (!feof (scsifile)) {
+		int hl_per_dev;
+		if (procscsi_readrecord (scsifile))
+			break;
+		++rdevs;
+		spnt = malloc (sizeof (sname));
+		memset (spnt, 0, sizeof (sname));
+		hl_per_dev = procscsi_parse (spnt);
+		if (!hl_per_dev || hl_per_dev == EOF) 
+			hl_per_dev = sysfs_getinfo (spnt);
+		if (!hl_per_dev || hl_per_dev == EOF) {
+			free (spnt);
+			fprintf (stderr, "Low level dev without HL driver?\n");
+			continue;
+		}
+		reg_add (spnt);
+		hdevs += setup_hl_devs (spnt, hl_per_dev);
+	}
+	if (verbose >= 1) {
+		printf ("%i real SCSI devices found, %i high level devs attached\n",
+			rdevs, hdevs);
+		dumplist ();
+	}
+}
+	
+
+/* Test for availability of /proc/scsi/scsi extensions */
+int procscsi_ext_status ()
+{
+	int n;
+	FILE *f = fopen (PROCSCSI, "r");
+	if (!f) {
+		fprintf (stderr, "scsidev: " PROCSCSI " does not exist?\n");
+		return 0;
+	}
+	n = procscsi_readrecord (f);
+	fclose (f);
+	/* We don't know ... */
+	if (n < 0)
+		return 1;
+	if (fourlnbuf[3][0])
+		return 1;
+	else
+		return 0;
+}
+
+/* Try to switch on extensions */
+int procscsi_ext_on ()
+{
+	FILE *f = fopen (PROCSCSI, "w");
+	if (!f) {
+		fprintf (stderr, "scsidev: " PROCSCSI ": %s\n",
+			 strerror (errno));
+		return -1;
+	}
+	fprintf (f, "scsi report-devs 1\n");
+	fclose (f);
+	//fprintf (stderr, "Switched on " PROCSCSI " extensions\n");
+	return 0;
+}
+
+/* Try to switch on extensions */
+int procscsi_ext_off ()
+{
+	FILE *f = fopen (PROCSCSI, "w");
+	if (!f) {
+		fprintf (stderr, "scsidev: " PROCSCSI ": %s\n",
+			 strerror (errno));
+		return -1;
+	}
+	fprintf (f, "scsi report-devs 0\n");
+	fclose (f);
+	//fprintf (stderr, "Switched off " PROCSCSI " extensions\n");
+	return 0;
+}
+
+
+int try_procscsi ()
+{
+	int se_status = procscsi_ext_status();
+	if (!se_status)
+		procscsi_ext_on();
+	if (!procscsi_ext_status())
+		return -1;
+	
+	build_sgdevlist_procscsi(0);
+	
+	if (!se_status)
+		procscsi_ext_off();
+	return 0;
+}
+
+
+
+/* Try sysfs */
+int find_sysfs ()
+{
+	DIR *sdev_dir = opendir("/sys/class/scsi_device");
+	if (!sdev_dir)
+		return -1;
+	closedir (sdev_dir);
+	build_sgdevlist_procscsi(1);
+	return 0;
+}
+
+
+#define MAXLUNS 512
+#define RLUNBUFSZ (8 + 8*MAXLUNS)
+
+/* Register one SCSI device host:chan:id:lun found in sysfs
+ * and create its dev nodes. */
+int sysfs_scan_dev (int hnum, int chan, int id, int lun)
+{
+	int hl_per_dev;
+	sname * spnt = malloc (sizeof (sname));
+	memset (spnt, 0, sizeof (sname));
+	spnt->hostnum = hnum; spnt->chan = chan;
+	spnt->id = id; spnt->lun = lun;
+	/* No /proc/scsi/scsi extensions record for this one */
+	fourlnbuf[3][0] = 0;
+	hl_per_dev = sysfs_getinfo (spnt);
+	if (hl_per_dev <= 0) {
+		free (spnt);
+		return -1;
+	}
+	reg_add (spnt);
+	setup_hl_devs (spnt, hl_per_dev);
+	return 0;
+}
+
+/* Collect the LUNs sysfs knows for host:chan:id */
+int sysfs_target_luns (int hnum, int chan, int id, int *luns, int maxluns)
+{
+	struct dirent *de;
+	int n = 0;
+	DIR *sdir = opendir (SYSSCSIDEV);
+	if (!sdir)
+		return -1;
+	while ((de = readdir (sdir)) != NULL) {
+		int h, c, i, l;
+		if (sscanf (de->d_name, "%d:%d:%d:%d", &h, &c, &i, &l) != 4)
+			continue;
+		if (h == hnum && c == chan && i == id && n < maxluns)
+			luns[n++] = l;
+	}
+	closedir (sdir);
+	return n;
+}
+
+/* Have the kernel probe host:chan:id:lun through the sysfs scan file */
+int sysfs_scan_lun (int hnum, int chan, int id, int lun)
+{
+	char nm[64];
+	FILE *f;
+	sprintf (nm, "/sys/class/scsi_host/host%d/scan", hnum);
+	/* --dry-run: The LUN won't show up then */
+	if (dry_run) {
+		printf ("%-9s%s %d %d %d\n", "scan", nm, chan, id, lun);
+		return -1;
+	}
+	f = fopen (nm, "w");
+	if (!f) {
+		fprintf (stderr, "scsidev: could not open %s: %s\n",
+			 nm, strerror (errno));
+		return -1;
+	}
+	fprintf (f, "%d %d %d\n", chan, id, lun);
+	if (fclose (f)) {
+		fprintf (stderr, "scsidev: scan of %d:%d:%d:%d failed: %s\n",
+			 hnum, chan, id, lun, strerror (errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Send REPORT LUNS and decode the list like the kernel's
+ * scsilun_to_int () does. Returns no of LUNs or -1. */
+int report_luns (int fd, int *luns, int maxluns)
+{
+	unsigned char buf[RLUNBUFSZ + 8];
+	unsigned char sense[32];
+	unsigned char cmd[12] = { 0xa0, 0x00, 0x00 /* all LUs */, 0x00, 0x00, 0x00,
+				  RLUNBUFSZ >> 24, (RLUNBUFSZ >> 16) & 0xff,
+				  (RLUNBUFSZ >> 8) & 0xff, RLUNBUFSZ & 0xff,
+				  0x00, 0x00 };
+	unsigned int len, i;
+	int n = 0;
+
+	if (scsi_cmd (fd, RLUNBUFSZ, cmd, 12, buf, sizeof (buf),
+		      sense, sizeof (sense)))
+		return -1;
+	len = buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+	if (len > RLUNBUFSZ - 8) {
+		fprintf (stderr, "scsidev: REPORT LUNS truncated to %i LUNs\n",
+			 (RLUNBUFSZ - 8) / 8);
+		len = RLUNBUFSZ - 8;
+	}
+	for (i = 0; i < len / 8 && n < maxluns; ++i) {
+		unsigned char *lp = buf + 8 + 8*i;
+		unsigned long long lun = 0;
+		int j;
+		for (j = 0; j < 8; j += 2)
+			lun |= (unsigned long long)(lp[j] << 8 | lp[j+1]) << (j * 8);
+		if (lun > 0x7fffffff) {
+			if (verbose)
+				printf ("Skipping LUN %Lx\n", lun);
+			continue;
+		}
+		luns[n++] = lun;
+	}
+	return n;
+}
+
+/* Targeted rescan: Get the LUN list of host:chan:id by REPORT LUNS,
+ * make the kernel scan the LUNs it does not know yet and create
+ * the device nodes for only those. Returns no of new devices or -1 */
+int rescan_target (int hnum, int chan, int id)
+{
+	int known[MAXLUNS], luns[MAXLUNS];
+	int nknown, nluns, i, j, fd, added = 0;
+	struct sysfsdev *sdev;
+	sname probe;
+
+	nknown = sysfs_target_luns (hnum, chan, id, known, MAXLUNS);
+	if (nknown < 0) {
+		fprintf (stderr, "scsidev: can't read " SYSSCSIDEV ": %s\n",
+			 strerror (errno));
+		return -1;
+	}
+	/* We need some LU to talk to, LUN 0 has to answer REPORT LUNS */
+	if (!nknown) {
+		if (sysfs_scan_lun (hnum, chan, id, 0))
+			return dry_run? 0: -1;
+		nknown = sysfs_target_luns (hnum, chan, id, known, MAXLUNS);
+		if (nknown <= 0) {
+			fprintf (stderr, "scsidev: no device found at %d:%d:%d\n",
+				 hnum, chan, id);
+			return -1;
+		}
+		if (!sysfs_scan_dev (hnum, chan, id, known[0]))
+			++added;
+	}
+
+	memset (&probe, 0, sizeof (sname));
+	probe.hostnum = hnum; probe.chan = chan;
+	probe.id = id; probe.lun = known[0];
+	i = sysfs_getinfo (&probe);
+	if (i <= 0) {
+		fprintf (stderr, "scsidev: no HL device for %d:%d:%d:%d\n",
+			 hnum, chan, id, known[0]);
+		return -1;
+	}
+	/* sg is last, if attached */
+	sdev = sysfsdevs + i - 1;
+	fd = open_testdev (sdev->blk, sdev->maj, sdev->min, O_RDWR | O_NONBLOCK);
+	if (fd < 0) {
+		fprintf (stderr, "scsidev: can't open %s: %s\n",
+			 sdev->nm, strerror (errno));
+		return -1;
+	}
+	nluns = report_luns (fd, luns, MAXLUNS);
+	close (fd);
+	if (nluns < 0) {
+		fprintf (stderr, "scsidev: REPORT LUNS failed for %d:%d:%d\n",
+			 hnum, chan, id);
+		return -1;
+	}
+
+	for (i = 0; i < nluns; ++i) {
+		for (j = 0; j < nknown; ++j)
+			if (known[j] == luns[i])
+				break;
+		if (j < nknown)
+			continue;
+		if (!quiet)
+			printf ("Scanning new LUN %d:%d:%d:%d\n",
+				hnum, chan, id, luns[i]);
+		if (sysfs_scan_lun (hnum, chan, id, luns[i]))
+			continue;
+		if (sysfs_scan_dev (hnum, chan, id, luns[i]))
+			fprintf (stderr, "scsidev: LUN %d:%d:%d:%d did not show up\n",
+				 hnum, chan, id, luns[i]);
+		else
+			++added;
+	}
+	if (!quiet)
+		printf ("%i new LUNs on %d:%d:%d\n", added, hnum, chan, id);
+	return added;
+}
+
+
+/* Serialize concurrent scsidev runs and coalesce their full scans.
+ * The lock file has two byte range locks: Byte 0 protects the
+ * scan counters stored in the file, byte 1 is held while working on
+ * /dev/scsi. A full scan that was started after we arrived makes our
+ * own full scan unnecessary; so if many instances get started at the
+ * same time, the waiters only need one more scan between them. */
+#define STATE_LOCK 0
+#define RUN_LOCK 1
+
+int lock_fd = -1;
+unsigned long cur_scan;
+
+static int lock_byte (int byte, int type)
+{
+	struct flock fl;
+	memset (&fl, 0, sizeof (fl));
+	fl.l_type = type; fl.l_whence = SEEK_SET;
+	fl.l_start = byte; fl.l_len = 1;
+	while (fcntl (lock_fd, F_SETLKW, &fl)) {
+		if (errno != EINTR)
+			return -1;
+	}
+	return 0;
+}
+
+/* LOCKFILE has the no of the last started and completed scan and the
+ * options fingerprint of the completed one */
+static void read_scan_gen (unsigned long *started, unsigned long *completed,
+			   unsigned int *fp)
+{
+	char buf[64];
+	int ln = pread (lock_fd, buf, sizeof (buf) - 1, 0);
+	*started = *completed = 0; *fp = 0;
+	if (ln <= 0)
+		return;
+	buf[ln] = 0;
+	sscanf (buf, "%lu %lu %x", started, completed, fp);
 }
 
+static void write_scan_gen (unsigned long started, unsigned long completed,
+			    unsigned int fp)
+{
+	char buf[64];
+	int ln = sprintf (buf, "%lu %lu %08x\n", started, completed, fp);
+	if (pwrite (lock_fd, buf, ln, 0) != ln || ftruncate (lock_fd, ln))
+		perror ("scsidev: write " LOCKFILE);
+}
 
-/* Create dev entries for a disk */
-int build_disk (sname * spnt, int no)
+/* Fingerprint of the options that make a difference for a full scan;
+ * only a scan with the same ones can do our job */
+static unsigned int scan_fingerprint ()
 {
-    int minor; int fd; int status;
-    sname * spnt1 = sname_dup (spnt);
-    findscsidisk(spnt1, no);
-    spnt->partition = -1;
-    spnt1->devtp = SD;
-    scsiname (spnt1); oldscsiname (spnt1);
-    spnt1->next = reglist; reglist = spnt1;
-    create_dev (spnt1, use_symlink);
-    spnt->related = spnt1;
-    /* Check if device is there (i.e. medium inside) */
-    fd =  open (spnt1->name, O_RDONLY | O_NONBLOCK);
-    /* No access to medium / part. table */
-    if (fd < 0) {
-	spnt1->unsafe = 1;
-	/* If it is a removable device, we can't do much more than 
-	 * trusting it or not support it at all */
-	if (spnt1->rmvbl && supp_rmvbl) 
-	    return 0;
-	fprintf (stderr, "Can't access %sremovable %s, which should "
-		 "be equal to %s!\n", (spnt1->rmvbl? "": "NON-"), 
-		 strrchr (spnt1->name, '/') + 1,
-		 strrchr (spnt->name, '/') + 1);
-	/* We don't unlink spnt1->name! Let sanitize take care of it ... */
-	reglist = spnt1->next; free (spnt1->name); 
-	spnt->related = 0; free (spnt1);
-	return 1;
-    }
-	
-    /* Sanity checks */
-    status = getscsiinfo (fd, spnt1, 1);
-    close (fd);
-    if (status) 
-	fprintf (stderr, "scsidev: Strange: Could not get info from %s\n",
-		 strrchr (spnt1->name, '/') + 1);
-    if (sname_cmp (spnt, spnt1)) {
-	fprintf (stderr, "scsidev: What's going on? Dev %s is different from %s\n", 
-		 strrchr (spnt1->name, '/') + 1, strrchr (spnt->name, '/') + 1);
-	spnt -> related = 0; spnt1 -> related = 0;
-	/* And now ? */
-	reglist = spnt1->next; free (spnt1->name); 
-	spnt->related = 0; free (spnt1);
-	return 1;
-    }
-    /* Now do a partition scan ... */
-    spnt = spnt1;
-    for (minor = spnt1->minor+1; minor % 16; minor++) {
-	struct stat statbuf; int status;
-	status = stat (TESTDEV, &statbuf);
-	if (status == 0)
-	    unlink (TESTDEV);
-	    
-	status = mknod ( TESTDEV, 0600 | S_IFBLK,
-			 makedev (spnt1->major, minor) );
-	fd = open (TESTDEV, O_RDONLY | O_NONBLOCK);
-	unlink (TESTDEV);
-	if (fd < 0) 
-	    continue;
-	// TODO: Add sanity checks here ??
-	close (fd);
-	spnt1 = sname_dup (spnt);
-	spnt1->partition = minor % 16;
-	spnt1->minor = minor;
-	scsiname (spnt1); oldscsiname (spnt1);
-	spnt1->next = reglist; reglist = spnt1;
-	create_dev (spnt1, use_symlink);
-    }
-    return 0;
+	char buf[PATH_MAX + 128];
+	snprintf (buf, sizeof (buf), "%d %d %d %d %d %d %d %d %d %d %d %d %d %o %d %d %s",
+		  force, staged, use_symlink, symlink_alias, nm_cbtu, shard,
+		  use_scd, supp_multi, supp_rmvbl, san_del, no_san, 
+		  no_procscsi, no_sysfs, filemode, maxmiss, early, scsialias);
+	return hash_str (buf);
 }
 
-int build_tape (sname * spnt, int no)
+/* Get the run lock. For full scans, returns 1 if someone else did a
+ * full scan with the same options for us meanwhile; the lock is held 
+ * nevertheless and needs to be released by run_unlock (0). 
+ * --dry-run scans don't count. */
+int run_lock (int full)
 {
-    int fd; int status;
-    sname * spnt1 = sname_dup (spnt);
-    spnt1->major = SCSI_TAPE_MAJOR;
-    spnt1->minor = no;
-    spnt1->devtp = ST;
-    scsiname (spnt1); oldscsiname (spnt1);
-    spnt1->next = reglist; reglist = spnt1;
-    create_dev (spnt1, use_symlink);
-    /* Check if device is there (i.e. medium inside) */
-    fd =  open (spnt1->name, O_RDONLY | O_NONBLOCK);
-    if (fd < 0) {
-	/* Tapes are always accessible, as they are char devices */
-	fprintf (stderr, "Can't access tape %s, which should "
-		 "be equal to %s!\n", strrchr (spnt1->name, '/') + 1,
-		 strrchr (spnt->name, '/') + 1);
-	/* We don't unlink spnt1->name! Let sanitize take care of it ... */
-	reglist = spnt1->next; free (spnt1->name); 
-	spnt->related = 0; free (spnt1);
-	return 1;
-    }
-    /* Do a sanity check here */
-    status = getscsiinfo (fd, spnt1, 1);
-    close (fd);
-    if (status) 
-	fprintf (stderr, "scsidev: Strange: Could not get info from %s\n",
-		 strrchr (spnt1->name, '/') + 1);
-    if (sname_cmp (spnt, spnt1)) {
-	fprintf (stderr, "scsidev: What's going on? Dev %s is different from %s\n", 
-		 strrchr (spnt1->name, '/') + 1, strrchr (spnt->name, '/') + 1);
-	spnt -> related = 0; spnt1 -> related = 0;
-	/* And now ? */
-	reglist = spnt1->next; free (spnt1->name); 
-	spnt->related = 0; free (spnt1);
-	return 1;
-    }
-    /* And create the no-rewind alias */
-    spnt1 = sname_dup (spnt1);
-    spnt1->minor |= 0x80;
-    scsiname (spnt1); oldscsiname (spnt1);
-    spnt1->next = reglist; reglist = spnt1;
-    create_dev (spnt1, use_symlink);
-	
-    return 0;
+	unsigned long started, completed, need;
+	unsigned int fp, ourfp = scan_fingerprint ();
+	/* Others may have changed DEVSCSI while we waited */
+	snap_drop ();
+	perm_drop ();
+	if (lock_fd < 0) {
+		mkdir (STATEDIR, 0755);
+		lock_fd = open (LOCKFILE, O_RDWR | O_CREAT, 0644);
+		if (lock_fd < 0) {
+			if (verbose)
+				fprintf (stderr, "scsidev: can't open " LOCKFILE ": %s\n",
+					 strerror (errno));
+			return 0;
+		}
+	}
+	if (!full || dry_run)
+		return lock_byte (RUN_LOCK, F_WRLCK), 0;
+
+	/* The next scan to be started will do */
+	lock_byte (STATE_LOCK, F_WRLCK);
+	read_scan_gen (&started, &completed, &fp);
+	need = started + 1;
+	lock_byte (STATE_LOCK, F_UNLCK);
+
+	lock_byte (RUN_LOCK, F_WRLCK);
+	lock_byte (STATE_LOCK, F_WRLCK);
+	read_scan_gen (&started, &completed, &fp);
+	if (completed >= need && fp == ourfp) {
+		lock_byte (STATE_LOCK, F_UNLCK);
+		if (verbose)
+			printf ("Full scan %lu done by concurrent scsidev\n", completed);
+		return 1;
+	}
+	cur_scan = ++started;
+	write_scan_gen (started, completed, fp);
+	lock_byte (STATE_LOCK, F_UNLCK);
+	return 0;
 }
 
-/* Create non-rew. alternative for a tape */
-void create_ntape (sname * spnt)
+void run_unlock (int full)
 {
-	sname * spnt1 = sname_dup (spnt);
-	spnt1->minor |= 0x80;
-	scsiname (spnt1); oldscsiname (spnt1);
-	create_dev (spnt1, use_symlink);
-	spnt1->next = reglist; reglist = spnt1;
+	unsigned long started, completed;
+	unsigned int fp;
+	perm_save ();
+	/* A partly applied plan leaves /dev/scsi out of sync with the
+	 * snapshot; drop INVENTORY so the next run reads the dir again */
+	if (plan_apply () < 0) {
+		if (!dry_run)
+			unlink (INVENTORY);
+	} else
+		inv_save ();
+	if (lock_fd < 0)
+		return;
+	if (full && !dry_run) {
+		lock_byte (STATE_LOCK, F_WRLCK);
+		read_scan_gen (&started, &completed, &fp);
+		if (cur_scan > completed)
+			write_scan_gen (started, cur_scan, scan_fingerprint ());
+		lock_byte (STATE_LOCK, F_UNLCK);
+	}
+	lock_byte (RUN_LOCK, F_UNLCK);
 }
 
-int build_os_tape (sname * spnt, int no)
+/* Find all devices and register them (and create their nodes) */
+void build_devlist ()
 {
-    int fd; int status;
-    sname * spnt1 = sname_dup (spnt);
-    spnt1->major = OSST_MAJOR;
-    spnt1->minor = no;
-    spnt1->devtp = OSST;
-    scsiname (spnt1); oldscsiname (spnt1);
-    spnt1->next = reglist; reglist = spnt1;
-    create_dev (spnt1, use_symlink);
-    /* Check if device is there (i.e. medium inside) */
-    fd =  open (spnt1->name, O_RDONLY | O_NONBLOCK);
-    if (fd < 0) {
-	/* OnStream tapes are NOT always accessible, as they have a heavy open() function */
-	spnt1->unsafe = 1;
-	if (!quiet || !supp_rmvbl) 
-	    fprintf (stderr, "Can't access tape %s, which should "
-		     "be equal to %s!\n", strrchr (spnt1->name, '/') + 1,
-		     strrchr (spnt->name, '/') + 1);
-	if (supp_rmvbl) 
-	    goto osst_force_success;
-	/* We don't unlink spnt1->name! Let sanitize take care of it ... */
-	reglist = spnt1->next; free (spnt1->name); 
-	spnt->related = 0; free (spnt1);
-	return 1;
-    }
-    /* Do a sanity check here */
-    status = getscsiinfo (fd, spnt1, 1);
-    close (fd);
-    if (status) 
-	fprintf (stderr, "scsidev: Strange: Could not get info from %s\n",
-		 strrchr (spnt1->name, '/') + 1);
-    if (sname_cmp (spnt, spnt1)) {
-	fprintf (stderr, "scsidev: What's going on? Dev %s is different from %s\n", 
-		 strrchr (spnt1->name, '/') + 1, strrchr (spnt->name, '/') + 1);
-	spnt -> related = 0; spnt1 -> related = 0;
-	/* And now ? */
-	reglist = spnt1->next; free (spnt1->name); 
-	spnt->related = 0; free (spnt1);
-	return 1;
+#ifdef DEBUG
+    register_dev("/dev/scsi/sdh4-334c0i0l0",  8,  0, SD, 6, 0x334, 0, 0, 0, -1, "debug", 0, NULL, NULL);
+    register_dev("/dev/scsi/sdh4-334c0i0l0p1",8,  1, SD, 6, 0x334, 0, 0, 0,  1, "debug", 0, NULL, NULL);
+    register_dev("/dev/scsi/sdh4-334c0i0l0p2",8,  2, SD, 6, 0x334, 0, 0, 0,  2, "debug", 0, NULL, NULL);
+    register_dev("/dev/scsi/sdh4-334c0i0l0p3",8,  3, SD, 6, 0x334, 0, 0, 0,  3, "debug", 0, NULL, NULL);
+    register_dev("/dev/scsi/sgh4-334c0i0l0", 21,  0, SG, 6, 0x334, 0, 0, 0, -1, "debug", 0, NULL, NULL);
+    register_dev("/dev/scsi/sgh4-334c0i2l0", 21,  1, SG, 6, 0x334, 0, 2, 0, -1, "debug", 0, NULL, NULL);
+    register_dev("/dev/scsi/sgh4-334c0i5l0", 21,  2, SG, 6, 0x334, 0, 5, 0, -1, "debug", 0, NULL, NULL);
+    register_dev("/dev/scsi/srh4-334c0i2l0", 11,  0, SR, 6, 0x334, 0, 2, 0, -1, "debug", 0, NULL, NULL);
+    register_dev("/dev/scsi/sth4-334c0i5l0",  9,  0, ST, 6, 0x334, 0, 5, 0, -1, "debug", 0, NULL, NULL);
+    register_dev("/dev/scsi/rsth4-334c0i5l0", 9,128, ST, 6, 0x334, 0, 5, 0, -1, "debug", 0, NULL, NULL);
+#else
+    if (no_procscsi || try_procscsi ()) {
+	if (no_sysfs || find_sysfs ()) {
+	    if (!quiet) 
+		fprintf (stderr, "/proc/scsi/scsi extensions not found. Fall back to scanning.\n");
+	    build_sgdevlist ();
+	}
     }
- osst_force_success:
-    /* And create the no-rewind alias */
-    spnt1 = sname_dup (spnt1);
-    spnt1->minor |= 0x80;
-    scsiname (spnt1);
-    spnt1->next = reglist; reglist = spnt1;
-    create_dev (spnt1, use_symlink);
-	
-    return 0;
+#endif
+    reglist_full = 1;
 }
 
-int build_cdrom (sname * spnt, int no)
+struct hctl {
+	int hnum, chan, id, lun;
+};
+
+void unregister_hctl (const struct hctl *hctl);
+
+/* Register the other devices for the targeted modes, so the aliases
+ * can be checked for uniqueness: From INVENTORY, by a full scan if
+ * there's none */
+void register_others ()
 {
-    int fd; int status;
-    sname * spnt1 = sname_dup (spnt);
-    spnt1->major = SCSI_CDROM_MAJOR;
-    spnt1->minor = no;
-    spnt1->devtp = SR;	
-    scsiname (spnt1); oldscsiname (spnt1);
-    spnt1->next = reglist; reglist = spnt1;
-    create_dev (spnt1, use_symlink);
-    fd =  open (spnt1->name, O_RDONLY | O_NONBLOCK);
-    /* No access to medium / part. table */
-    if (fd < 0) {
-	spnt1->unsafe = 1;
-	/* Removable block devs are hairy! */
-	if (spnt1->rmvbl && supp_rmvbl) 
-	    return 0;
-	fprintf (stderr, "Can't access %sremovable %s, which should "
-		 "be equal to %s!\n", (spnt1->rmvbl? "": "NON-"), 
-		 strrchr (spnt1->name, '/') + 1,
-		 strrchr (spnt->name, '/') + 1);
-	/* We don't unlink spnt1->name! Let sanitize take care of it ... */
-	reglist = spnt1->next; free (spnt1->name); 
-	spnt->related = 0; free (spnt1);
-	return 1;
-    }
-	
-    /* Do a sanity check */
-    status = getscsiinfo (fd, spnt1, 1);
-    close (fd);
-    if (status) 
-	fprintf (stderr, "scsidev: Strange: Could not get info from %s\n",
-		 strrchr (spnt1->name, '/') + 1);
-    if (sname_cmp (spnt, spnt1)) {
-	fprintf (stderr, "scsidev: What's going on? Dev %s is different from %s\n", 
-		 strrchr (spnt1->name, '/') + 1, strrchr (spnt->name, '/') + 1);
-	/* And now ? */
-	reglist = spnt1->next; free (spnt1->name); 
-	spnt->related = 0; free (spnt1);
-	return 1;
-    }
-    return 0;
+	snap_load ();
+	if (!inv_restore ())
+		return;
+	if (!quiet)
+		fprintf (stderr, "scsidev: no devices in " INVENTORY 
+			 ", doing a full scan\n");
+	build_devlist ();
+}
+
+/* Refresh a single SCSI device given as host:chan:id:lun or as its
+ * dev node [b|c]major:minor: (Re)create its nodes and aliases and
+ * sanitize only the nodes that belonged to it. */
+int refresh_device (const char *devarg)
+{
+	int hnum, chan, id, lun, major, minor;
+	struct hctl hctl;
+	sname * dropped;
+	char tp = 0, *sel;
+
+	if (sscanf (devarg, "%d:%d:%d:%d", &hnum, &chan, &id, &lun) != 4) {
+		if (*devarg == 'b' || *devarg == 'c')
+			tp = *devarg++;
+		if (sscanf (devarg, "%d:%d", &major, &minor) != 2) {
+			fprintf (stderr, "scsidev: can't parse device \"%s\"\n", devarg);
+			return -1;
+		}
+		if ((tp == 'c' || sysfs_devt_to_hctl (1, major, minor, &hnum, &chan, &id, &lun))
+		    && (tp == 'b' || sysfs_devt_to_hctl (0, major, minor, &hnum, &chan, &id, &lun))) {
+			fprintf (stderr, "scsidev: no SCSI device %d:%d in sysfs "
+				 "(use host:chan:id:lun for removed devices)\n", 
+				 major, minor);
+			return -1;
+		}
+	}
+	register_others ();
+	/* The rules that matched it before and those that match it now */
+	sel = alias_select (hnum, chan, id, lun, NULL);
+	dropped = alias_unregister (hnum, chan, id, lun, NULL, NULL);
+	hctl.hnum = hnum; hctl.chan = chan; hctl.id = id; hctl.lun = lun;
+	unregister_hctl (&hctl);
+	if (sysfs_scan_dev (hnum, chan, id, lun) && !quiet)
+		printf ("Device %d:%d:%d:%d is gone\n", hnum, chan, id, lun);
+	sel = alias_select (hnum, chan, id, lun, sel);
+	alias_refresh (sel, dropped);
+	if (!no_san)
+		sanitize_hctl (hnum, chan, id, lun);
+	return 0;
+}
+
+
+/*************************** EVENT DAEMON ****************************/
+
+#define UEVENT_BUFSZ 8192
+#define EVT_QUIET_MS 250	/* batch is complete after this quiet time */
+#define EVT_MAX_MS 2000		/* but process at least this often */
+#define MAXBATCH 1024
+
+/* Free a list of unregistered snames; the strings may be shared among
+ * the snames of one SCSI device, so free every one only once */
+void free_snames (sname * list)
+{
+	char **strs = 0;
+	int nstrs = 0, maxstrs = 0, i;
+	sname * spnt;
+
+	while (list) {
+		char *s[9];
+		spnt = list; list = list->next;
+		s[0] = spnt->name; s[1] = spnt->oldname;
+		s[2] = spnt->manufacturer; s[3] = spnt->model;
+		s[4] = spnt->rev; s[5] = spnt->serial;
+		s[6] = spnt->hostname; s[7] = spnt->shorthostname;
+		s[8] = spnt->desigs;
+		for (i = 0; i < 9; ++i) {
+			if (!s[i] || s[i] == no_serial)
+				continue;
+			if (nstrs == maxstrs) {
+				maxstrs = maxstrs? 2*maxstrs: 64;
+				strs = realloc (strs, maxstrs * sizeof (char*));
+			}
+			strs[nstrs++] = s[i];
+		}
+		free (spnt);
+	}
+	qsort (strs, nstrs, sizeof (char*), cmp_ptr);
+	for (i = 0; i < nstrs; ++i)
+		if (!i || strs[i] != strs[i-1])
+			free (strs[i]);
+	free (strs);
+}
+
+/* Remove the devices at hctl (all aliases if hctl is NULL) from reglist */
+void unregister_hctl (const struct hctl *hctl)
+{
+	sname ** prev = &reglist;
+	sname * dropped = NULL;
+	while (*prev) {
+		sname * spnt = *prev;
+		if (hctl? (!spnt->alias && spnt->hostnum == hctl->hnum &&
+			   spnt->chan == hctl->chan && spnt->id == hctl->id &&
+			   spnt->lun == hctl->lun)
+			: spnt->alias != NULL) {
+			*prev = spnt->next;
+			reg_unindex (spnt);
+			spnt->next = dropped; dropped = spnt;
+		} else
+			prev = &spnt->next;
+	}
+	free_snames (dropped);
+}
+
+/* Open the uevent source: the kernel's netlink socket, or a local
+ * datagram socket at standin (for testing) */
+int uevent_open (const char *standin)
+{
+	int fd, bufsz = 1 << 20;
+	if (standin) {
+		struct sockaddr_un sun;
+		memset (&sun, 0, sizeof (sun));
+		sun.sun_family = AF_UNIX;
+		strncpy (sun.sun_path, standin, sizeof (sun.sun_path) - 1);
+		unlink (standin);
+		fd = socket (AF_UNIX, SOCK_DGRAM, 0);
+		if (fd < 0 || bind (fd, (struct sockaddr *) &sun, sizeof (sun))) {
+			fprintf (stderr, "scsidev: can't bind %s: %s\n",
+				 standin, strerror (errno));
+			return -1;
+		}
+	} else {
+		struct sockaddr_nl snl;
+		memset (&snl, 0, sizeof (snl));
+		snl.nl_family = AF_NETLINK;
+		snl.nl_groups = 1;	/* kernel uevents */
+		fd = socket (AF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+		if (fd < 0 || bind (fd, (struct sockaddr *) &snl, sizeof (snl))) {
+			fprintf (stderr, "scsidev: can't open uevent netlink socket: %s\n",
+				 strerror (errno));
+			return -1;
+		}
+	}
+	/* Fabric events come in bursts */
+	if (setsockopt (fd, SOL_SOCKET, SO_RCVBUFFORCE, &bufsz, sizeof (bufsz)))
+		setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &bufsz, sizeof (bufsz));
+	return fd;
+}
+
+/* Parse one uevent and add the SCSI device it is about to the batch.
+ * Returns -1 if the batch is full */
+int uevent_parse (const char *msg, int len, struct hctl *batch, int *nbatch)
+{
+	static const char *subsystems[] = { "scsi", "scsi_device", "scsi_generic",
+		"block", "scsi_tape", "scsi_changer", "onstream_tape", 0 };
+	const char *ptr, *action = 0, *devpath = 0, *subsys = 0;
+	struct hctl hctl;
+	int i;
+
+	for (ptr = msg; ptr < msg + len; ptr += strlen (ptr) + 1) {
+		if (!memcmp (ptr, "ACTION=", 7))
+			action = ptr + 7;
+		else if (!memcmp (ptr, "DEVPATH=", 8))
+			devpath = ptr + 8;
+		else if (!memcmp (ptr, "SUBSYSTEM=", 10))
+			subsys = ptr + 10;
+	}
+	if (!action || !devpath || !subsys)
+		return 0;
+	if (strcmp (action, "add") && strcmp (action, "remove") && strcmp (action, "change"))
+		return 0;
+	for (i = 0; subsystems[i]; ++i)
+		if (!strcmp (subsys, subsystems[i]))
+			break;
+	if (!subsystems[i])
+		return 0;
+	if (!sysfs_path_hctl (devpath, &hctl.hnum, &hctl.chan, &hctl.id, &hctl.lun))
+		return 0;
+	if (verbose)
+		printf ("uevent %s %s (%s)\n", action, devpath, subsys);
+	for (i = 0; i < *nbatch; ++i)
+		if (!memcmp (batch + i, &hctl, sizeof (hctl)))
+			return 0;
+	if (*nbatch == MAXBATCH)
+		return -1;
+	batch[(*nbatch)++] = hctl;
+	return 0;
 }
 
-int build_changer (sname * spnt, int no)
+/* Update the nodes for a batch of changed SCSI devices. reglist is kept,
+ * only the changed devices are looked at again. If we lost track
+ * (overflow), everything is scanned again. */
+void process_batch (struct hctl *batch, int nbatch, int overflow)
 {
-    int fd; int status;
-    sname * spnt1 = sname_dup (spnt);
-    spnt1->major = SCSI_CHANGER_MAJOR;
-    spnt1->minor = no;
-    spnt1->devtp = SCH;
-    scsiname (spnt1); oldscsiname (spnt1);
-    spnt1->next = reglist; reglist = spnt1;
-    create_dev (spnt1, use_symlink);
-    fd =  open (spnt1->name, O_RDONLY | O_NONBLOCK);
-    /* No access to medium / part. table */
-    if (fd < 0) {
-	spnt1->unsafe = 1;
-	/* Removable block devs are hairy! */
-	if (spnt1->rmvbl && supp_rmvbl) 
-	    return 0;
-	fprintf (stderr, "Can't access %sremovable %s, which should "
-		 "be equal to %s!\n", (spnt1->rmvbl? "": "NON-"), 
-		 strrchr (spnt1->name, '/') + 1,
-		 strrchr (spnt->name, '/') + 1);
-	/* We don't unlink spnt1->name! Let sanitize take care of it ... */
-	reglist = spnt1->next; free (spnt1->name); 
-	spnt->related = 0; free (spnt1);
-	return 1;
-    }
+	int i;
 
-    /* Do a sanity check */
-    status = getscsiinfo (fd, spnt1, 1);
-    close (fd);
-    if (status) 
-	fprintf (stderr, "scsidev: Strange: Could not get info from %s\n",
-		 strrchr (spnt1->name, '/') + 1);
-    if (sname_cmp (spnt, spnt1)) {
-	fprintf (stderr, "scsidev: What's going on? Dev %s is different from %s\n",
-		 strrchr (spnt1->name, '/') + 1, strrchr (spnt->name, '/') + 1);
-	/* And now ? */
-	reglist = spnt1->next; free (spnt1->name); 
-	spnt->related = 0; free (spnt1);
-	return 1;
-    }
-    return 0;
+	if (!quiet)
+		printf ("Processing %i changed devices%s\n", nbatch,
+			overflow? " (overflow, full rescan)": "");
+	/* Aliases are all evaluated again, they may move */
+	unregister_hctl (NULL);
+	if (overflow) {
+		sname * list = reglist;
+		reglist = NULL;
+		hash_clear (&regnames, NULL);
+		free_snames (list);
+		build_devlist ();
+	} else {
+		for (i = 0; i < nbatch; ++i) {
+			unregister_hctl (batch + i);
+			if (sysfs_scan_dev (batch[i].hnum, batch[i].chan,
+					    batch[i].id, batch[i].lun) && !quiet)
+				printf ("Device %d:%d:%d:%d is gone\n", batch[i].hnum,
+					batch[i].chan, batch[i].id, batch[i].lun);
+		}
+	}
+	build_special ();
+	if (no_san)
+		return;
+	if (overflow)
+		sanitize_sdev ();
+	else
+		for (i = 0; i < nbatch; ++i)
+			sanitize_hctl (batch[i].hnum, batch[i].chan,
+				       batch[i].id, batch[i].lun);
 }
 
-/* Use /proc/partitions to scan for partitions */
-void create_partitions (sname * spnt)
+/* Watch the directory of the alias file (editors replace the file) */
+int alias_watch ()
 {
-	char pline[128]; char *ptr;
-	FILE *pf = fopen ("/proc/partitions", "r");
-	if (!pf) {
-		fprintf (stderr, "scsidev: Couldn't read /proc/partitions: %s\n",
-			 strerror (errno));
-		return;
+	char dir[PATH_MAX];
+	const char *base = strrchr (scsialias, '/');
+	int fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+
+	if (fd < 0)
+		return -1;
+	if (!base)
+		strcpy (dir, ".");
+	else
+		snprintf (dir, sizeof (dir), "%.*s", base == scsialias? 1: 
+			  (int) (base - scsialias), scsialias);
+	if (inotify_add_watch (fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO 
+			       | IN_MOVED_FROM | IN_DELETE) < 0) {
+		if (verbose)
+			fprintf (stderr, "scsidev: can't watch %s: %s\n",
+				 dir, strerror (errno));
+		close (fd);
+		return -1;
 	}
-	while (!feof (pf)) {
-		unsigned int maj, min, blk;
-		char nm[64], nm2[64];
-		ptr = fgets (pline, 128, pf);
-		if (!ptr)
-			break;
-		if (sscanf (pline, " %d %d %d %8s", &maj, &min, &blk, nm) < 4)
-			continue;
-		
-		/* Strip part */
-		strcpy (nm2, nm);
-		if (isdigit (nm2[strlen(nm2)-1])) {
-			for (ptr = nm2+strlen(nm2)-1; isdigit(*ptr); --ptr);
-			*(++ptr) = 0;
+	return fd;
+}
+
+/* Read the pending inotify events; was the alias file among them? */
+int alias_changed (int fd)
+{
+	char buf[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+	const struct inotify_event *ev;
+	const char *base = strrchr (scsialias, '/');
+	char *ptr;
+	int n, chg = 0;
+
+	base = base? base + 1: scsialias;
+	while ((n = read (fd, buf, sizeof (buf))) > 0) {
+		for (ptr = buf; ptr < buf + n; ptr += sizeof (*ev) + ev->len) {
+			ev = (const struct inotify_event *) ptr;
+			if (ev->len && !strcmp (ev->name, base))
+				chg = 1;
 		}
-		ptr = nm + strlen(nm2);
-		if (!strcmp (nm2, spnt->oldname)) {
-			/* Found it ! */
-			if (maj != spnt->major || (min & ~0x0f) != (spnt->minor)) {
-				fprintf (stderr, "scsidev: Inconsistency found: /proc/partitions reports "
-					 " %s as %03x:%05x\n whereas we have %03x:%05x\n",
-					 nm2, maj, min & ~0x0f, spnt->major, spnt->minor);
-				dumpentry (spnt);
-				abort ();
+	}
+	return chg;
+}
+
+static long ms_since (const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 
+		+ (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Daemon mode: Wait for SCSI uevents, collect bursts of them into 
+ * one batch and process it. Changes to the alias file are handled
+ * the same way. Does not return unless on error. */
+int event_loop (const char *standin)
+{
+	char buf[UEVENT_BUFSZ + 1];
+	struct hctl batch[MAXBATCH];
+	struct pollfd pfd[2];
+	int fd = uevent_open (standin);
+
+	if (fd < 0)
+		return -1;
+	if (!quiet)
+		printf ("Waiting for uevents from %s\n", standin? standin: "kernel");
+	pfd[0].fd = fd; pfd[0].events = POLLIN;
+	/* poll ignores it if it's -1 */
+	pfd[1].fd = alias_watch (); pfd[1].events = POLLIN;
+	while (1) {
+		struct timespec start;
+		int nbatch = 0, overflow = 0, aliaschg = 0, timeout = -1;
+		long elapsed;
+		/* Debounce: wait until it's quiet for a while */
+		while (1) {
+			int n = poll (pfd, 2, timeout);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0) {
+				perror ("scsidev: poll");
+				return -1;
 			}
-			if (isdigit (*ptr)) {
-				int part = atoi (ptr);
-				sname * spnt1 = sname_dup (spnt);
-				spnt1->minor |= part; spnt1->partition = part;
-				scsiname (spnt1); 
-				spnt1->oldname = strdup (nm);
-				create_dev (spnt1, use_symlink);
-				spnt1->next = reglist; reglist = spnt1;
+			if (n == 0)
+				break;
+			if (pfd[1].revents & POLLIN)
+				aliaschg |= alias_changed (pfd[1].fd);
+			n = (pfd[0].revents & POLLIN)? recv (fd, buf, UEVENT_BUFSZ, 0): 0;
+			if (n < 0 && errno == ENOBUFS)
+				/* The kernel dropped events */
+				overflow = 1;
+			else if (n > 0) {
+				buf[n] = 0;
+				if (uevent_parse (buf, n, batch, &nbatch))
+					overflow = 1;
 			}
+			if (timeout < 0)
+				clock_gettime (CLOCK_MONOTONIC, &start);
+			elapsed = ms_since (&start);
+			if (elapsed >= EVT_MAX_MS)
+				break;
+			timeout = EVT_MAX_MS - elapsed < EVT_QUIET_MS? 
+				EVT_MAX_MS - elapsed: EVT_QUIET_MS;
+		}
+		if (aliaschg) {
+			if (!quiet)
+				printf ("%s changed\n", scsialias);
+			alias_reset ();
 		}
+		/* process_batch evaluates all rules again anyway */
+		if (nbatch || overflow) {
+			run_lock (overflow);
+			process_batch (batch, nbatch, overflow);
+			run_unlock (overflow);
+		} else if (aliaschg) {
+			run_lock (0);
+			alias_update ();
+			run_unlock (0);
+		}
+		fflush (stdout);
 	}
-	fclose (pf);
 }
-	
 
 
-void build_sgdevlist ()
+void usage()
 {
-    int fd; 
+    fprintf (stderr, "%s\n", versid);
+    fprintf (stderr, "Usage: scsidev [options]\n");
+    fprintf (stderr, " -f     : Force deletion of all " DEVSCSI" entries\n");
+    fprintf (stderr, " -S     : build new " DEVSCSI " in staging dir and swap it in\n");
+    fprintf (stderr, " --dry-run: only print the changes to " DEVSCSI "\n");
+    fprintf (stderr, " --io-uring: batch the operations on " DEVSCSI " via io_uring\n");
+    fprintf (stderr, " --aliases: only apply changes of the alias file (no SCSI scan)\n");
+    fprintf (stderr, " --early: name the devices in the alias file first, then touch " READYFILE "\n");
+    fprintf (stderr, " --explain: report candidates, eliminations and time per alias rule\n");
+    fprintf (stderr, " -n     : Nosanitize: leaved undetected entries untouched\n");
+    fprintf (stderr, " -d     : sanitize by Deleting undetected entries (def: keep perms)\n");
+    fprintf (stderr, " -l/-L  : create symLinks for device names / alias names\n");
+    fprintf (stderr, " -m mode: permissions to create dev nodes with\n");
+    fprintf (stderr, " -s     : list Serial numbers /WWIDs /HSVs of devices (if available)\n");
+    fprintf (stderr, " -c mxms: Continue scanning until mxms missing devs found\n");
+    fprintf (stderr, " -A file: alias file (default: /etc/scsi.alias)\n");
+    fprintf (stderr, " -r     : trust Removeable media (only safe after boot)\n");
+    fprintf (stderr, " -e     : use dEvfs like naming  (cbtu chars)\n");
+    fprintf (stderr, " -H host|type: put the names into subdirs per Host or type\n");
+    fprintf (stderr, " -o     : for the Old names use scd instead of sr\n");
+    fprintf (stderr, " -M     : support Multipathing: First device is aliased\n");
+    fprintf (stderr, " -R h:c:t: Rescan target by REPORT LUNS, only name new LUNs\n");
+    fprintf (stderr, " -D dev : only refresh Device h:c:t:l or [b|c]maj:min\n");
+    fprintf (stderr, " -u path: udev callout: print names for sysfs devpath\n");
+    fprintf (stderr, " -E     : Event daemon: update nodes on SCSI uevents\n");
+    fprintf (stderr, " -U sock: use local datagram socket sock as uevent source\n");
+    fprintf (stderr, " -v/-q  : Verbose/Quiet operation\n");
+    fprintf (stderr, " -h     : print Help and exit.\n");
+}
+
+int main (int argc, char * argv[])
+{
+    int c;
+    int show_serial = 0;
     struct stat statbuf;
-    int status;
     sname * spnt;
-    int disks = 0, tapes = 0, cdroms = 0, changers = 0;
-    int miss = 0;	
-    int minor = 0;
-    int major = SCSI_GENERIC_MAJOR; 
-    int mode = O_RDWR | O_NONBLOCK;
-    //    int devtype = (SCSI_BLK_MAJOR(major)? S_IFBLK: S_IFCHR);
-    enum devtype_t devtp;
+    int status;
+    int rescan = 0, rs_host, rs_chan, rs_id;
+    char *refresh = 0, *devpath = 0, *ptr;
+    int evdaemon = 0, aliases_only = 0;
+    char *uevent_sock = 0;
+    static const struct option long_opts[] = {
+	{ "dry-run", no_argument, 0, 'N' },
+	{ "io-uring", no_argument, 0, 'I' },
+	{ "aliases", no_argument, 0, 'a' },
+	{ "early", no_argument, 0, 'P' },
+	{ "explain", no_argument, 0, 'X' },
+	{ 0, 0, 0, 0 }
+    };
+
+    while ((c = getopt_long(argc, argv, "ypflLvqshnderoMESm:c:A:R:D:u:U:H:",
+			    long_opts, NULL)) != -1) {
+	switch (c) {
+	  case 'y':	/* undocumented */
+	    no_sysfs = 1; break;
+	  case 'p':	/* undocumented */
+	    no_procscsi = 1; break;
+	  case 'f':
+	    force = 1; break;
+	  case 'S':
+	    staged = 1; break;
+	  case 'H':
+	    if (!strcmp (optarg, "host"))
+		shard = SHARD_HOST;
+	    else if (!strcmp (optarg, "type"))
+		shard = SHARD_TYPE;
+	    else {
+		usage (); exit (1);
+	    }
+	    break;
+	  case 'N':
+	    dry_run = 1; break;
+	  case 'I':
+	    use_uring = 1; break;
+	  case 'a':
+	    aliases_only = 1; break;
+	  case 'P':
+	    early = 1; break;
+	  case 'X':
+	    explain = 1; break;
+	  case 'm':
+	    filemode = strtoul (optarg, 0, 0); break;
+	  case 'c':
+	    maxmiss = strtoul (optarg, 0, 0); break;
+	  case 'A':
+	    scsialias = optarg; break;
+	  case 'l':
+	    use_symlink = 1; break;
+	  case 'L':
+	    symlink_alias = 1; break;
+	  case 's':
+	    show_serial = 1; break;
+	  case 'n':
+	    no_san = 1; break;
+	  case 'd':
+	    san_del = 1; break;
+	  case 'r':
+	    supp_rmvbl = 1; break;
+	  case 'M':
+	    supp_multi = 1; break;
+	  case 'R':
+	    if (sscanf (optarg, "%d:%d:%d", &rs_host, &rs_chan, &rs_id) != 3) {
+		usage (); exit (1);
+	    }
+	    rescan = 1; break;
+	  case 'D':
+	    refresh = optarg; break;
+	  case 'u':
+	    devpath = optarg; break;
+	  case 'U':
+	    uevent_sock = optarg; /* fall through */
+	  case 'E':
+	    evdaemon = 1; break;
+	  case 'e':
+	    nm_cbtu = 1; break;
+	  case 'o':
+	    use_scd = 1; break;  
+	  case 'v':
+	    verbose++; break;
+	  case 'h':
+	    fprintf (stderr, "%s\n%s\n", rcsid, copyright); 
+	    usage (); exit (0); break;
+	  case 'q':
+	    quiet = 1; break;
+	  default:
+	    usage(); break;
+	}
+    }
+
+    /* udev callout: Don't touch anything, just print names */
+    if (devpath)
+	return callout (devpath) < 0;
+
+    status = stat(DEVSCSI, &statbuf);
+    if ( status == -1 )
+	mkdir (DEVSCSI, 0755);
+    status = stat(DEVSCSI, &statbuf);
+    if ( status == -1 || !S_ISDIR(statbuf.st_mode)) {
+	fprintf(stderr, DEVSCSI " either does not exist, or is not a directory\n");
+	exit(0);
+    }
+    devscsi_fd = open (DEVSCSI, O_RDONLY | O_DIRECTORY);
+    if (devscsi_fd < 0) {
+	perror ("scsidev: open " DEVSCSI);
+	exit (1);
+    }
+    mkdir (STATEDIR, 0755);
+    testdev_fd = open (STATEDIR, O_RDONLY | O_DIRECTORY);
+    if (testdev_fd < 0) {
+	perror ("scsidev: open " STATEDIR);
+	exit (1);
+    }
+
+    if( verbose >= 1 ) 
+	fprintf( stderr, "%s\n", versid );
     
-    status = stat (DEVSCSI, &statbuf);
-    if (status == -1)
-	return;
+    /* Hotplug: Only one device, modules are loaded already */
+    if (refresh) {
+	run_lock (0);
+	status = refresh_device (refresh);
+	run_unlock (0);
+	return status < 0;
+    }
 
-    status = stat (TESTDEV, &statbuf);
-    if (status == 0)
-	unlink (TESTDEV);
+    /* Alias file changed: Re-evaluate it against the known devices */
+    if (aliases_only) {
+	run_lock (0);
+	snap_load ();
+	status = inv_restore ();
+	if (!status)
+	    alias_update ();
+	run_unlock (0);
+	if (!status)
+	    return 0;
+	if (!quiet)
+	    fprintf (stderr, "scsidev: no devices in " INVENTORY 
+		     ", doing a full scan\n");
+    }
 
-    if (verbose >= 1)
-	fprintf (stderr, "Building list for sg (%s dev major %03x)\n",
-		 "char", major);
+    /* Now, we need to make sure all high-level modules are loaded */
+    trigger_module_loads ();
 
-    while (minor <= 255) {
-	errno = 0;
-	status = mknod ( TESTDEV, 0600 | S_IFCHR, 
-			 makedev (major, minor) );
-	if (status) { 
-	    perror ("scsidev: mknod"); 
-	    exit (3); 
-	}
-	fd = open (TESTDEV, mode);
-	unlink (TESTDEV);
-	if (fd == -1) {
-	    if (verbose == 2)
-		fprintf (stderr, "open(%03x:%05x) returned %d (%d)\n",
-			 major, minor, fd, errno);
-	    miss++;
-	    if (miss > maxmiss) 
-		break;
-	    else { 
-		minor++; continue; 
-	    }
-	}
-	spnt = (sname*) malloc (sizeof (sname));
-	memset (spnt, 0, sizeof (sname));
-	spnt->major = major;   spnt->minor = minor;
-	spnt->devtp = SG;
-	spnt->name  = TESTDEV; spnt->partition = -1;
-	status = getscsiinfo (fd, spnt, 1);
-	close (fd);
+    /* Targeted rescan: Only the new LUNs are named, nothing is sanitized */
+    if (rescan) {
+	run_lock (0);
+	register_others ();
+	status = rescan_target (rs_host, rs_chan, rs_id);
+	if (status > 0)
+	    alias_refresh (alias_select (rs_host, rs_chan, rs_id, -1, NULL), NULL);
+	run_unlock (0);
+	return status < 0;
+    }
 
-	if (status) { 
-		free (spnt); miss++;
-		if (miss > maxmiss) 
-		    break;
-		else { 
-		    minor++; continue; 
-		}
-	}
-	//scsiname (spnt) called by getscsiinfo();
+    /* Wait for concurrent instances; maybe one of them does our job
+     * (but we need to scan ourselves to list the serials) */
+    if (run_lock (1) && !evdaemon && !show_serial) {
+	run_unlock (0);
+	return 0;
+    }
+
+    /* The staged tree starts out empty, no need to flush */
+    if (staged && dry_run) {
+	fprintf (stderr, "scsidev: no staging with --dry-run\n");
+	staged = 0;
+    }
+    if (staged && stage_begin ())
+	staged = 0;
+    if( force && !staged ) 
+	flush_sdev ();
 
-	spnt->next = reglist; reglist = spnt;
-	create_dev (spnt, use_symlink);
+    /* The staged tree is only visible at the end */
+    if (early && staged)
+	fprintf (stderr, "scsidev: no --early with -S\n");
+    else if (early)
+	prio_scan ();
 
-	devtp = inq_devtp_to_devtp (spnt->inq_devtp, spnt);
+    build_devlist ();
 
-	if (!quiet) 
-	    printf ("Found %s (Type %02x) %c on %s \n", spnt->name,
-		    spnt->inq_devtp, (spnt->rmvbl? 'R' : ' '),
-		    spnt->hostname);
+    if( show_serial ) {
+	if (verbose)
+	    dumplist();
+	for (spnt = reglist; spnt; spnt = spnt->next) {
+	    if( spnt->partition != -1 ) 
+		continue;
+	    if( (spnt->devtp == ST || spnt->devtp == OSST)
+		&& (spnt->minor & 0x80) != 0 )
+		continue;
 
-	/* Now register cdroms, tapes, and disks as well */
-	switch (devtp) {
-	    case SD:
-		if (!build_disk (spnt, disks)) 
-			disks++;
-		/* This shouldn't happen, we search already in findscsidisk() 
-		else if (!build_disk (spnt, disks+1)) 
-			disks += 2;
-		 */	
-		break;
-	    case ST:
-		if (!build_tape (spnt, tapes)) 
-			tapes++;
-		else if (!build_tape (spnt, tapes+1)) 
-			tapes += 2;
-		break;
-	    case OSST:
-		if (!build_os_tape (spnt, tapes)) 
-			tapes++;
-		else if (!build_os_tape (spnt, tapes+1)) 
-			tapes += 2;
-		break;
-	    case SR:
-		if (!build_cdrom (spnt, cdroms)) 
-			cdroms++;
-		else if (!build_cdrom (spnt, cdroms+1)) 
-			cdroms += 2;
-		break;
-	    case SCH:
-		if (!build_changer (spnt, changers)) 
-			changers++;
-		else if (!build_cdrom (spnt, changers+1)) 
-			changers += 2;
-		break;
-		
-	    default:
-		;/* nothing to be done */
+	    //if( spnt->serial == NULL ) inquiry (spnt);
+	    if( spnt->serial == no_serial )
+		printf("Device  %s has no serial number\n", spnt->name);
+	    else
+		printf("Serial number of %s: \"%s\"\n", spnt->name, spnt->serial);
+	    if (!spnt->name)
+		    dumpentry(spnt);
+	    if ( spnt->wwid != no_wwid )
+		printf (" WWID: %Lx\n", spnt->wwid);
+	    for (ptr = spnt->desigs; ptr && *ptr; ptr += strlen (ptr) + 1)
+		printf (" Designator: %s\n", ptr);
+	    if ( spnt->hsv_os_id != no_hsv_os_id )
+		printf (" HSV OS Id: %d\n", spnt->hsv_os_id);
 	}
-	minor += 1;
     }
-    //unlink (TESTDEV);
-}
 
-char fourlnbuf[4][128];
-/* Fill fourlnbuf with the next record from /proc/scsi/scsi */
-int procscsi_readrecord (FILE* f)
-{
-	int c; char *ptr;
-	fourlnbuf[0][0] = 0; fourlnbuf[1][0] = 0;
-	fourlnbuf[2][0] = 0; fourlnbuf[3][0] = 0;
-	do {
-		ptr = fgets (fourlnbuf[0], 128, f);
-		if (!ptr || feof (f))
-			return -1;
-	} while (memcmp (fourlnbuf[0], "Host:", 5));
-	ptr = fgets (fourlnbuf[1], 128, f);
-	ptr = fgets (fourlnbuf[2], 128, f);
-	/* Test for extensions ... */
-	c = fgetc (f);
-	if (c != EOF) {
-		ungetc (c, f);
-		if (c != 'H') {
-			ptr = fgets (fourlnbuf[3], 128, f);
-			c = fgetc (f);
-			if (c != EOF) 
-				ungetc (c, f);
-		}
-	}
-#ifdef DEBUG
-	printf ("procscsi_readrecord:\n");
-	printf ("%s", fourlnbuf[0]); printf ("%s", fourlnbuf[1]);
-	printf ("%s", fourlnbuf[2]); printf ("%s", fourlnbuf[3]);
-	printf ("%i\n", fourlnbuf[3][0]);
-#endif
-	return 0;
+
+    //dumplist ();
+    /*
+     * Now, read the configuration file and see whether there
+     * are any special device names we want to try and match.
+     */
+    build_special ();
+    if (verbose)
+	inv_report ();
+
+    /* flush_sdev () has been changed to delete all, so the if is correct */
+    if (staged)
+	stage_commit ();
+    else if (!force)
+	sanitize_sdev ();
+    else
+	node_rmdirs ();
+
+    run_unlock (1);
+
+    if (evdaemon)
+	return event_loop (uevent_sock) < 0;
+
+    return 0;
 }
 
-/* This is a copy of 
- * const char *const scsi_device_types[MAX_SCSI_DEVICE_CODE]
- * from linux/drivers/scsi/scsi.c
+/*
+ * The configuration file is designed to be something that can match
+ * any number of fields.  Thus we need to be able to specify a large
+ * number of different things in the hope that we can uniquely match
+ * to one specific device.
+ *
+ * Each match contains a series of tokens:
+ *
+ * ID=number
+ * LUN=number
+ * CHANNEL=number
+ * HOSTID=number
+ * HOST="string" (hostname)
+ * MANUFACTURER="string"
+ * MODEL="string"
+ * SERIAL_NUMBER="string"	(for those devices that support this).
+ * WWID=number			( "    "      "     "      "      " )
+ * HSVOSID=number		( "    "      "     "      "      " )
+ * REV="string"
+ * NAME="string" (alias)
+ * GROUP="string" (instead of alias: numbered aliases in a subdir)
+ * NAA=hex, EUI64=hex, T10="string", SCSINAME="string" (VPD 0x83)
+ * DEVTYPE="disk", "tape", "osst", "generic", or "cdrom".
+ *
+ * The strings (but the alias) may be shell globs (*, ?, [...]) with
+ * a leading glob: or, with a leading ~, extended regular expressions.
+ * Unmarked strings are compared literally.
+ * The alias may contain %{field} templates (see templ_fields), such a
+ * rule creates one alias for each device it matches.
  */
-#define MAX_SCSI_DEVICE_CODE 15
-const char *const scsi_device_types[MAX_SCSI_DEVICE_CODE] =
-{
-	"Direct-Access",
-	"Sequential-Access",
-	"Printer",
-	"Processor",
-	"WORM",
-	"CD-ROM",
-	"Scanner",
-	"Optical Device",
-	"Medium Changer",
-	"Communications",
-	"Unknown",
-	"Unknown",
-	"RAID",
-	"Enclosure",
-	"Direct-Access-RBC",
+
+/* How a string field of a rule matches */
+enum pat_t { PAT_LIT = 0, PAT_GLOB, PAT_RE, PAT_BAD };
+#define GLOB_TAG "glob:"
+#define GLOB_TAGLEN (sizeof (GLOB_TAG) - 1)
+#define AR_NPAT 5	/* manufacturer, model, serial, rev, host */
+#define RULE_PAT(rule, i) ((rule)->pat? (rule)->pat[i].kind: PAT_LIT)
+
+struct strpat {
+    enum pat_t kind;
+    const char *pfx;		/* literal prefix of the pattern ... */
+    int pfxlen;			/* ... and its length */
+    regex_t re;
+};
+	
+struct alias_rule {
+    int line;
+    int lun, chan, id, part, hostid, hostnum;
+    int hsv_os_id;
+    unsigned long long wwid;	/* host byte order ... */
+    enum devtype_t devtp;
+    char *manufacturer, *model, *serial, *rev, *host, *name, *group;
+    char *desig;		/* designator as in sname.desigs */
+    struct strpat *pat;		/* AR_NPAT compiled patterns, NULL if literal */
+    unsigned int sig;		/* hash of all of the above but line */
+    struct alias_rule *next_tp;	/* next rule for same devtype */
 };
 
+/* The compiled alias rules, in file order and chained per devtype */
+struct alias_rule * alias_rules = NULL;
+int n_alias_rules = -1;
+struct alias_rule * alias_rules_tp[SCH+1];
+/* Only some rules are evaluated, not matching is expected for them */
+int alias_partial = 0;
 
-char linux_to_devtp (const char* tp)
+/*
+ * Binary cache of the parsed alias file (ALIASCACHE), so unchanged
+ * files need not be parsed again: A header identifying the file
+ * (path, dev, inode, size, mtime), the rules with the strings as
+ * offsets into a string table following them. It is mmap()ed and 
+ * the rules point into the mapping. Only valid for the same build
+ * (struct layout), the magic contains the sizes. The path is padded
+ * with NULs so the rules following it are aligned.
+ */
+#define ALIASCACHE_VERSION 4
+#define AC_NSTR 8
+
+struct alias_cache_hdr {
+    char magic[8];
+    int version, rulesz;
+    int n_rules, strsz, pathlen;
+    unsigned long long dev, ino, size;
+    long long mtime_sec;
+    long mtime_nsec;
+};
+
+struct alias_crule {
+    struct alias_rule rule;	/* pointers invalid */
+    int str[AC_NSTR];		/* offset + 1, 0 for NULL */
+};
+
+#define AC_ALIGN __alignof__ (struct alias_crule)
+#define AC_PATHLEN(l) (((l) + AC_ALIGN - 1) & ~(AC_ALIGN - 1))
+
+/* The string fields of a rule */
+static char ** ac_strings (struct alias_rule *rule, int i)
 {
-	int idx;
-	if (!strcmp (tp, "Unknown"))
-		return 0x1f;
-	for (idx = 0; idx < MAX_SCSI_DEVICE_CODE; ++idx)
-		if (!strcmp (tp, scsi_device_types[idx]))
-			return idx;
-	fprintf (stderr, "Linux kernel reports new device type \"%s\". Mail author!\n",
-		 tp);
-	return 0x1f;
+    char ** fld[AC_NSTR];
+    fld[0] = &rule->manufacturer; fld[1] = &rule->model;
+    fld[2] = &rule->serial; fld[3] = &rule->rev;
+    fld[4] = &rule->host; fld[5] = &rule->name;
+    fld[6] = &rule->group; fld[7] = &rule->desig;
+    return fld[i];
 }
 
-/* Parse contents of fourlnbuf */
-int procscsi_parse (sname *spnt)
+static int ac_matches (const struct alias_cache_hdr *hdr, const struct stat *st)
 {
-	char vendor[9];
-	char product[17];
-	char rev[5];
-	char devtype[21];
-	char hldev0[16], hldev1[16], hldev2[16], hldev3[16];
-	int ansi;
-	
-	sscanf (fourlnbuf[0], "Host: scsi%i Channel: %d Id: %d Lun: %d",
-		&spnt->hostnum, &spnt->chan, &spnt->id, &spnt->lun);
-	sscanf (fourlnbuf[1], "  Vendor: %8c Model: %16c Rev: %4c",
-		vendor, product, rev);
-	vendor[8] = 0; product[16] = 0; rev[4] = 0;
-	rmv_trail_ws (vendor); rmv_trail_ws (product); rmv_trail_ws (rev);
-	spnt->manufacturer = strdup (vendor);
-	spnt->model = strdup (product);
-	spnt->rev = strdup (rev);
-	sscanf (fourlnbuf[2], "  Type: %20c ANSI SCSI revision: %d",
-		devtype, &ansi);
-	devtype [20] = 0; rmv_trail_ws (devtype);
-	spnt->inq_devtp = linux_to_devtp (devtype);
-	if (!fourlnbuf[3][0])
-		return 0;
-	return sscanf (fourlnbuf[3], "  Attached drivers: %16s %16s %16s %16s",
-		       hldev0, hldev1, hldev2, hldev3);
+    return !memcmp (hdr->magic, "scsidevA", 8) 
+	&& hdr->version == ALIASCACHE_VERSION
+	&& hdr->rulesz == sizeof (struct alias_crule)
+	&& hdr->pathlen == AC_PATHLEN (strlen (scsialias) + 1)
+	&& hdr->n_rules >= 0 && hdr->strsz >= 0
+	&& hdr->dev == st->st_dev && hdr->ino == st->st_ino
+	&& hdr->size == st->st_size 
+	&& hdr->mtime_sec == st->st_mtim.tv_sec
+	&& hdr->mtime_nsec == st->st_mtim.tv_nsec;
 }
 
-int procscsiext_parse (sname *spnt, int idx)
+/* Take alias_rules from the cache, if it's valid for the file st */
+char *ac_map;		/* the mapping alias_rules point into */
+size_t ac_maplen;
+
+int alias_cache_load (const struct stat *st)
 {
-	char hldev[4][16];
-	char* hdev; char* devptr;
-	char tp;
-	int n = sscanf (fourlnbuf[3], "  Attached drivers: %16s %16s %16s %16s",
-			hldev[0], hldev[1], hldev[2], hldev[3]);
-	if (idx >= n) {
-	    return -1;
-	} else
-		hdev = hldev[idx];
-	
-	for (devptr = hdev; *devptr != '(' && *devptr != 0; ++devptr);
-	*devptr++ = 0;
-	spnt->oldname = strdup (hdev);
+    const struct alias_cache_hdr *hdr;
+    const struct alias_crule *crules;
+    const char *path, *strtab;
+    struct stat cst;
+    char *map;
+    int fd, i, j;
+
+    fd = open (ALIASCACHE, O_RDONLY);
+    if (fd < 0)
+	return -1;
+    if (fstat (fd, &cst) || cst.st_size < sizeof (*hdr)) {
+	close (fd);
+	return -1;
+    }
+    map = mmap (0, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED)
+	return -1;
+    hdr = (const struct alias_cache_hdr *) map;
+    if (!ac_matches (hdr, st) 
+	|| cst.st_size != sizeof (*hdr) + hdr->pathlen 
+	   + (size_t) hdr->n_rules * sizeof (*crules) + hdr->strsz)
+	goto bad;
+    path = map + sizeof (*hdr);
+    crules = (const struct alias_crule *) (path + hdr->pathlen);
+    strtab = (const char *) (crules + hdr->n_rules);
+    if (!memchr (path, 0, hdr->pathlen) || strcmp (path, scsialias)
+	|| (hdr->strsz && strtab[hdr->strsz - 1]))
+	goto bad;
+    /* Don't trust anything that is used as an index */
+    for (i = 0; i < hdr->n_rules; ++i) {
+	if (crules[i].rule.devtp < SG || crules[i].rule.devtp > SCH)
+	    goto bad;
+	for (j = 0; j < AC_NSTR; ++j)
+	    if (crules[i].str[j] < 0 || crules[i].str[j] > hdr->strsz)
+		goto bad;
+    }
+    /* Stays mapped, the strings point into it */
+    ac_map = map; ac_maplen = cst.st_size;
+    alias_rules = malloc ((hdr->n_rules + 1) * sizeof (struct alias_rule));
+    for (i = 0; i < hdr->n_rules; ++i) {
+	alias_rules[i] = crules[i].rule;
+	for (j = 0; j < AC_NSTR; ++j)
+	    *ac_strings (alias_rules + i, j) = 
+		crules[i].str[j]? (char *) strtab + crules[i].str[j] - 1: NULL;
+    }
+    n_alias_rules = hdr->n_rules;
+    if (verbose >= 2)
+	printf ("Took %i alias rules from " ALIASCACHE "\n", n_alias_rules);
+    return 0;
+ bad:
+    munmap (map, cst.st_size);
+    return -1;
+}
 
-	sscanf (devptr, "%c:%x:%x)", &tp, &spnt->major, &spnt->minor);
-	
-	// We don't use tp (which can be 'b' or 'c')
-	
-	if (!memcmp (hdev, "sg", 2))
-		spnt->devtp = SG;
-	else
-		spnt->devtp = inq_devtp_to_devtp (spnt->inq_devtp, spnt);
+/* Write the cache for alias_rules parsed from the file st */
+void alias_cache_save (const struct stat *st)
+{
+    struct alias_cache_hdr hdr;
+    struct alias_crule crule;
+    char pad[AC_ALIGN];
+    int i, j, off = 0, err;
+    FILE *f;
 
-	scsiname (spnt);	
+    if (dry_run)
+	return;
+    mkdir ("/var/cache/scsidev", 0755);
+    f = fopen (ALIASCACHE ".new", "w");
+    if (!f) {
+	if (verbose)
+	    perror ("scsidev: can't write " ALIASCACHE);
+	return;
+    }
+    memset (&hdr, 0, sizeof (hdr));
+    memcpy (hdr.magic, "scsidevA", 8);
+    hdr.version = ALIASCACHE_VERSION;
+    hdr.rulesz = sizeof (struct alias_crule);
+    hdr.n_rules = n_alias_rules;
+    hdr.pathlen = AC_PATHLEN (strlen (scsialias) + 1);
+    hdr.dev = st->st_dev; hdr.ino = st->st_ino; hdr.size = st->st_size;
+    hdr.mtime_sec = st->st_mtim.tv_sec; hdr.mtime_nsec = st->st_mtim.tv_nsec;
+    for (i = 0; i < n_alias_rules; ++i)
+	for (j = 0; j < AC_NSTR; ++j)
+	    if (*ac_strings (alias_rules + i, j))
+		hdr.strsz += strlen (*ac_strings (alias_rules + i, j)) + 1;
+    fwrite (&hdr, sizeof (hdr), 1, f);
+    memset (pad, 0, sizeof (pad));
+    fwrite (scsialias, strlen (scsialias) + 1, 1, f);
+    fwrite (pad, hdr.pathlen - strlen (scsialias) - 1, 1, f);
+    for (i = 0; i < n_alias_rules; ++i) {
+	memset (&crule, 0, sizeof (crule));
+	crule.rule = alias_rules[i];
+	crule.rule.pat = NULL;
+	for (j = 0; j < AC_NSTR; ++j) {
+	    const char *str = *ac_strings (alias_rules + i, j);
+	    *ac_strings (&crule.rule, j) = NULL;
+	    if (str) {
+		crule.str[j] = off + 1;
+		off += strlen (str) + 1;
+	    }
+	}
+	fwrite (&crule, sizeof (crule), 1, f);
+    }
+    for (i = 0; i < n_alias_rules; ++i)
+	for (j = 0; j < AC_NSTR; ++j)
+	    if (*ac_strings (alias_rules + i, j))
+		fwrite (*ac_strings (alias_rules + i, j), 
+			strlen (*ac_strings (alias_rules + i, j)) + 1, 1, f);
+    /* Don't let a crash leave a truncated cache behind the rename */
+    err = fflush (f) || fsync (fileno (f));
+    if (fclose (f) || err || rename (ALIASCACHE ".new", ALIASCACHE)) {
+	if (verbose)
+	    perror ("scsidev: can't write " ALIASCACHE);
+	unlink (ALIASCACHE ".new");
+    }
+}
+
+/* Glob or ~regex? Set up pat for str (of the rule on line) */
+static int strpat_compile (struct strpat *pat, const char *str, int line)
+{
+    const char *ptr;
+    int err;
+
+    pat->pfx = str; pat->pfxlen = 0;
+    if (*str == '~') {
+	pat->kind = PAT_RE;
+	err = regcomp (&pat->re, str + 1, REG_EXTENDED | REG_NOSUB);
+	if (err) {
+	    char msg[128];
+	    regerror (err, &pat->re, msg, sizeof (msg));
+	    fprintf (stderr, "Line %d: invalid regular expression \"%s\": %s\n",
+		     line, str + 1, msg);
+	    pat->kind = PAT_BAD;
+	    return 1;
+	}
+	/* Only anchored expressions without alternatives have a prefix */
+	if (str[1] != '^' || strchr (str, '|'))
+	    return 1;
+	pat->pfx = ptr = str + 2;
+	while (*ptr && !strchr (".[]()*+?{}|\\^$", *ptr))
+	    ptr++;
+	pat->pfxlen = ptr - pat->pfx;
+	/* A quantifier applies to the last char */
+	if (pat->pfxlen && *ptr && strchr ("*?{", *ptr))
+	    pat->pfxlen--;
+	return 1;
+    }
+    if (strncmp (str, GLOB_TAG, GLOB_TAGLEN)) {
+	pat->kind = PAT_LIT;
 	return 0;
+    }
+    pat->kind = PAT_GLOB;
+    pat->pfx = str += GLOB_TAGLEN;
+    ptr = strpbrk (str, "*?[\\");
+    pat->pfxlen = ptr? ptr - str: strlen (str);
+    return 1;
 }
 
-char* find_scsihostname (int hnum)
+/* Signature of a rule: Two rules with the same one match the same
+ * devices and create the same aliases for them */
+static unsigned int rule_sig (struct alias_rule *rule)
 {
-	struct dirent *sde;
-	DIR * sdir;
-	char path[64];
-	char num[8];
-	char* const phost = path + strlen("/proc/scsi/");
-	
-	strcpy (path, "/proc/scsi/");
-	sprintf (num, "/%d", hnum);
-	
-	sdir = opendir ("/proc/scsi");
-	if (!sdir) {
-		fprintf (stderr, "can't read /proc/scsi/: %s\n",
-			 strerror (errno));
-		abort ();
+    char buf[160];
+    const char *str;
+    unsigned int h;
+    int i;
+
+    snprintf (buf, sizeof (buf), "%d %d %d %d %d %d %d %d %Lx",
+	      rule->devtp, rule->lun, rule->chan, rule->id, rule->part,
+	      rule->hostid, rule->hostnum, rule->hsv_os_id, rule->wwid);
+    h = hash_str (buf);
+    for (i = 0; i < AC_NSTR; ++i) {
+	/* FNV-1a on, with a separator (\1 for NULL) */
+	str = *ac_strings (rule, i);
+	h = (h ^ (str? 0: 1)) * 16777619U;
+	for (; str && *str; ++str)
+	    h = (h ^ (unsigned char) *str) * 16777619U;
+    }
+    return h;
+}
+
+/* Compile the patterns of all alias_rules */
+static void alias_compile ()
+{
+    struct strpat pat[AR_NPAT];
+    struct alias_rule *rule;
+    int i, npat;
+
+    for (rule = alias_rules; rule < alias_rules + n_alias_rules; ++rule) {
+	rule->sig = rule_sig (rule);
+	rule->pat = NULL;
+	for (i = 0, npat = 0; i < AR_NPAT; ++i) {
+	    memset (pat + i, 0, sizeof (struct strpat));
+	    if (*ac_strings (rule, i))
+		npat += strpat_compile (pat + i, *ac_strings (rule, i), rule->line);
 	}
-	while (1) {
-		int fd;
-		sde = readdir (sdir);
-		if (!sde)
-			break;
-		if (!strcmp (sde->d_name, "scsi") || *sde->d_name == '.')
-			continue;
-		strcpy (phost, sde->d_name);
-		strcat (phost, num);
-		fd = open (path, O_RDONLY);
-		if (fd > 0) {
-			char * nm = strdup (sde->d_name);
-			close (fd);
-			closedir (sdir);
-			return nm;
-		}
+	if (npat) {
+	    rule->pat = malloc (sizeof (pat));
+	    memcpy (rule->pat, pat, sizeof (pat));
 	}
-	closedir (sdir);
-	return 0;
+    }
 }
 
-unsigned int find_ioport (const char* nm)
+/* Does the device string str match field i (string rstr) of rule? */
+static int str_matches (const struct alias_rule *rule, int i, 
+			const char *rstr, const char *str)
 {
-	unsigned char lnbuf[128];
-	char nm2[64]; char *nmptr;
-	char * buf;
-	FILE * iop = fopen ("/proc/ioports", "r");
-	if (!iop)
-		return 0;
-	/* nm2 = to_lower (nm); */
-	strcpy (nm2, nm);
-	for (nmptr = nm2; *nmptr; ++nmptr)
-		*nmptr = tolower (*nmptr);
-	
-	while (!feof (iop)) {
-		unsigned int io1, io2;
-		char name[64];
-		buf = fgets (lnbuf, 128, iop);
-		if (!buf)
-			break;
-		sscanf (lnbuf, " %x-%x : %s", &io1, &io2, name);
-		if (!strcmp (name, "PCI"))
-			continue;
-		/* name = to_lower (name); */
-		for (nmptr = name; *nmptr; ++nmptr)
-			*nmptr = tolower (*nmptr);
-		if (!strcmp (nm2, name)) {
-			fclose (iop);
-			return io1;
-		}
-	}
-	fclose (iop);
+    if (!str)
 	return 0;
+    switch (RULE_PAT (rule, i)) {
+    case PAT_LIT:
+	return !strcmp (str, rstr);
+    case PAT_GLOB:
+	return !fnmatch (rstr + GLOB_TAGLEN, str, 0);
+    case PAT_RE:
+	return !regexec (&rule->pat[i].re, str, 0, NULL, 0);
+    default:
+	return 0;
+    }
 }
 
-char* sysfs_findhostname (sname *sdev)
+/* A literal hostname is a prefix, patterns have to match it all */
+static int host_matches (const struct alias_rule *rule, const char *str)
 {
-	char buf[128]; FILE* f; char* ptr;
-	strcpy (buf, "/sys/class/scsi_host/");
-	sprintf (buf+strlen(buf), "host%d/", sdev->hostnum);
-	ptr = buf+strlen(buf);
-	strcat (buf, "unique_id");
-	f = fopen (buf, "r");
-	if (!f) {
-		fprintf (stderr, "Could not open \"%s\"!\n", buf);
-		return 0;
-	}
-	fscanf (f, "%i", &sdev->hostid);
-	fclose (f);
-	*ptr = 0;
-	strcat (buf, "name");	// used to be device/name
-	f = fopen (buf, "r");
-	if (f) {
-		char buf2[128];
-		fgets (buf2, 127, f);
-		if (buf2[strlen(buf2)-1] == '\n')
-			buf2[strlen(buf2)-1] = 0;
-		sdev->hostname = strdup (buf2);
-		fclose (f);
-	}
-	*ptr = 0; 
-	strcat (buf, "proc_name");
-	f = fopen (buf, "r");
-	if (!f) {
-		fprintf (stderr, "Could not open \"%s\"!\n", buf);
-		return 0;
-	}
-	fgets (buf, 127, f);
-	fclose (f);
-	if (buf[strlen(buf)-1] == '\n')
-		buf[strlen(buf)-1] = 0;
-	return strdup (buf);
+    if (RULE_PAT (rule, 4) == PAT_LIT)
+	return str && !strncmp (str, rule->host, strlen (rule->host));
+    return str_matches (rule, 4, rule->host, str);
 }
 
-void fill_in_proc (sname * spnt)
+/* The device fields usable in %{} templates in alias names */
+static const char * const templ_fields[] = {
+    "serial", "wwid", "manufacturer", "model", "rev", "hostname",
+    "hostnum", "chan", "id", "lun", "part", NULL
+};
+
+/* Index of the field nm (len chars) in templ_fields or -1 */
+static int templ_field (const char *nm, int len)
 {
-	int fd;
-	spnt->shorthostname = find_scsihostname (spnt->hostnum);
-	if (!spnt->shorthostname) 
-		spnt->shorthostname = sysfs_findhostname (spnt);
-	if (!spnt->shorthostname) {
-		fprintf (stderr, "scsidev: warning: could not deduce hostname & hostid\n");
-		return;
+    int i;
+    for (i = 0; templ_fields[i]; ++i)
+	if (strlen (templ_fields[i]) == len && !memcmp (templ_fields[i], nm, len))
+	    return i;
+    return -1;
+}
+
+/* Are all %{} templates in the alias name (on line) valid? */
+static int templ_valid (const char *name, int line)
+{
+    const char *ptr, *end;
+    for (ptr = strstr (name, "%{"); ptr; ptr = strstr (end, "%{")) {
+	end = strchr (ptr, '}');
+	if (!end || templ_field (ptr + 2, end - ptr - 2) < 0) {
+	    fprintf (stderr, "Line %d has invalid template in \"alias\" (%s)\n",
+		     line, ptr);
+	    return 0;
 	}
-	if (!spnt->hostname)
-		spnt->hostname = strdup (spnt->shorthostname);
-	if (!spnt->hostid)
-		spnt->hostid = find_ioport (spnt->shorthostname);
+    }
+    return 1;
+}
 
-	/* Don't overwrite device type! It should have been filled correctly
-	 * and with matching major/minor before. */
-	// spnt->devtp = inq_devtp_to_devtp (spnt->inq_devtp, spnt);/
+/*
+ * Expand the %{} templates of the alias of rule for the device spnt
+ * into buf. Chars not safe for file names are replaced by _.
+ * Returns -1 if a field is unknown for spnt or it does not fit.
+ */
+int alias_expand (const struct alias_rule *rule, const sname *spnt,
+		  char *buf, int len)
+{
+    const char *ptr = rule->name, *end, *val;
+    char num[32];
+    int i, ln = 0;
 
-	unlink(TESTDEV);
-	fd = mknod (TESTDEV, 0600 | (isblk(spnt->devtp)? S_IFBLK: S_IFCHR),
-		    makedev (spnt->major, spnt->minor));
-	if (fd) {
-		fprintf (stderr, "scsidev: Can't mknod " TESTDEV ": %s\n",
-			 strerror (errno));
-		return;
+    while (*ptr) {
+	if (ptr[0] != '%' || ptr[1] != '{') {
+	    if (ln + 1 >= len)
+		return -1;
+	    buf[ln++] = *ptr++;
+	    continue;
 	}
-	fd = open (TESTDEV, O_RDWR | O_NONBLOCK);
-	unlink (TESTDEV);
-	if (fd == -1) {
-	    char buf[64];
-            sprintf(buf, "open %s %03x:%05x",
-		   isblk(spnt->devtp)? "b": "c", spnt->major, spnt->minor); 
-	    perror(buf);
-	    return;
+	end = strchr (ptr, '}');
+	val = num;
+	switch (templ_field (ptr + 2, end - ptr - 2)) {
+	case 0: val = spnt->serial != no_serial? spnt->serial: NULL; break;
+	case 1: 
+	    if (spnt->wwid == no_wwid)
+		return -1;
+	    sprintf (num, "%Lx", spnt->wwid); 
+	    break;
+	case 2: val = spnt->manufacturer; break;
+	case 3: val = spnt->model; break;
+	case 4: val = spnt->rev; break;
+	case 5: val = spnt->shorthostname? spnt->shorthostname: spnt->hostname; break;
+	case 6: sprintf (num, "%d", spnt->hostnum); break;
+	case 7: sprintf (num, "%d", spnt->chan); break;
+	case 8: sprintf (num, "%d", spnt->id); break;
+	case 9: sprintf (num, "%d", spnt->lun); break;
+	case 10: 
+	    if (spnt->partition == -1)
+		return -1;
+	    sprintf (num, "%d", spnt->partition); 
+	    break;
+	default: return -1;
 	}
-	inquiry (fd, spnt);
-	get_hsv_os_id(fd, spnt);
-	close (fd);
-	//scsiname (spnt);
+	if (!val || !*val)
+	    return -1;
+	for (i = 0; val[i]; ++i) {
+	    if (ln + 1 >= len)
+		return -1;
+	    buf[ln++] = isalnum ((unsigned char) val[i]) 
+		|| strchr ("+-.:_", val[i])? val[i]: '_';
+	}
+	ptr = end + 1;
+    }
+    buf[ln] = 0;
+    return 0;
 }
-		
 
-void fill_in_sg (sname * spnt)
+/*
+ * Group aliases (group=): All devices matched by the rule get a 
+ * numbered alias in DEVSCSI/group/. New members get the lowest free
+ * ordinals in the order of their WWIDs (or serials). The ordinals are
+ * kept in GROUPDB (also those of absent members), so members keep
+ * their number when others come or go.
+ */
+struct group {
+    char *name;
+    int max;
+    char *used;			/* used[ord]: ordinal is taken */
+};
+
+struct grpmem {
+    char *key;			/* group/member ("w" wwid or "s" serial) */
+    int ord;
+};
+
+struct hash groups, grpmembers;
+int groups_loaded = 0, groups_dirty = 0;
+
+static struct group * group_get (const char *name)
 {
-	int status; int fd;
+    struct group *grp = hash_find (&groups, name);
+    if (!grp) {
+	grp = malloc (sizeof (struct group));
+	memset (grp, 0, sizeof (struct group));
+	grp->name = strdup (name);
+	hash_add (&groups, grp->name, grp);
+    }
+    return grp;
+}
 
-	errno = 0;
-	unlink (TESTDEV);
-	status = mknod (TESTDEV, 0600 | S_IFCHR,
-			makedev (spnt->major, spnt->minor));
-	if (status) { 
-		perror ("scsidev: mknod"); 
-		exit (3); 
-	}
-	fd = open (TESTDEV, O_RDWR);
-	unlink (TESTDEV);
-	getscsiinfo (fd, spnt, 0);
-	close (fd);
-	spnt->shorthostname = find_scsihostname (spnt->hostnum);
-	if (spnt->hostid == 0 && spnt->shorthostname)
-		spnt->hostid = find_ioport (spnt->shorthostname);
+/* Record the member key of grp with ordinal ord */
+static void group_set (struct group *grp, const char *key, int ord)
+{
+    struct grpmem *mem = malloc (sizeof (struct grpmem));
+    mem->key = malloc (strlen (grp->name) + strlen (key) + 2);
+    sprintf (mem->key, "%s/%s", grp->name, key);
+    mem->ord = ord;
+    if (hash_add (&grpmembers, mem->key, mem)) {
+	free (mem->key); free (mem);
+	return;
+    }
+    if (ord >= grp->max) {
+	int max = grp->max? grp->max: 16;
+	while (max <= ord)
+	    max *= 2;
+	grp->used = realloc (grp->used, max);
+	memset (grp->used + grp->max, 0, max - grp->max);
+	grp->max = max;
+    }
+    grp->used[ord] = 1;
 }
 
+/* The ordinal of the member key of grp, -1 if it's none (yet) */
+static int group_ord (const struct group *grp, const char *key)
+{
+    char *mkey = malloc (strlen (grp->name) + strlen (key) + 2);
+    struct grpmem *mem;
+    sprintf (mkey, "%s/%s", grp->name, key);
+    mem = hash_find (&grpmembers, mkey);
+    free (mkey);
+    return mem? mem->ord: -1;
+}
 
+/* The member key of spnt: WWID or serial (malloced); NULL if it has neither */
+static char * group_key (const sname *spnt)
+{
+    char *key;
+
+    if (spnt->wwid != no_wwid) {
+	key = malloc (18);
+	sprintf (key, "w%016Lx", spnt->wwid);
+    } else if (spnt->serial && spnt->serial != no_serial) {
+	key = malloc (strlen (spnt->serial) + 2);
+	sprintf (key, "s%s", spnt->serial);
+    } else
+	return NULL;
+    return key;
+}
 
-/* Create device nodes etc. */
-void dev_specific_setup (sname * spnt)
+/* Read GROUPDB (once): Lines "group\tordinal\tmember" */
+void group_load ()
 {
-	if (verbose >= 2) {
-		printf ("dev_specific_setup () for %s\n",
-			spnt->name);
-		dumpentry (spnt);
-	}
-	create_dev (spnt, use_symlink);
-	switch (spnt->devtp) {
-	    case SG:
-	    case SR:
-	    case SCH:
-		break;
-	    case ST:
-	    case OSST:
-		create_ntape (spnt);
-		break;
-	    case SD:
-		spnt->partition = -1;
-		create_partitions (spnt);
-		break;
-	    default: 
-		fprintf (stderr, "scsidev: Unset dev type! Oops!\n");
-		dumpentry (spnt);
-		abort ();
-	}
+    char *line = NULL, *key, *ptr;
+    size_t linesz = 0;
+    FILE *f;
+    int ord;
+
+    if (groups_loaded)
+	return;
+    groups_loaded = 1;
+    f = fopen (GROUPDB, "r");
+    if (!f)
+	return;
+    while (getline (&line, &linesz, f) > 0) {
+	line[strcspn (line, "\n")] = 0;
+	ptr = strchr (line, '\t');
+	if (!ptr || ptr == line)
+	    continue;
+	*ptr++ = 0;
+	ord = strtol (ptr, &key, 10);
+	if (*key++ != '\t' || ord < 0 || !*key)
+	    continue;
+	group_set (group_get (line), key, ord);
+    }
+    free (line);
+    fclose (f);
 }
 
-/* access a dev that's unlikely to exist to trigger module loads
- * with a minimum of side effects */
-void trigger_one_mod (char blk, int major, int minor)
+static int grpmem_cmp (const void *p1, const void *p2)
 {
-	int fd;
-	fd = mknod (TESTDEV, blk? S_IFBLK: S_IFCHR, makedev (major, minor));
-	if (fd)
-		return;
-	fd = open (TESTDEV, O_RDWR | O_NONBLOCK);
-	if (fd > 0)
-		close (fd);
-	unlink (TESTDEV);
+    return strcmp ((*(struct grpmem * const *) p1)->key, 
+		   (*(struct grpmem * const *) p2)->key);
 }
 
-void trigger_module_loads ()
+/* Write GROUPDB if members were added */
+void group_save ()
 {
-	unlink (TESTDEV);
-	/* sd */
-	trigger_one_mod (1, SCSI_DISK0_MAJOR, 255);
-	/* sr */
-	trigger_one_mod (1, SCSI_CDROM_MAJOR, 255);
-	/* osst */
-	trigger_one_mod (0, OSST_MAJOR, 255);
-	/* st */
-	trigger_one_mod (0, SCSI_TAPE_MAJOR, 255);
-	/* sch */
-	trigger_one_mod (0, SCSI_CHANGER_MAJOR, 255);
-	/* sg */
-	trigger_one_mod (0, SCSI_GENERIC_MAJOR, 255);
+    struct grpmem **mems, **mp;
+    const char *sl;
+    FILE *f;
+
+    if (!groups_dirty || dry_run)
+	return;
+    mkdir ("/var/lib/scsidev", 0755);
+    f = fopen (GROUPDB ".new", "w");
+    if (!f) {
+	perror ("scsidev: can't write " GROUPDB);
+	return;
+    }
+    mems = (struct grpmem **) hash_list (&grpmembers);
+    qsort (mems, grpmembers.cnt, sizeof (*mems), grpmem_cmp);
+    for (mp = mems; *mp; ++mp) {
+	sl = strchr ((*mp)->key, '/');
+	fprintf (f, "%.*s\t%d\t%s\n", (int) (sl - (*mp)->key), (*mp)->key,
+		 (*mp)->ord, sl + 1);
+    }
+    free (mems);
+    if (fclose (f) || rename (GROUPDB ".new", GROUPDB)) {
+	perror ("scsidev: can't write " GROUPDB);
+	unlink (GROUPDB ".new");
+    } else
+	groups_dirty = 0;
+}
+
+/* Is nm a group (dir) we have assigned ordinals in? */
+int group_known (const char *nm)
+{
+    group_load ();
+    return hash_find (&groups, nm) != NULL;
 }
 
-struct sysfsdev {
-	int maj, min;
-	char nm[23];
-	char blk;
+/*
+ * The alias name of rule for spnt: The expanded alias or group/ordinal
+ * (only looked up here, build_special assigns them). -1 if none.
+ */
+int alias_name (const struct alias_rule *rule, const sname *spnt,
+		char *buf, int len)
+{
+    char *key;
+    int ord;
+
+    if (!rule->group)
+	return alias_expand (rule, spnt, buf, len);
+    group_load ();
+    if (!(key = group_key (spnt)))
+	return -1;
+    ord = group_ord (group_get (rule->group), key);
+    free (key);
+    if (ord < 0)
+	return -1;
+    snprintf (buf, len, "%s/%d", rule->group, ord);
+    return 0;
+}
+
+/*
+ * The alias file parser: The file is mmap()ed and tokenized in place,
+ * so lines can be of any length. Keywords are looked up in a perfect 
+ * hash of their usual spellings; the abbreviations accepted by older
+ * versions are still understood. Errors are reported with the column
+ * and make the line be ignored.
+ */
+enum kw_t { KW_NONE = 0, KW_MANU, KW_MODEL, KW_SERIAL, KW_WWID, KW_REV, 
+	    KW_HOSTNAME, KW_ID, KW_LUN, KW_CHAN, KW_PART, KW_HOSTID, 
+	    KW_HOSTNUM, KW_ALIAS, KW_DEVTYPE, KW_HSVOSID, KW_GROUP, 
+	    KW_NAA, KW_EUI64, KW_T10, KW_SCSINAME, KW_MAX };
+
+static const struct { const char *nm; enum kw_t kw; } alias_kws[] = {
+    { "manufacturer", KW_MANU }, { "model", KW_MODEL },
+    { "serial_number", KW_SERIAL }, { "serial", KW_SERIAL },
+    { "wwid", KW_WWID }, { "rev", KW_REV }, { "hostname", KW_HOSTNAME },
+    { "id", KW_ID }, { "lun", KW_LUN }, 
+    { "chan", KW_CHAN }, { "channel", KW_CHAN },
+    { "part", KW_PART }, { "partition", KW_PART },
+    { "hostid", KW_HOSTID }, { "hostnum", KW_HOSTNUM },
+    { "alias", KW_ALIAS }, { "devtype", KW_DEVTYPE },
+    { "hsvosid", KW_HSVOSID }, { "group", KW_GROUP },
+    { "naa", KW_NAA }, { "eui64", KW_EUI64 }, { "t10", KW_T10 }, 
+    { "scsiname", KW_SCSINAME },
+    { NULL, KW_NONE }
 };
 
-struct sysfsdev sysfsdevs[2];
+/* Old style: only the first chars were compared */
+static const struct { const char *pfx; enum kw_t kw; } alias_kwpfx[] = {
+    { "manu", KW_MANU }, { "mode", KW_MODEL }, { "seri", KW_SERIAL },
+    { "rev", KW_REV }, { "hostna", KW_HOSTNAME }, { "chan", KW_CHAN },
+    { "part", KW_PART }, { "alia", KW_ALIAS }, { "devt", KW_DEVTYPE },
+    { NULL, KW_NONE }
+};
 
+#define KW_HASHSZ 64
+static signed char kw_slot[KW_HASHSZ];
 
-/* Strip /dev part from nm and readlink the device name */
-void sysfs_get_dev_nm (char* nm, struct sysfsdev* sysfsdevptr)
+/* Collision free for alias_kws (checked by kw_init) */
+static unsigned int kw_hash (const char *nm, int len)
 {
-	char buf[128];
-	char* ptr = strrchr (nm, '/');
-	int ln;
-	*ptr = 0;
-	ln = readlink (nm, buf, 128);
-	buf[ln] = 0;
-	ptr = strrchr (buf, '/');
-	strcpy (sysfsdevptr->nm, ptr+1);
+    return (len * 4 + (unsigned char) nm[0] 
+	    + (unsigned char) nm[len-1] * 26) % KW_HASHSZ;
 }
 
-void sysfs_get_generic_nm (char* nm, struct sysfsdev* sysfsdevptr)
+static void kw_init ()
 {
-	char buf[128]; char *ptr;
-	int ln;
-	ln = readlink (nm, buf, 128);
-	buf[ln] = 0;
-	ptr = strrchr (buf, '/');
-	strcpy (sysfsdevptr->nm, ptr+1);
+    static int done = 0;
+    unsigned int h;
+    int i;
+    if (done++)
+	return;
+    memset (kw_slot, -1, sizeof (kw_slot));
+    for (i = 0; alias_kws[i].nm; ++i) {
+	h = kw_hash (alias_kws[i].nm, strlen (alias_kws[i].nm));
+	if (kw_slot[h] >= 0) {
+	    fprintf (stderr, "scsidev: keyword hash collision %s\n", alias_kws[i].nm);
+	    abort ();
+	}
+	kw_slot[h] = i;
+    }
 }
 
-FILE* sysfs_fopen_pattern(const char* basenm, const char* pat, char* nm)
+static enum kw_t kw_lookup (const char *nm, int len)
 {
-	DIR *dir = opendir(basenm);
-	struct dirent *dent;
-	const ssize_t ln = strlen(pat);
-	if (!dir)
-		return NULL;
-	while (dent = readdir(dir)) {
-		if (0 == memcmp(pat, dent->d_name, ln)) {
-			strcpy(nm, basenm);
-			strcat(nm, dent->d_name);
-			strcat(nm, "/dev");
-			return fopen(nm, "r");
-		}
-	}
-	return NULL;
+    int i;
+    if (len > 0) {
+	i = kw_slot[kw_hash (nm, len)];
+	if (i >= 0 && !strncmp (alias_kws[i].nm, nm, len) && !alias_kws[i].nm[len])
+	    return alias_kws[i].kw;
+    }
+    for (i = 0; alias_kwpfx[i].pfx; ++i) {
+	int l = strlen (alias_kwpfx[i].pfx);
+	if (len >= l && !memcmp (nm, alias_kwpfx[i].pfx, l))
+	    return alias_kwpfx[i].kw;
+    }
+    return KW_NONE;
 }
 
-int sysfs_read_devinfo(char* basenm, struct sysfsdev* sysfsptr, 
-		       sname * spnt, char* suffix, char blk)
+/* A token: not NUL terminated */
+struct alias_tok {
+    const char *ptr;
+    int len;
+};
+
+static int tok_eq (const struct alias_tok *tok, const char *str)
 {
-	FILE* f;
-	char nm[128];
-	strcpy(nm, basenm);
-	strcat(nm, suffix);
-	strcat(nm, "/dev");
-	f = fopen(nm, "r");
-	if (!f) {
-		f = sysfs_fopen_pattern(basenm, suffix, nm);
-		if (!f)
-			return 0;
-	}
-	sysfsptr->blk = blk;
-	fscanf(f, "%i:%i", &sysfsptr->maj, &sysfsptr->min);
-	sysfs_get_dev_nm(nm, sysfsptr);
-	if (verbose > 1)
-		printf ("sysfs_read_devinfo %d:%d:%d:%d -> %s(%c %x:%x)\n",
-			spnt->hostnum, spnt->chan, spnt->id, spnt->lun,
-			sysfsptr->nm, blk? 'b': 'c',
-			sysfsptr->maj, sysfsptr->min);
-	fclose(f);
-	return 1;
+    return tok->ptr && !strncmp (tok->ptr, str, tok->len) && !str[tok->len];
 }
 
+static char * tok_dup (const struct alias_tok *tok)
+{
+    return tok->ptr? strndup (tok->ptr, tok->len): NULL;
+}
 
-int sysfs_getinfo (sname * spnt)
+/* Decimal or 0x hex number; 0 if tok is not all of one */
+static int tok_number (const struct alias_tok *tok, unsigned long long *num)
 {
-	char nm[128]; 
-	int dev = 0;
-	int inq_devtp;
-	FILE* f;
+    const char *ptr = tok->ptr, *end = tok->ptr + tok->len;
+    int base = 10, dig;
 
-	strcpy (nm, "/sys/class/scsi_device/");
-	sprintf (nm+strlen(nm), "%d:%d:%d:%d",
-		 spnt->hostnum, spnt->chan, spnt->id, spnt->lun);
-	strcat (nm, "/device/");
-	/* sysfs devs */
-	dev += sysfs_read_devinfo(nm, sysfsdevs+dev, spnt, "block", 1);
-	dev += sysfs_read_devinfo(nm, sysfsdevs+dev, spnt, "tape", 0);
-	dev += sysfs_read_devinfo(nm, sysfsdevs+dev, spnt, "generic", 0);
-	
-	strcat (nm, "type");
-	f = fopen (nm, "r");
-	fscanf (f, "%i", &inq_devtp);
-	spnt->inq_devtp = inq_devtp;
-	/* TODO: Use much more info from sysfs, e.g. driver */
-	fclose (f);
-	
-	return dev;
-}	
+    if (end - ptr > 2 && ptr[0] == '0' && (ptr[1] == 'x' || ptr[1] == 'X')) {
+	base = 16; ptr += 2;
+    }
+    if (ptr == end)
+	return 0;
+    for (*num = 0; ptr < end; ++ptr) {
+	if (*ptr >= '0' && *ptr <= '9')
+	    dig = *ptr - '0';
+	else if (base == 16 && isxdigit ((unsigned char) *ptr))
+	    dig = tolower ((unsigned char) *ptr) - 'a' + 10;
+	else
+	    return 0;
+	*num = *num * base + dig;
+    }
+    return 1;
+}
 
-void sysfs_parse (sname *spnt, int idx)
-{	
-	char nm[23];
-	char *p1 = sysfsdevs[idx].nm, *p2 = nm;
-	
-	while (!isdigit(*p1) && *p1)
-		*p2++ = *p1++;
-	*p2 = 0;
-	spnt->oldname = strdup(sysfsdevs[idx].nm);
-	spnt->major   = sysfsdevs[idx].maj;
-	spnt->minor   = sysfsdevs[idx].min;
-	//spnt->blk     = sysfsdevs[idx].blk;
-	/* Note: We need to handle generic here, thus can't rely on inq_devtp */
-	//spnt->devtp   = inq_devtp_to_devtp(spnt->inq_devtp, spnt);
-	spnt->devtp   = nm26_to_devtp(nm);
+static void rule_free_strs (struct alias_rule *rule)
+{
+    int i;
+    for (i = 0; i < AC_NSTR; ++i)
+	free (*ac_strings (rule, i));
+}
 
-	if (verbose >= 1) {
-		dumpentry(spnt);
-		printf("Names %s, %s\n", spnt->oldname, nm);
+#define IS_BLANK(c) ((c) == ' ' || (c) == '\t' || (c) == '\r')
+
+/* The designator keys, in the order of enum kw_t */
+static const char * const desig_kws[] = { "naa", "eui64", "t10", "scsiname" };
+
+/* Set rule->desig from the designator key in str (at most one) */
+static int desig_parse (const struct alias_tok *str, struct alias_rule *rule,
+			int line)
+{
+    const struct alias_tok *tok = NULL;
+    char *ptr;
+    int kw, i = 0;
+
+    for (kw = KW_NAA; kw <= KW_SCSINAME; ++kw) {
+	if (!str[kw].ptr)
+	    continue;
+	if (tok) {
+	    fprintf (stderr, "Line %d has more than one designator\n", line);
+	    free (rule->desig); rule->desig = NULL;
+	    return 0;
 	}
-	scsiname(spnt);
+	tok = str + kw;
+	rule->desig = malloc (strlen (desig_kws[kw - KW_NAA]) + tok->len + 2);
+	ptr = rule->desig + sprintf (rule->desig, "%s:", desig_kws[kw - KW_NAA]);
+	if (kw == KW_NAA || kw == KW_EUI64) {
+	    /* hex, as we print it */
+	    if (tok->len > 2 && tok->ptr[0] == '0' && tolower (tok->ptr[1]) == 'x')
+		i = 2;
+	    for (; i < tok->len; ++i) {
+		if (!isxdigit ((unsigned char) tok->ptr[i])) {
+		    fprintf (stderr, "Line %d has invalid \"%s\" (%.*s)\n", 
+			     line, desig_kws[kw - KW_NAA], tok->len, tok->ptr);
+		    free (rule->desig); rule->desig = NULL;
+		    return 0;
+		}
+		*ptr++ = tolower ((unsigned char) tok->ptr[i]);
+	    }
+	    *ptr = 0;
+	} else {
+	    memcpy (ptr, tok->ptr, tok->len);
+	    ptr[tok->len] = 0;
+	}
+    }
+    return 1;
 }
-	
 
-/* Build device list by reading /proc/scsi/scsi with extensions from scsi-many or sysfs */
-void build_sgdevlist_procscsi ()
+/*
+ * Parse the line starting at bol (ending at eol) into rule.
+ * Returns 1 for a rule, 0 for blank lines, comments and errors.
+ */
+static int alias_parse_line (const char *bol, const char *eol, int line,
+			     struct alias_rule *rule)
 {
-	FILE* scsifile;
-	sname * spnt;
-	int status;
-	struct stat statbuf;
-	int rdevs = 0, hdevs = 0;
-
-	status = stat (DEVSCSI, &statbuf);
-	if (status == -1)
-		return;
+    struct alias_tok str[KW_MAX], tok;
+    const char *ptr = bol, *key;
+    unsigned long long num = 0;
+    enum kw_t kw;
+
+#define COL(p) ((int) ((p) - bol + 1))
+    while (ptr < eol && IS_BLANK (*ptr))
+	ptr++;
+    /* allow blank lines and comments... */
+    if (ptr == eol || *ptr == '#')
+	return 0;
 
-	status = stat (TESTDEV, &statbuf);
-	if (status == 0)
-		unlink (TESTDEV);
-	
-	if (verbose >= 1)
-		fprintf (stderr, "Building device list using " PROCSCSI "\n");
-	
-	scsifile = fopen (PROCSCSI, "r");
-	if (!scsifile) {
-		fprintf (stderr, "scsidev: could not open " PROCSCSI ": %s\n",
-			 strerror (errno));
-		return;
+    memset (rule, 0, sizeof (*rule));
+    memset (str, 0, sizeof (str));
+    rule->line = line;
+    rule->lun = -1; rule->id = -1;
+    rule->chan = -1;
+    rule->hostid = -1; rule->hostnum = -1;
+    rule->part = -1; rule->wwid = no_wwid;
+    rule->hsv_os_id = -1;
+    rule->devtp = NONE;
+
+    while (ptr < eol) {
+	key = ptr;
+	while (ptr < eol && *ptr != '=' && *ptr != ',' && !IS_BLANK (*ptr))
+	    ptr++;
+	if (ptr == eol || *ptr != '=') {
+	    fprintf (stderr, "Line %d, col %d: expected specifier=value\n",
+		     line, COL (key));
+	    return 0;
 	}
-	fclose (scsifile);
-    
-	scsifile = fopen (PROCSCSI, "r");
-	/* parse /proc/scsi */
-	while (!feof (scsifile)) {
-		int hl_per_dev; int hl;
-		sname *sgpnt = 0;
-		if (procscsi_readrecord (scsifile))
-			break;
-		++rdevs;
-		spnt = malloc (sizeof (sname));
-		memset (spnt, 0, sizeof (sname));
-		hl_per_dev = procscsi_parse (spnt);
-		if (!hl_per_dev || hl_per_dev == EOF) 
-			hl_per_dev = sysfs_getinfo (spnt);
-		if (!hl_per_dev || hl_per_dev == EOF) {
-			free (spnt);
-			fprintf (stderr, "Low level dev without HL driver?\n");
-			continue;
-		}
-		spnt->next = reglist; reglist = spnt;
-		if (verbose > 1)
-			printf ("dev %d:%d:%d:%d: %i drivers\n",
-				spnt->hostnum, spnt->chan, spnt->id, spnt->lun,
-				hl_per_dev);
-		for (hl = 0; hl < hl_per_dev; ++hl) {
-			if (hl) {
-				spnt = sname_dup (spnt);
-				spnt->next = reglist; reglist = spnt;
-				spnt->major = 0;
-			}
-			++hdevs; spnt->partition = -1;
-			procscsiext_parse (spnt, hl);
-			if (spnt->major == 0)
-				sysfs_parse (spnt, hl);
-			if (spnt->devtp == SG)
-				sgpnt = spnt;
-		}
-		/* Fill in missing information (inquiry, host adapter name ...) */
-		if (sgpnt)
-			fill_in_sg (sgpnt);
-		if (!spnt->shorthostname)
-			fill_in_proc (spnt);
-		if (!sgpnt)
-		    sgpnt = spnt;
-		/* Copy info to the colleagues
-		 * and do special stuff depending on dev types. Such as the non-rew.
-		 * variant for tapes or the partitions on disks
-		 */
-		for (hl = 0; hl < hl_per_dev; ++hl, spnt = spnt->next) {
-			if (spnt != sgpnt) {
-				if (sgpnt->serial) 
-					spnt->serial = strdup (sgpnt->serial);
-				spnt->wwid = sgpnt->wwid;
-				spnt->rmvbl = sgpnt->rmvbl;
-				//spnt->unsafe = sgpnt->unsafe;
-				spnt->hostid = sgpnt->hostid;
-				if (sgpnt->hostname)
-					spnt->hostname = strdup (sgpnt->hostname);
-				if (sgpnt->shorthostname) 
-					spnt->shorthostname = strdup (sgpnt->shorthostname);
-				spnt->related = sgpnt;
-			}
-#if 1
-			/* This does the handling of the dev nodes */
-			dev_specific_setup (spnt);
-#endif
-		}
+	kw = kw_lookup (key, ptr - key);
+	if (kw == KW_NONE) {
+	    fprintf (stderr, "Line %d, col %d: unrecognized specifier \"%.*s\"\n",
+		     line, COL (key), (int) (ptr - key), key);
+	    return 0;
 	}
-	if (verbose >= 1) {
-		printf ("%i real SCSI devices found, %i high level devs attached\n",
-			rdevs, hdevs);
-		dumplist ();
+	ptr++;
+	while (ptr < eol && IS_BLANK (*ptr))
+	    ptr++;
+	if (ptr < eol && (*ptr == '"' || *ptr == '\'')) {
+	    const char *quote = ptr++;
+	    tok.ptr = ptr;
+	    while (ptr < eol && *ptr != *quote)
+		ptr++;
+	    if (ptr == eol) {
+		fprintf (stderr, "Line %d, col %d: unterminated string\n",
+			 line, COL (quote));
+		return 0;
+	    }
+	    tok.len = ptr++ - tok.ptr;
+	} else {
+	    tok.ptr = ptr;
+	    while (ptr < eol && *ptr != ',' && !IS_BLANK (*ptr))
+		ptr++;
+	    tok.len = ptr - tok.ptr;
+	}
+	while (ptr < eol && IS_BLANK (*ptr))
+	    ptr++;
+	if (ptr < eol && *ptr == ',')
+	    ptr++;
+	while (ptr < eol && IS_BLANK (*ptr))
+	    ptr++;
+
+	switch (kw) {
+	case KW_WWID: case KW_ID: case KW_LUN: case KW_CHAN: case KW_PART:
+	case KW_HOSTID: case KW_HOSTNUM: case KW_HSVOSID:
+	    if (!tok_number (&tok, &num)) {
+		fprintf (stderr, "Line %d, col %d: invalid number \"%.*s\"\n",
+			 line, COL (tok.ptr), tok.len, tok.ptr);
+		return 0;
+	    }
+	    break;
+	default:
+	    break;
 	}
+	switch (kw) {
+	case KW_WWID: rule->wwid = num; break;
+	case KW_ID: rule->id = num; break;
+	case KW_LUN: rule->lun = num; break;
+	case KW_CHAN: rule->chan = num; break;
+	case KW_PART: rule->part = num; break;
+	case KW_HOSTID: rule->hostid = num; break;
+	case KW_HOSTNUM: rule->hostnum = num; break;
+	case KW_HSVOSID: rule->hsv_os_id = num; break;
+	default: str[kw] = tok;
+	}
+    }
+#undef COL
+
+    /*
+     * OK, got one complete entry.  Make sure it has the required
+     * fields, and then store it.
+     */
+    if( !str[KW_ALIAS].ptr && !str[KW_GROUP].ptr ) {
+	fprintf(stderr,"Line %d is missing \"alias\" specifier\n", line);
+	return 0;
+    }
+    if( str[KW_ALIAS].ptr && str[KW_GROUP].ptr ) {
+	fprintf(stderr,"Line %d has both \"alias\" and \"group\"\n", line);
+	return 0;
+    }
+    if( !str[KW_DEVTYPE].ptr ) {
+	fprintf(stderr,"Line %d is missing \"devtype\" specifier\n", line);
+	return 0;
+    }
+    if( tok_eq (&str[KW_DEVTYPE], "disk") )
+	rule->devtp = SD;
+    else if( tok_eq (&str[KW_DEVTYPE], "cdrom") )
+	rule->devtp = SR;
+    else if( tok_eq (&str[KW_DEVTYPE], "tape") )
+	rule->devtp = ST;
+    else if( tok_eq (&str[KW_DEVTYPE], "osst") )
+	rule->devtp = OSST;
+    else if( tok_eq (&str[KW_DEVTYPE], "generic") )
+	rule->devtp = SG;
+    else if( tok_eq (&str[KW_DEVTYPE], "changer") )
+	rule->devtp = SCH;
+    else {
+	fprintf(stderr,"Line %d has invalid  \"devtype\" specifier(%.*s)\n", 
+		line, str[KW_DEVTYPE].len, str[KW_DEVTYPE].ptr);
+	return 0;
+    }
+    /* Allocates, so errors from here on need rule_free_strs () */
+    if( !desig_parse (str, rule, line) )
+	return 0;
+
+    rule->name = tok_dup (&str[KW_ALIAS]);
+    rule->group = tok_dup (&str[KW_GROUP]);
+    rule->manufacturer = tok_dup (&str[KW_MANU]);
+    rule->model = tok_dup (&str[KW_MODEL]);
+    rule->serial = tok_dup (&str[KW_SERIAL]);
+    rule->rev = tok_dup (&str[KW_REV]);
+    rule->host = tok_dup (&str[KW_HOSTNAME]);
+    if( rule->group && (!*rule->group || *rule->group == '.' 
+			|| strchr (rule->group, '/')) ) {
+	fprintf(stderr,"Line %d has invalid \"group\" (%s)\n", line, rule->group);
+	rule_free_strs (rule);
+	return 0;
+    }
+    if (rule->name && !templ_valid (rule->name, line)) {
+	rule_free_strs (rule);
+	return 0;
+    }
+    return 1;
 }
-	
 
-/* Test for availability of /proc/scsi/scsi extensions */
-int procscsi_ext_status ()
+/* Parse the alias file into alias_rules. Returns no of rules */
+int read_alias_rules ()
 {
-	int n;
-	FILE *f = fopen (PROCSCSI, "r");
-	if (!f) {
-		fprintf (stderr, "scsidev: " PROCSCSI " does not exist?\n");
-		return 0;
+    struct alias_rule rule, ** tail;
+    const char *bol, *eol, *end;
+    char *map = NULL, *buf = NULL;
+    size_t len = 0, max = 0;
+    int max_rules = 0;
+    struct stat cfst;
+    int fd, i, line;
+    ssize_t rd;
+
+    if (n_alias_rules >= 0)
+	return n_alias_rules;
+    n_alias_rules = 0;
+
+    if (!*scsialias) {
+#ifdef DEBUG
+      scsialias = "scsi.alias";
+#else
+      scsialias = "/etc/scsi.alias";
+#endif
+    }
+
+    fd = open (scsialias, O_RDONLY);
+    if (fd < 0) {
+	if (verbose) perror (scsialias);
+	return 0;
+    }
+    /* Unchanged since we parsed it last time? */
+    if (fstat (fd, &cfst) || !S_ISREG (cfst.st_mode))
+	memset (&cfst, 0, sizeof (cfst));
+    else if (!alias_cache_load (&cfst)) {
+	close (fd);
+	goto chain;
+    }
+
+    if (cfst.st_size > 0) {
+	len = cfst.st_size;
+	map = mmap (0, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+	    map = NULL;
+    }
+    /* Not mappable (e.g. a pipe): read it */
+    if (!map) {
+	len = 0;
+	do {
+	    if (len == max)
+		buf = realloc (buf, max = max? 2*max: 4096);
+	    rd = read (fd, buf + len, max - len);
+	    if (rd > 0)
+		len += rd;
+	} while (rd > 0);
+    }
+    close (fd);
+    kw_init ();
+
+    end = (map? map: buf) + len;
+    for (bol = map? map: buf, line = 1; bol < end; bol = eol + 1, ++line) {
+	eol = memchr (bol, '\n', end - bol);
+	if (!eol)
+	    eol = end;
+	if (!alias_parse_line (bol, eol, line, &rule))
+	    continue;
+	if (n_alias_rules == max_rules) {
+	    max_rules = max_rules? 2*max_rules: 64;
+	    alias_rules = realloc (alias_rules, max_rules * sizeof (rule));
 	}
-	n = procscsi_readrecord (f);
-	fclose (f);
-	/* We don't know ... */
-	if (n < 0)
-		return 1;
-	if (fourlnbuf[3][0])
-		return 1;
-	else
-		return 0;
+	alias_rules[n_alias_rules++] = rule;
+    }
+    if (map)
+	munmap (map, len);
+    free (buf);
+    if (cfst.st_ino)
+	alias_cache_save (&cfst);
+
+ chain:
+    alias_compile ();
+    /* Chain the rules per devtype (after the last realloc) */
+    memset (alias_rules_tp, 0, sizeof (alias_rules_tp));
+    for (i = n_alias_rules - 1; i >= 0; --i) {
+	tail = &alias_rules_tp[alias_rules[i].devtp];
+	alias_rules[i].next_tp = *tail;
+	*tail = alias_rules + i;
+    }
+    return n_alias_rules;
 }
 
-/* Try to switch on extensions */
-int procscsi_ext_on ()
+/* Forget the alias rules, the file has changed */
+void alias_reset ()
 {
-	FILE *f = fopen (PROCSCSI, "w");
-	if (!f) {
-		fprintf (stderr, "scsidev: " PROCSCSI ": %s\n",
-			 strerror (errno));
-		return -1;
+    struct alias_rule *rule;
+    int i;
+
+    for (rule = alias_rules; rule < alias_rules + n_alias_rules; ++rule) {
+	if (rule->pat) {
+	    for (i = 0; i < AR_NPAT; ++i)
+		if (rule->pat[i].kind == PAT_RE)
+		    regfree (&rule->pat[i].re);
+	    free (rule->pat);
 	}
-	fprintf (f, "scsi report-devs 1\n");
-	fclose (f);
-	//fprintf (stderr, "Switched on " PROCSCSI " extensions\n");
-	return 0;
+	if (!ac_map)
+	    rule_free_strs (rule);
+    }
+    if (ac_map)
+	munmap (ac_map, ac_maplen);
+    ac_map = NULL;
+    free (alias_rules);
+    alias_rules = NULL;
+    n_alias_rules = -1;
 }
 
-/* Try to switch on extensions */
-int procscsi_ext_off ()
+/* The checks of rule_check, in order; the first one failing is
+ * returned (RF_MATCH if none) */
+enum rf_t { RF_MATCH = 0, RF_ALIAS, RF_ID, RF_CHAN, RF_LUN, RF_HOSTID,
+	    RF_HOSTNUM, RF_HSVOSID, RF_DEVTYPE, RF_PART, RF_NRTAPE, RF_WWID,
+	    RF_DESIG, RF_MANU, RF_MODEL, RF_SERIAL, RF_REV, RF_HOST, RF_MAX };
+static const char * const rf_names[RF_MAX] = {
+    "match", "alias", "id", "chan", "lun", "hostid", "hostnum", "hsvosid",
+    "devtype", "partition", "non-rewinding tape", "wwid", "designator",
+    "manufacturer", "model", "serial", "rev", "host",
+};
+
+unsigned long rule_ncmp;	/* field comparisons done by rule_check */
+
+#define RF_FAIL(rf, cond) do { ++rule_ncmp; if (cond) return rf; } while (0)
+
+/* Does the device spnt match rule? */
+enum rf_t rule_check (const struct alias_rule *rule, const sname *spnt)
 {
-	FILE *f = fopen (PROCSCSI, "w");
-	if (!f) {
-		fprintf (stderr, "scsidev: " PROCSCSI ": %s\n",
-			 strerror (errno));
-		return -1;
-	}
-	fprintf (f, "scsi report-devs 0\n");
-	fclose (f);
-	//fprintf (stderr, "Switched off " PROCSCSI " extensions\n");
-	return 0;
+    /* Don't alias aliases */
+    if( spnt->alias != NULL )
+	return RF_ALIAS;
+    /*
+     * Check the integers first.  Some of the strings we have to
+     * request, and we want to avoid this if possible.
+     */
+    if( rule->id != -1 )
+	RF_FAIL (RF_ID, rule->id != spnt->id);
+    if( rule->chan != -1 )
+	RF_FAIL (RF_CHAN, rule->chan != spnt->chan);
+    if( rule->lun != -1 )
+	RF_FAIL (RF_LUN, rule->lun != spnt->lun);
+    if( rule->hostid != -1 )
+	RF_FAIL (RF_HOSTID, rule->hostid != spnt->hostid);
+    if( rule->hostnum != -1 )
+	RF_FAIL (RF_HOSTNUM, rule->hostnum != spnt->hostnum);
+    if( rule->hsv_os_id != -1 )
+	RF_FAIL (RF_HSVOSID, rule->hsv_os_id != spnt->hsv_os_id);
+    RF_FAIL (RF_DEVTYPE, spnt->devtp != rule->devtp);
+    RF_FAIL (RF_PART, rule->part != spnt->partition);
+    if( spnt->devtp == ST || spnt->devtp == OSST )
+	RF_FAIL (RF_NRTAPE, (spnt->minor & 0x80) != 0);
+    if( rule->wwid != no_wwid )
+	RF_FAIL (RF_WWID, rule->wwid != spnt->wwid);
+    if( rule->desig != NULL )
+	RF_FAIL (RF_DESIG, !desigs_has (spnt->desigs, rule->desig));
+
+    /*
+     * OK, that matches, now obtain some of the strings
+     * that might be needed.
+     */
+    if( rule->manufacturer != NULL )
+	RF_FAIL (RF_MANU, !str_matches (rule, 0, rule->manufacturer, 
+					spnt->manufacturer));
+
+    if( rule->model != NULL )
+	RF_FAIL (RF_MODEL, !str_matches (rule, 1, rule->model, spnt->model));
+
+    /* No serial never matches a pattern */
+    if( rule->serial != NULL )
+	RF_FAIL (RF_SERIAL, !str_matches (rule, 2, rule->serial, 
+			RULE_PAT (rule, 2) != PAT_LIT && spnt->serial == no_serial?
+			NULL: spnt->serial));
+
+    if( rule->rev != NULL )
+	RF_FAIL (RF_REV, !str_matches (rule, 3, rule->rev, spnt->rev));
+
+    if( rule->host != NULL )
+	RF_FAIL (RF_HOST, !host_matches (rule, spnt->hostname)
+		 && !host_matches (rule, spnt->shorthostname));
+
+    return RF_MATCH;
 }
 
+/*
+ * --explain: What happened to each rule in eval_rule. Collected by
+ * rule_matches and create_alias while rule_stats is set.
+ */
+struct rule_stats {
+    const struct alias_rule *rule;
+    unsigned long ncand, ncmp;
+    unsigned long nelim[RF_MAX];	/* candidates failing each check */
+    long long ns;			/* time in eval_rule */
+    int naliases;
+    char winner[2*NAME_MAX];		/* last alias: device */
+};
+
+struct rule_stats * rule_stats = NULL;
+struct rule_stats * explained;	/* of all evaluated rules, for the summary */
+int n_explained, max_explained;
 
-int try_procscsi ()
+int rule_matches (const struct alias_rule *rule, const sname *spnt)
 {
-	int se_status = procscsi_ext_status();
-	if (!se_status)
-		procscsi_ext_on();
-	if (!procscsi_ext_status())
-		return -1;
-	
-	build_sgdevlist_procscsi(0);
-	
-	if (!se_status)
-		procscsi_ext_off();
-	return 0;
+    enum rf_t rf = rule_check (rule, spnt);
+    if (rule_stats) {
+	rule_stats->ncand++;
+	rule_stats->nelim[rf]++;
+    }
+    return rf == RF_MATCH;
 }
 
+/*
+ * Index of the registered devices for alias matching: Each device is
+ * filed under its designators, wwid, serial, hsvosid, devtype:chan:id:lun
+ * and devtype:partition, disk partitions also under their disk's h:c:t:l.
+ * A rule only needs to look at the devices under its most selective 
+ * field. The lists keep the order of reglist, so the results (and 
+ * messages) are the same as when walking reglist. Serial patterns
+ * use a binary search for their literal prefix in the sorted serials.
+ */
+struct devvec {
+    char *key;
+    int n, max;
+    sname ** v;
+};
+
+struct hash devindex;
 
+/* The serials sorted, for the prefixes of serial patterns */
+struct serent {
+    const char *serial;
+    int seq;			/* position on reglist */
+    sname *spnt;
+};
 
-/* Try sysfs */
-int find_sysfs ()
+struct serent *serials;
+int n_serials, max_serials;
+
+void devvec_free (void *data)
 {
-	DIR *sdev_dir = opendir("/sys/class/scsi_device");
-	if (!sdev_dir)
-		return -1;
-	closedir (sdev_dir);
-	build_sgdevlist_procscsi(1);
-	return 0;
+    struct devvec *vec = data;
+    free (vec->key);
+    free (vec->v);
+    free (vec);
 }
 
+static void devindex_add (const char *key, sname *spnt)
+{
+    struct devvec *vec = hash_find (&devindex, key);
+    if (!vec) {
+	vec = malloc (sizeof (struct devvec));
+	memset (vec, 0, sizeof (struct devvec));
+	vec->key = strdup (key);
+	hash_add (&devindex, vec->key, vec);
+    }
+    if (vec->n == vec->max) {
+	vec->max = vec->max? 2*vec->max: 4;
+	vec->v = realloc (vec->v, vec->max * sizeof (sname *));
+    }
+    vec->v[vec->n++] = spnt;
+}
 
-void usage()
+static int serent_cmp (const void *p1, const void *p2)
 {
-    fprintf (stderr, "%s\n", versid);
-    fprintf (stderr, "Usage: scsidev [options]\n");
-    fprintf (stderr, " -f     : Force deletion of all " DEVSCSI" entries\n");
-    fprintf (stderr, " -n     : Nosanitize: leaved undetected entries untouched\n");
-    fprintf (stderr, " -d     : sanitize by Deleting undetected entries (def: .shadow. files\n");
-    fprintf (stderr, " -l/-L  : create symLinks for device names / alias names\n");
-    fprintf (stderr, " -m mode: permissions to create dev nodes with\n");
-    fprintf (stderr, " -s     : list Serial numbers /WWIDs /HSVs of devices (if available)\n");
-    fprintf (stderr, " -c mxms: Continue scanning until mxms missing devs found\n");
-    fprintf (stderr, " -A file: alias file (default: /etc/scsi.alias)\n");
-    fprintf (stderr, " -r     : trust Removeable media (only safe after boot)\n");
-    fprintf (stderr, " -e     : use dEvfs like naming  (cbtu chars)\n");
-    fprintf (stderr, " -o     : for the Old names use scd instead of sr\n");
-    fprintf (stderr, " -M     : support Multipathing: First device is aliased\n");
-    fprintf (stderr, " -v/-q  : Verbose/Quiet operation\n");
-    fprintf (stderr, " -h     : print Help and exit.\n");
+    const struct serent *s1 = p1, *s2 = p2;
+    int cmp = strcmp (s1->serial, s2->serial);
+    return cmp? cmp: s1->seq - s2->seq;
 }
 
-int main (int argc, char * argv[])
+static int serent_seqcmp (const void *p1, const void *p2)
 {
-    int c;
-    int show_serial = 0;
-    struct stat statbuf;
+    return ((const struct serent *) p1)->seq - ((const struct serent *) p2)->seq;
+}
+
+/* (Re)build devindex and serials from reglist */
+void devindex_build ()
+{
+    char key[64];
     sname * spnt;
-    int status;
+    char * sbuf = NULL, * ptr;
+    int slen = 0, seq = 0;
+
+    hash_clear (&devindex, devvec_free);
+    n_serials = 0;
+    for (spnt = reglist; spnt; spnt = spnt->next, ++seq) {
+	/* Aliases are never matched */
+	if (spnt->alias)
+	    continue;
+	if (spnt->wwid != no_wwid) {
+	    sprintf (key, "w%Lx", spnt->wwid);
+	    devindex_add (key, spnt);
+	}
+	for (ptr = spnt->desigs; ptr && *ptr; ptr += strlen (ptr) + 1) {
+	    if (slen < strlen (ptr) + 2) {
+		slen = strlen (ptr) + 2;
+		sbuf = realloc (sbuf, slen);
+	    }
+	    sprintf (sbuf, "d%s", ptr);
+	    devindex_add (sbuf, spnt);
+	}
+	if (spnt->serial) {
+	    if (slen < strlen (spnt->serial) + 2) {
+		slen = strlen (spnt->serial) + 2;
+		sbuf = realloc (sbuf, slen);
+	    }
+	    sprintf (sbuf, "s%s", spnt->serial);
+	    devindex_add (sbuf, spnt);
+	}
+	if (spnt->serial && spnt->serial != no_serial) {
+	    if (n_serials == max_serials) {
+		max_serials = max_serials? 2*max_serials: 64;
+		serials = realloc (serials, max_serials * sizeof (struct serent));
+	    }
+	    serials[n_serials].serial = spnt->serial;
+	    serials[n_serials].seq = seq;
+	    serials[n_serials++].spnt = spnt;
+	}
+	if (spnt->hsv_os_id != no_hsv_os_id) {
+	    sprintf (key, "v%d", spnt->hsv_os_id);
+	    devindex_add (key, spnt);
+	}
+	sprintf (key, "c%d:%d:%d:%d", spnt->devtp, spnt->chan, spnt->id, spnt->lun);
+	devindex_add (key, spnt);
+	sprintf (key, "t%d:%d", spnt->devtp, spnt->partition);
+	devindex_add (key, spnt);
+	if (spnt->devtp == SD && spnt->partition != -1) {
+	    sprintf (key, "p%d-%x:%d:%d:%d", spnt->hostnum, spnt->hostid,
+		     spnt->chan, spnt->id, spnt->lun);
+	    devindex_add (key, spnt);
+	}
+    }
+    free (sbuf);
+    qsort (serials, n_serials, sizeof (struct serent), serent_cmp);
+}
 
-    status = stat(DEVSCSI, &statbuf);
-    if ( status == -1 )
-	mkdir (DEVSCSI, 0755);
-    status = stat(DEVSCSI, &statbuf);
-    if ( status == -1 || !S_ISDIR(statbuf.st_mode)) {
-	fprintf(stderr, DEVSCSI " either does not exist, or is not a directory\n");
-	exit(0);
+/* The devices with a serial starting with pfx, in reglist order */
+static const struct devvec * serial_range (const char *pfx, int len)
+{
+    static struct devvec vec;
+    static struct serent *tmp;
+    static int max_tmp;
+    int lo = 0, hi = n_serials, first, i;
+
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+	if (strncmp (serials[mid].serial, pfx, len) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
     }
-    while ((c = getopt(argc, argv, "ypflLvqshnderoMm:c:A:")) != -1) {
-	switch (c) {
-	  case 'y':	/* undocumented */
-	    no_sysfs = 1; break;
-	  case 'p':	/* undocumented */
-	    no_procscsi = 1; break;
-	  case 'f':
-	    force = 1; break;
-	  case 'm':
-	    filemode = strtoul (optarg, 0, 0); break;
-	  case 'c':
-	    maxmiss = strtoul (optarg, 0, 0); break;
-	  case 'A':
-	    scsialias = optarg; break;
-	  case 'l':
-	    use_symlink = 1; break;
-	  case 'L':
-	    symlink_alias = 1; break;
-	  case 's':
-	    show_serial = 1; break;
-	  case 'n':
-	    no_san = 1; break;
-	  case 'd':
-	    san_del = 1; break;
-	  case 'r':
-	    supp_rmvbl = 1; break;
-	  case 'M':
-	    supp_multi = 1; break;
-	  case 'e':
-	    nm_cbtu = 1; break;
-	  case 'o':
-	    use_scd = 1; break;  
-	  case 'v':
-	    verbose++; break;
-	  case 'h':
-	    fprintf (stderr, "%s\n%s\n", rcsid, copyright); 
-	    usage (); exit (0); break;
-	  case 'q':
-	    quiet = 1; break;
-	  default:
-	    usage(); break;
-	}
+    first = lo;
+    while (hi < n_serials && !strncmp (serials[hi].serial, pfx, len))
+	hi++;
+    vec.n = hi - first;
+    if (vec.n > max_tmp) {
+	max_tmp = vec.n;
+	tmp = realloc (tmp, max_tmp * sizeof (struct serent));
+	vec.v = realloc (vec.v, max_tmp * sizeof (sname *));
     }
+    memcpy (tmp, serials + first, vec.n * sizeof (struct serent));
+    qsort (tmp, vec.n, sizeof (struct serent), serent_seqcmp);
+    for (i = 0; i < vec.n; ++i)
+	vec.v[i] = tmp[i].spnt;
+    return &vec;
+}
 
-    if( verbose >= 1 ) 
-	fprintf( stderr, "%s\n", versid );
-    
-    /* Now, we need to make sure all high-level modules are loaded */
-    trigger_module_loads ();
+/* The devices that may match rule (a superset of the matches) */
+const struct devvec * rule_candidates (const struct alias_rule *rule)
+{
+    char key[64];
+    if (rule->desig) {
+	const struct devvec *vec;
+	char * sbuf = malloc (strlen (rule->desig) + 2);
+	sprintf (sbuf, "d%s", rule->desig);
+	vec = hash_find (&devindex, sbuf);
+	free (sbuf);
+	return vec;
+    }
+    if (rule->wwid != no_wwid) {
+	sprintf (key, "w%Lx", rule->wwid);
+	return hash_find (&devindex, key);
+    }
+    if (rule->serial && RULE_PAT (rule, 2) == PAT_BAD)
+	return NULL;
+    if (rule->serial && RULE_PAT (rule, 2) != PAT_LIT) {
+	if (rule->pat[2].pfxlen)
+	    return serial_range (rule->pat[2].pfx, rule->pat[2].pfxlen);
+    } else if (rule->serial) {
+	const struct devvec *vec;
+	char * sbuf = malloc (strlen (rule->serial) + 2);
+	sprintf (sbuf, "s%s", rule->serial);
+	vec = hash_find (&devindex, sbuf);
+	free (sbuf);
+	return vec;
+    }
+    if (rule->hsv_os_id != -1) {
+	sprintf (key, "v%d", rule->hsv_os_id);
+	return hash_find (&devindex, key);
+    }
+    if (rule->chan != -1 && rule->id != -1 && rule->lun != -1) {
+	sprintf (key, "c%d:%d:%d:%d", rule->devtp, rule->chan, rule->id, rule->lun);
+	return hash_find (&devindex, key);
+    }
+    sprintf (key, "t%d:%d", rule->devtp, rule->part);
+    return hash_find (&devindex, key);
+}
 
-    if( force ) 
-	flush_sdev ();
+/* Register and create the alias nodes name of rule for the device match */
+void create_alias (const struct alias_rule *rule, const char *name, sname * match)
+{
+    sname * spnt, * spnt1;
+    char scsidev[PATH_MAX];
+    enum devtype_t devtype_i = rule->devtp;
 
-#ifdef DEBUG
-    register_dev("/dev/scsi/sdh4-334c0i0l0",  8,  0, SD, 6, 0x334, 0, 0, 0, -1, "debug", 0, NULL, NULL);
-    register_dev("/dev/scsi/sdh4-334c0i0l0p1",8,  1, SD, 6, 0x334, 0, 0, 0,  1, "debug", 0, NULL, NULL);
-    register_dev("/dev/scsi/sdh4-334c0i0l0p2",8,  2, SD, 6, 0x334, 0, 0, 0,  2, "debug", 0, NULL, NULL);
-    register_dev("/dev/scsi/sdh4-334c0i0l0p3",8,  3, SD, 6, 0x334, 0, 0, 0,  3, "debug", 0, NULL, NULL);
-    register_dev("/dev/scsi/sgh4-334c0i0l0", 21,  0, SG, 6, 0x334, 0, 0, 0, -1, "debug", 0, NULL, NULL);
-    register_dev("/dev/scsi/sgh4-334c0i2l0", 21,  1, SG, 6, 0x334, 0, 2, 0, -1, "debug", 0, NULL, NULL);
-    register_dev("/dev/scsi/sgh4-334c0i5l0", 21,  2, SG, 6, 0x334, 0, 5, 0, -1, "debug", 0, NULL, NULL);
-    register_dev("/dev/scsi/srh4-334c0i2l0", 11,  0, SR, 6, 0x334, 0, 2, 0, -1, "debug", 0, NULL, NULL);
-    register_dev("/dev/scsi/sth4-334c0i5l0",  9,  0, ST, 6, 0x334, 0, 5, 0, -1, "debug", 0, NULL, NULL);
-    register_dev("/dev/scsi/rsth4-334c0i5l0", 9,128, ST, 6, 0x334, 0, 5, 0, -1, "debug", 0, NULL, NULL);
-#else
-    if (no_procscsi || try_procscsi ()) {
-	if (no_sysfs || find_sysfs ()) {
-	    if (!quiet) 
-		fprintf (stderr, "/proc/scsi/scsi extensions not found. Fall back to scanning.\n");
-	    build_sgdevlist ();
+    /*
+     * OK, we have a unique match.  Create the device entries,
+     * as requested.
+     */
+    if (!quiet) {
+	fprintf (stderr, "Alias device %s: %s (%s)", name,
+		 strrchr (match->name, '/') + 1,
+		 match->oldname);
+	if (match->related)
+	    fprintf (stderr, " -> (%s, %s)\n",
+		     strrchr (match->related->name, '/') + 1,
+		     match->related->oldname);
+	else 
+	    fprintf (stderr, "\n");
+    }
+
+    /*
+     * If this is just an ordinary single device type,
+     * Just create it.
+     */
+    snprintf (scsidev, PATH_MAX, DEVSCSI "/%s", name);
+    spnt1 = register_dev (scsidev, match->major, match->minor,
+			  match->devtp, match->hostnum, match->hostid,
+			  match->chan, match->id, match->lun, 0,
+			  match->hostname, match->name, match, 0);
+    spnt1->aliasrule = rule->sig;
+    create_dev (spnt1, symlink_alias);
+    if (rule_stats) {
+	rule_stats->naliases++;
+	snprintf (rule_stats->winner, sizeof (rule_stats->winner), "%s: %s",
+		  name, strrchr (match->name, '/') + 1);
+    }
+
+    if( devtype_i == ST || devtype_i == OSST ) {
+	char nm2[PATH_MAX]; char * ptr; const char * base;
+	ptr = strrchr (match->name, '/');
+	snprintf (nm2, PATH_MAX, "scsi/n%s", ptr? ptr+1: match->name);
+	/* group/n<ord> */
+	base = strrchr (name, '/');
+	base = base? base + 1: name;
+	snprintf (scsidev, PATH_MAX, DEVSCSI "/%.*sn%s", 
+		  (int) (base - name), name, base);
+
+	spnt1 = register_dev (scsidev, match->major, match->minor | 0x80,
+			      match->devtp, match->hostnum, match->hostid,
+			      match->chan, match->id, match->lun, 0,
+			      match->hostname, nm2, match, spnt1);
+	spnt1->aliasrule = rule->sig;
+	create_dev (spnt1, symlink_alias);
+    }
+
+    if ( devtype_i == SD 
+	 && match->partition == -1 ) {
+	/*
+	 * This is the master entry for a disk.
+	 * we need to go through and generate entries
+	 * for each partition.  The trick is to find
+	 * all of the related entries so we know which
+	 * ones we actually need to create.
+	 */
+	char key[64];
+	const struct devvec *parts;
+	int i;
+	sprintf (key, "p%d-%x:%d:%d:%d", match->hostnum, match->hostid,
+		 match->chan, match->id, match->lun);
+	parts = hash_find (&devindex, key);
+	for (i = 0; parts && i < parts->n; ++i) {
+	    sname * spnt2;
+	    spnt = parts->v[i];
+
+	    snprintf(scsidev, PATH_MAX, DEVSCSI "/%s-p%d", name, 
+		     spnt->partition);
+	    spnt2 = register_dev (scsidev, match->major, spnt->minor,
+				  match->devtp, match->hostnum, match->hostid,
+				  match->chan, match->id, match->lun, spnt->partition,
+				  match->hostname, spnt->name, spnt, spnt1);
+	    spnt2->aliasrule = rule->sig;
+	    create_dev (spnt2, symlink_alias);
 	}
     }
-#endif
+}
 
-    if( show_serial ) {
-	if (verbose)
-	    dumplist();
-	for (spnt = reglist; spnt; spnt = spnt->next) {
-	    if( spnt->partition != -1 ) 
-		continue;
-	    if( (spnt->devtp == ST || spnt->devtp == OSST)
-		&& (spnt->minor & 0x80) != 0 )
-		continue;
+/* Create the aliases of the templated rule for all devices it matches */
+static void create_templ_aliases (const struct alias_rule *rule, 
+				  const struct devvec *cands)
+{
+    char name[256];
+    sname * spnt;
+    int i, n = 0;
 
-	    //if( spnt->serial == NULL ) inquiry (spnt);
-	    if( spnt->serial == no_serial )
-		printf("Device  %s has no serial number\n", spnt->name);
-	    else
-		printf("Serial number of %s: \"%s\"\n", spnt->name, spnt->serial);
-	    if (!spnt->name)
-		    dumpentry(spnt);
-	    if ( spnt->wwid != no_wwid )
-		printf (" WWID: %Lx\n", spnt->wwid);
-	    if ( spnt->hsv_os_id != no_hsv_os_id )
-		printf (" HSV OS Id: %d\n", spnt->hsv_os_id);
+    for (i = 0; cands && i < cands->n; ++i) {
+	spnt = cands->v[i];
+	if (!rule_matches (rule, spnt))
+	    continue;
+	n++;
+	if (alias_expand (rule, spnt, name, sizeof (name))) {
+	    if (!quiet)
+		fprintf (stderr, "Line %d: can't expand alias %s for %s\n",
+			 rule->line, rule->name, spnt->name);
+	    continue;
+	}
+	if (find_registered (name)) {
+	    fprintf (stderr, "Line %d: alias %s for %s exists already\n",
+		     rule->line, name, spnt->name);
+	    continue;
+	}
+	create_alias (rule, name, spnt);
+    }
+    if (!n && !quiet && !alias_partial) 
+	fprintf (stderr, "Unable to match device for line %d (alias %s)\n", 
+		 rule->line, rule->name);
+}
+
+/* Create the numbered aliases of the group rule for the devices it matches */
+static void create_group_aliases (const struct alias_rule *rule, 
+				  const struct devvec *cands)
+{
+    struct group *grp;
+    struct serent *mems;	/* the member keys in serial */
+    char *key, name[256];
+    int i, n = 0, ord;
+
+    group_load ();
+    grp = group_get (rule->group);
+    mems = malloc ((cands? cands->n: 0) * sizeof (struct serent) + 1);
+    for (i = 0; cands && i < cands->n; ++i) {
+	sname * spnt = cands->v[i];
+	if (!rule_matches (rule, spnt))
+	    continue;
+	if (!(key = group_key (spnt))) {
+	    if (!quiet)
+		fprintf (stderr, "Line %d: %s has no WWID nor serial number, "
+			 "not in group %s\n", rule->line, spnt->name, rule->group);
+	    continue;
 	}
+	mems[n].serial = key;
+	mems[n].seq = i;
+	mems[n++].spnt = spnt;
     }
+    qsort (mems, n, sizeof (struct serent), serent_cmp);
 
+    for (i = 0; i < n; ++i) {
+	/* Another path to the same device */
+	if (i && !strcmp (mems[i].serial, mems[i-1].serial)) {
+	    if (!quiet) 
+		fprintf (stderr, "Line %d: %s <=> %s\n",
+			 rule->line, mems[i-1].spnt->name, mems[i].spnt->name);
+	    continue;
+	}
+	ord = group_ord (grp, mems[i].serial);
+	if (ord < 0) {
+	    for (ord = 0; ord < grp->max && grp->used[ord]; ++ord)
+		;
+	    group_set (grp, mems[i].serial, ord);
+	    groups_dirty = 1;
+	}
+	snprintf (name, sizeof (name), "%s/%d", rule->group, ord);
+	if (find_registered (name))
+	    fprintf (stderr, "Line %d: alias %s for %s exists already\n",
+		     rule->line, name, mems[i].spnt->name);
+	else
+	    create_alias (rule, name, mems[i].spnt);
+    }
+    if (!n && !quiet && !alias_partial) 
+	fprintf (stderr, "Unable to match device for line %d (group %s)\n", 
+		 rule->line, rule->group);
+    for (i = 0; i < n; ++i)
+	free ((char *) mems[i].serial);
+    free (mems);
+}
+
+static void match_rule (const struct alias_rule * rule)
+{
+    const struct devvec * cands;
+    sname * spnt, *match;
+    int i, dup;
 
-    //dumplist ();
     /*
-     * Now, read the configuration file and see whether there
-     * are any special device names we want to try and match.
+     * Try and match this to something we know about already.
      */
-    build_special ();
+    match = NULL; dup = 0;
+    cands = rule_candidates (rule);
+    if (rule->group) {
+	create_group_aliases (rule, cands);
+	return;
+    }
+    if (strstr (rule->name, "%{")) {
+	create_templ_aliases (rule, cands);
+	return;
+    }
+    for (i = 0; cands && i < cands->n; ++i) {
+	spnt = cands->v[i];
+	if (!rule_matches (rule, spnt))
+	    continue;
+	/*
+	 * We have a match.  Record it and keep looking just in
+	 * case we find a duplicate.
+	 */
+	if( match != NULL ) {
+	    if (!supp_multi) {
+		fprintf (stderr, "Line %d not matched uniquely\n", rule->line);
+		fprintf (stderr, " Prev. match: %s\n", match->name);
+		fprintf (stderr, " Curr. match: %s\n", spnt->name);
+		dup = 1;
+		break;
+	    } else {
+		if (!quiet) 
+		    fprintf (stderr, "Line %d: %s <=> %s\n",
+			     rule->line, match->name, spnt->name);
+	    }
+	} else
+	    match = spnt;
+    }
 
-    /* flush_sdev () has been changed to delete all, so the if is correct */
-    if (!force)
-	sanitize_sdev ();
+    /*
+     * See if there was a non-unique mapping.  If so, then
+     * don't do anything for this one.
+     */
+	    
+    if (dup)
+	return;
 
-    return 0;
+    if( match != NULL )
+	create_alias (rule, rule->name, match);
+    else {
+	if (!quiet && !alias_partial) 
+	    fprintf (stderr, "Unable to match device for line %d (alias %s)\n", 
+		     rule->line, rule->name);
+    }
 }
 
-char * get_string (char * pnt, char **result)
+/* Which devindex rule_candidates uses for rule */
+static const char * rule_index (const struct alias_rule *rule)
 {
-    char quote = 0;
+    if (rule->desig)
+	return "designator";
+    if (rule->wwid != no_wwid)
+	return "wwid";
+    if (rule->serial && RULE_PAT (rule, 2) == PAT_BAD)
+	return "none (bad serial pattern)";
+    if (rule->serial && RULE_PAT (rule, 2) == PAT_LIT)
+	return "serial";
+    if (rule->serial && rule->pat[2].pfxlen)
+	return "serial prefix";
+    if (rule->hsv_os_id != -1)
+	return "hsvosid";
+    if (rule->chan != -1 && rule->id != -1 && rule->lun != -1)
+	return "devtype and chan:id:lun";
+    return "devtype and partition";
+}
 
-    while (*pnt == ' ' || *pnt == '\t') pnt++;
+static void explain_rule (const struct rule_stats *st)
+{
+    const struct alias_rule *rule = st->rule;
+    int rf;
+
+    fprintf (stderr, "Line %d (%s %s): %lu candidates by %s, %lu matched, "
+	     "%lu comparisons, %.3f ms\n", rule->line, 
+	     rule->group? "group": "alias", rule->group? rule->group: rule->name,
+	     st->ncand, rule_index (rule), st->nelim[RF_MATCH], st->ncmp,
+	     st->ns / 1e6);
+    for (rf = RF_MATCH + 1; rf < RF_MAX; ++rf)
+	if (st->nelim[rf])
+	    fprintf (stderr, "  eliminated by %s: %lu\n", rf_names[rf], st->nelim[rf]);
+    if (st->naliases > 1)
+	fprintf (stderr, "  -> %d aliases, last %s\n", st->naliases, st->winner);
+    else if (st->naliases)
+	fprintf (stderr, "  -> %s\n", st->winner);
+    else if (st->nelim[RF_MATCH] > 1)
+	fprintf (stderr, "  -> no alias, not unique\n");
+    else
+	fprintf (stderr, "  -> no alias\n");
+}
 
-    if( *pnt == '"' || *pnt == '\'') 
-	quote = *pnt++;
+static int stats_nscmp (const void *p1, const void *p2)
+{
+    const struct rule_stats *s1 = p1, *s2 = p2;
+    return s1->ns < s2->ns? 1: s1->ns > s2->ns? -1: 0;
+}
 
-    *result = pnt;
+/* Totals and the slowest rules of this run */
+void explain_summary ()
+{
+    unsigned long ncand = 0, ncmp = 0;
+    long long ns = 0;
+    int i;
 
-    if( quote != 0 ) {
-	while ( *pnt != quote ) pnt++;
-	*pnt++ = 0;
-    } else {
-	while ( *pnt != ',' && *pnt != ' ' && *pnt != '\t' && *pnt != '\0' ) 
-	    pnt++;
-	*pnt++ = 0;
+    if (!explain || !n_explained)
+	return;
+    for (i = 0; i < n_explained; ++i) {
+	ncand += explained[i].ncand;
+	ncmp += explained[i].ncmp;
+	ns += explained[i].ns;
     }
-
-    while (*pnt == ' ' || *pnt == '\t') 
-	pnt++;
-    if (*pnt == ',') 
-	pnt++;
-    while (*pnt == ' ' || *pnt == '\t') 
-	pnt++;
-    return pnt;
+    fprintf (stderr, "%d rules: %lu candidates, %lu comparisons, %.3f ms\n",
+	     n_explained, ncand, ncmp, ns / 1e6);
+    qsort (explained, n_explained, sizeof (struct rule_stats), stats_nscmp);
+    fprintf (stderr, "Slowest rules:\n");
+    for (i = 0; i < n_explained && i < 10; ++i)
+	fprintf (stderr, "  line %d: %.3f ms, %lu candidates by %s\n",
+		 explained[i].rule->line, explained[i].ns / 1e6,
+		 explained[i].ncand, rule_index (explained[i].rule));
+    n_explained = 0;
 }
 
-char * get_llnumber (char * pnt, unsigned long long * result)
+/* Create the alias(es) of rule (devindex needs to be current) */
+void eval_rule (const struct alias_rule * rule)
 {
-    int base = 10;
-    unsigned long long num;
+    struct rule_stats st;
+    struct timespec t0, t1;
+    unsigned long ncmp = rule_ncmp;
 
-    while (*pnt == ' ' || *pnt == '\t') 
-	pnt++;
-    if (pnt[0] == '0' && pnt[1] == 'x') { 
-	base = 16; pnt += 2;
+    if (!explain) {
+	match_rule (rule);
+	return;
     }
-
-    num = 0;
-    while (1) {
-	if (base == 10 && *pnt >= '0' && *pnt <= '9' ) {
-	    num = num * 10ULL + *pnt - '0';
-	    pnt++;
-	    continue;
-	}
-	else if ( base == 16 ) {
-	    if (*pnt >= '0' && *pnt <= '9') {
-		num = (num << 4) + *pnt - '0';
-		pnt++;
-		continue;
-	    }
-	    if (*pnt >= 'a' && *pnt <= 'f') {
-		num = (num << 4) + *pnt - 'a' + 10;
-		pnt++;
-		continue;
-	    }
-	    if (*pnt >= 'A' && *pnt <= 'F') {
-		num = (num << 4) + *pnt - 'A' + 10;
-		pnt++;
-		continue;
-	    }
-	    break;
-	}
-	/*
-	 * Isn't a digit.  Must be the end of the number.
-	 */
-	break;
+    memset (&st, 0, sizeof (st));
+    st.rule = rule;
+    rule_stats = &st;
+    clock_gettime (CLOCK_MONOTONIC, &t0);
+    match_rule (rule);
+    clock_gettime (CLOCK_MONOTONIC, &t1);
+    rule_stats = NULL;
+    st.ns = (t1.tv_sec - t0.tv_sec) * 1000000000LL + t1.tv_nsec - t0.tv_nsec;
+    st.ncmp = rule_ncmp - ncmp;
+    explain_rule (&st);
+    if (n_explained == max_explained) {
+	max_explained = max_explained? 2*max_explained: 64;
+	explained = realloc (explained, max_explained * sizeof (st));
     }
-    while (*pnt == ' ' || *pnt == '\t') 
-	pnt++;
-    if (*pnt == ',') 
-	pnt++;
-    while (*pnt == ' ' || *pnt == '\t') 
-	pnt++;
-    *result = num;
-    return pnt;
+    explained[n_explained++] = st;
+}
 
+/* Note that the aliases are those of the current alias_rules */
+static void evalrules_set ()
+{
+    struct alias_rule * rule;
+    char *sig;
+
+    hash_clear (&evalrules, free);
+    for (rule = alias_rules; rule < alias_rules + n_alias_rules; ++rule) {
+	sig = malloc (9);
+	sprintf (sig, "%08x", rule->sig);
+	if (hash_add (&evalrules, sig, sig))
+	    free (sig);
+    }
 }
 
-char * get_number (char * pnt, int * result)
+void build_special ()
 {
-    int base = 10;
-    int num;
+    struct alias_rule * rule;
 
-    while (*pnt == ' ' || *pnt == '\t') 
-	pnt++;
-    if (pnt[0] == '0' && pnt[1] == 'x') { 
-	base = 16; pnt += 2; 
+    if (read_alias_rules () <= 0) {
+	hash_clear (&evalrules, free);
+	return;
     }
 
-    num = 0;
-    while (1) {
-	if (base == 10 && *pnt >= '0' && *pnt <= '9' ) {
-	    num = num * 10 + *pnt - '0';
-	    pnt++;
+    devindex_build ();
+    for (rule = alias_rules; rule < alias_rules + n_alias_rules; ++rule)
+	eval_rule (rule);
+    group_save ();
+    evalrules_set ();
+    explain_summary ();
+}
+
+/* Remove the nodes of the dropped aliases, unless reused, and free them */
+static void alias_drop (sname * dropped)
+{
+    struct devnode * node;
+    struct stat st;
+    sname * spnt;
+
+    for (spnt = dropped; spnt && !no_san; spnt = spnt->next) {
+	if (find_registered (reg_key (spnt)))
 	    continue;
-	}
-	else if ( base == 16 ) {
-	    if (*pnt >= '0' && *pnt <= '9') {
-		num = (num << 4) + *pnt - '0';
-		pnt++;
-		continue;
-	    }
-	    if (*pnt >= 'a' && *pnt <= 'f') {
-		num = (num << 4) + *pnt - 'a' + 10;
-		pnt++;
-		continue;
-	    }
-	    if (*pnt >= 'A' && *pnt <= 'F') {
-		num = (num << 4) + *pnt - 'A' + 10;
-		pnt++;
-		continue;
-	    }
-	    break;
-	}
-	/*
-	 * Isn't a digit.  Must be the end of the number.
-	 */
-	break;
+	node = node_get (reg_key (spnt));
+	if (node && !node->claimed && !node_stat (node, &st)
+	    && (S_ISLNK (st.st_mode) || S_ISCHR (st.st_mode) 
+		|| S_ISBLK (st.st_mode)))
+	    sanitize_node (node->name, &st);
     }
-    while (*pnt == ' ' || *pnt == '\t') 
-	pnt++;
-    if (*pnt == ',') 
-	pnt++;
-    while (*pnt == ' ' || *pnt == '\t') 
-	pnt++;
-    *result = num;
-    return pnt;
-
+    if (!no_san)
+	node_rmdirs ();
+    free_snames (dropped);
 }
 
 /*
- * The configuration file is designed to be something that can match
- * any number of fields.  Thus we need to be able to specify a large
- * number of different things in the hope that we can uniquely match
- * to one specific device.
- *
- * Each match contains a series of tokens:
- *
- * ID=number
- * LUN=number
- * CHANNEL=number
- * HOSTID=number
- * HOST="string" (hostname)
- * MANUFACTURER="string"
- * MODEL="string"
- * SERIAL_NUMBER="string"	(for those devices that support this).
- * WWID=number			( "    "      "     "      "      " )
- * HSVOSID=number		( "    "      "     "      "      " )
- * REV="string"
- * NAME="string" (alias)
- * DEVTYPE="disk", "tape", "osst", "generic", or "cdrom".
+ * The alias file changed, the devices did not: Only the aliases of 
+ * rules that are gone (or changed) are dropped and only the rules
+ * that are new (or changed) are evaluated, against the devices on
+ * reglist (which may have been restored from INVENTORY). A rule is
+ * identified by its sig. Returns the no of rules evaluated.
  */
-	
-void build_special ()
+int alias_update ()
 {
-    FILE *	configfile;
-    char buffer[256];
-    char * pnt;
-    char * pnt1;
-    sname * spnt, * spnt1, *match;
-    char scsidev[64];
-
-    int lun, chan, id, part, hostid, hostnum;
-    int line;
-    int hsv_os_id;
-    unsigned long long wwid;	/* host byte order ... */
-    enum devtype_t devtype_i;
-    char *manufacturer, *model, *serial_number, *name, *devtype, *rev, *host;
-
-    if (!*scsialias) {
-#ifdef DEBUG
-      scsialias = "scsi.alias";
-#else
-      scsialias = "/etc/scsi.alias";
-#endif
+    struct alias_rule * rule;
+    struct hash sigs;
+    sname ** prev = &reglist, * dropped = NULL, * spnt;
+    char key[16];
+    int neval = 0, ndrop = 0;
+
+    memset (&sigs, 0, sizeof (sigs));
+    read_alias_rules ();
+    for (rule = alias_rules; rule < alias_rules + n_alias_rules; ++rule) {
+	char *sig = malloc (9);
+	sprintf (sig, "%08x", rule->sig);
+	if (hash_add (&sigs, sig, sig))
+	    free (sig);
     }
-
-    configfile = fopen (scsialias, "r");
-    if (!configfile) {
-	if (verbose) perror (scsialias);
-	return;
+    /* Drop the aliases of the rules that are gone */
+    while (*prev) {
+	spnt = *prev;
+	sprintf (key, "%08x", spnt->aliasrule);
+	if (spnt->alias && !hash_find (&sigs, key)) {
+	    *prev = spnt->next;
+	    reg_unindex (spnt);
+	    spnt->next = dropped; dropped = spnt;
+	    ++ndrop;
+	} else
+	    prev = &spnt->next;
     }
-
-    line = 0;
-    while (1) {
-	*buffer = 0;
-	fgets (buffer, sizeof(buffer), configfile);
-	line++;
-	if (feof (configfile) && !*buffer) 
-	    break;
-	
-	/*
-	 * Remove trailing \n, if present.
-	 */
-	pnt = buffer + strlen(buffer) - 1;
-	if( *pnt == '\n' ) 
-	    *pnt = '\0';
-
-	/*
-	 * First, tokenize the input line, and pick out the parameters.
-	 */
-	lun = -1; id = -1;
-	chan = -1;
-	hostid = -1; hostnum = -1;
-	part = -1; wwid = no_wwid;
-	hsv_os_id = -1;
-	host = NULL;
-	manufacturer = NULL; model = NULL;
-	serial_number = NULL; rev = NULL;
-	name = NULL; devtype_i = NONE;
-	devtype = NULL;
-	pnt = buffer;
-	while (*pnt == ' ' || *pnt == '\t') pnt++;
-
-	/* allow blank lines and comments... */
-	if( *pnt == '\0' ) 
-	    continue;
-	if( *pnt == '#'  ) 
+    devindex_build ();
+    for (rule = alias_rules; rule < alias_rules + n_alias_rules; ++rule) {
+	sprintf (key, "%08x", rule->sig);
+	if (hash_find (&evalrules, key))
 	    continue;
+	eval_rule (rule);
+	++neval;
+    }
+    group_save ();
+    evalrules_set ();
+    explain_summary ();
+    alias_drop (dropped);
+    hash_clear (&sigs, free);
+    if (!quiet)
+	printf ("Alias rules: %i evaluated, %i aliases dropped\n", neval, ndrop);
+    return neval;
+}
 
-	while (1) {
-	    pnt1 = pnt;
-	    while (*pnt1 != '=' && *pnt1 != '\0') 
-		pnt1++;
-	    if( *pnt1 == '\0' ) 
-		break;
+/* Is spnt at hnum:chan:id:lun (lun -1: any LUN)? */
+static int at_hctl (const sname *spnt, int hnum, int chan, int id, int lun)
+{
+    return spnt->hostnum == hnum && spnt->chan == chan && spnt->id == id
+	&& (lun == -1 || spnt->lun == lun);
+}
 
-	    *pnt1 = '\0';
-	    if( strncmp(pnt, "manu", 4) == 0 )
-		pnt = get_string(pnt1 + 1, &manufacturer);
-	    else if ( strncmp(pnt, "mode", 4) == 0 )
-		pnt = get_string(pnt1 + 1, &model);
-	    else if ( strncmp(pnt, "seri", 4) == 0 )
-		pnt = get_string(pnt1 + 1, &serial_number);
-	    else if ( strcmp(pnt, "wwid") == 0 )
-		pnt = get_llnumber(pnt1 + 1, &wwid);
-	    else if ( strncmp(pnt, "rev", 3) == 0 )
-		pnt = get_string(pnt1 + 1, &rev);
-	    else if ( strncmp(pnt, "hostname", 6) == 0 )
-		pnt = get_string(pnt1 + 1, &host);
-	    else if ( strcmp(pnt, "id") == 0 )
-		pnt = get_number(pnt1 + 1, &id);
-	    else if ( strcmp(pnt, "lun") == 0 )
-		pnt = get_number(pnt1 + 1, &lun);
-	    else if ( strncmp(pnt, "chan", 4) == 0 )
-		pnt = get_number(pnt1 + 1, &chan);
-	    else if ( strncmp(pnt, "part", 4) == 0 )
-		pnt = get_number(pnt1 + 1, &part);
-	    else if ( strcmp(pnt, "hostid") == 0 )
-		pnt = get_number(pnt1 + 1, &hostid);
-	    else if ( strcmp(pnt, "hostnum") == 0 )
-		pnt = get_number(pnt1 + 1, &hostnum);
-	    else if ( strncmp(pnt, "alia", 4) == 0 )
-		pnt = get_string(pnt1 + 1, &name);
-	    else if ( strncmp(pnt, "devt", 4) == 0 )
-		pnt = get_string(pnt1 + 1, &devtype);
-	    else if ( strcmp(pnt, "hsvosid") == 0 )
-		pnt = get_number(pnt1 + 1, &hsv_os_id);
-	    else {
-		fprintf(stderr,"Unrecognized specifier \"%s\" on line %i\n", pnt,
-			line);
+/* Add the rules that may match (a device at) hnum:chan:id:lun on reglist
+ * to the selection sel (allocated if NULL) */
+char * alias_select (int hnum, int chan, int id, int lun, char *sel)
+{
+    struct alias_rule * rule;
+    const struct devvec * cands;
+    int i;
+
+    read_alias_rules ();
+    if (!sel)
+	sel = calloc (n_alias_rules + 1, 1);
+    devindex_build ();
+    for (rule = alias_rules; rule < alias_rules + n_alias_rules; ++rule) {
+	cands = rule_candidates (rule);
+	for (i = 0; cands && i < cands->n; ++i)
+	    if (at_hctl (cands->v[i], hnum, chan, id, lun)) {
+		sel[rule - alias_rules] = 1;
 		break;
 	    }
-	}
+    }
+    return sel;
+}
 
-	/*
-	 * OK, got one complete entry.  Make sure it has the required
-	 * fields, and then attempt to match it to a real device.
-	 */
-	if( name == NULL ) {
-	    fprintf(stderr,"Line %d is missing \"alias\" specifier\n", line);
-	    continue;
-	}
-	if( devtype == NULL ) {
-	    fprintf(stderr,"Line %d is missing \"devtype\" specifier\n", line);
+/* Take the aliases of the devices at hnum:chan:id:lun (hnum -1: none)
+ * and those made by the rules selected in sel (if any) off reglist;
+ * returns them prepended to dropped */
+sname * alias_unregister (int hnum, int chan, int id, int lun, 
+			  const char *sel, sname * dropped)
+{
+    struct hash sigs;
+    sname ** prev = &reglist, * spnt;
+    char key[16], *sig;
+    int i;
+
+    memset (&sigs, 0, sizeof (sigs));
+    for (i = 0; sel && i < n_alias_rules; ++i) {
+	if (!sel[i])
 	    continue;
-	}
-	if( strcmp(devtype, "disk") == 0 )
-	    devtype_i = SD;
-	else if( strcmp(devtype, "cdrom") == 0)
-	    devtype_i = SR;
-	else if( strcmp(devtype, "tape") == 0)
-	    devtype_i = ST;
-	else if( strcmp(devtype, "osst") == 0)
-	    devtype_i = OSST;
-	else if(strcmp(devtype, "generic") == 0 )
-	    devtype_i = SG;
-	else if(strcmp(devtype, "changer") == 0 )
-	    devtype_i = SCH;
-	else {
-	    fprintf(stderr,"Line %d has invalid  \"devtype\" specifier(%s)\n", 
-		    line, devtype);
+	sig = malloc (9);
+	sprintf (sig, "%08x", alias_rules[i].sig);
+	if (hash_add (&sigs, sig, sig))
+	    free (sig);
+    }
+    while (*prev) {
+	spnt = *prev;
+	sprintf (key, "%08x", spnt->aliasrule);
+	if (spnt->alias && ((hnum >= 0 && at_hctl (spnt, hnum, chan, id, lun))
+			    || hash_find (&sigs, key))) {
+	    *prev = spnt->next;
+	    reg_unindex (spnt);
+	    spnt->next = dropped; dropped = spnt;
+	} else
+	    prev = &spnt->next;
+    }
+    hash_clear (&sigs, free);
+    return dropped;
+}
+
+/*
+ * Only a few devices changed (-D, -R): Evaluate again just the rules
+ * selected by alias_select for them, after dropping their aliases.
+ * reglist needs to hold the other devices as well (restored from 
+ * INVENTORY), only then a rule is known to match uniquely. dropped
+ * are the old aliases of the devices. Returns the no of rules evaluated.
+ */
+int alias_refresh (char *sel, sname * dropped)
+{
+    struct alias_rule * rule;
+    char *sig;
+    int neval = 0;
+
+    dropped = alias_unregister (-1, 0, 0, 0, sel, dropped);
+    devindex_build ();
+    alias_partial = 1;
+    for (rule = alias_rules; rule < alias_rules + n_alias_rules; ++rule) {
+	if (!sel[rule - alias_rules])
 	    continue;
-	}
+	eval_rule (rule);
+	++neval;
+	/* It has seen all devices, like the rules of the last run */
+	sig = malloc (9);
+	sprintf (sig, "%08x", rule->sig);
+	if (hash_add (&evalrules, sig, sig))
+	    free (sig);
+    }
+    alias_partial = 0;
+    group_save ();
+    explain_summary ();
+    alias_drop (dropped);
+    free (sel);
+    if (verbose)
+	printf ("Alias rules: %i of %i evaluated\n", neval, n_alias_rules);
+    return neval;
+}
 
-	/*
-	 * OK, minimal requirements are met.  Try and match this to something
-	 * we know about already.
-	 */
-	match = NULL;
-	for (spnt = reglist; spnt; spnt = spnt->next) {
-	    /* Don't alias aliases */
-	    if( spnt->alias != NULL )
-		continue;
-	    /*
-	     * Check the integers first.  Some of the strings we have to
-	     * request, and we want to avoid this if possible.
-	     */
-	    if( id != -1 && id != spnt->id ) 
-		continue;
-	    if( chan != -1 && chan != spnt->chan )
-		continue;
-	    if( lun != -1 && lun != spnt->lun ) 
-		continue;
-	    if( hostid != -1 && hostid != spnt->hostid ) 
-		continue;
-	    if( hostnum != -1 && hostnum != spnt->hostnum ) 
-		continue;
-	    if( hsv_os_id != -1 && hsv_os_id != spnt->hsv_os_id ) 
-		continue;
-	    if( spnt->devtp != devtype_i )
-		continue;
-	    if( part != spnt->partition )
-		continue;
-	    if( (spnt->devtp == ST || spnt->devtp == OSST)
-		&& (spnt->minor & 0x80) != 0) 
-		continue;
-	    if( wwid != no_wwid && wwid != spnt->wwid ) 
-		continue;
+/* Read a sysfs attribute (first line, without surrounding blanks) */
+char * sysfs_read_attr (const char *dir, const char *attr, char *buf, int len)
+{
+	char nm[PATH_MAX]; char *ptr;
+	FILE *f;
+	snprintf (nm, sizeof (nm), "%s/%s", dir, attr);
+	f = fopen (nm, "r");
+	if (!f)
+		return NULL;
+	ptr = fgets (buf, len, f);
+	fclose (f);
+	if (!ptr)
+		return NULL;
+	rmv_trail_ws (buf);
+	for (ptr = buf; *ptr == ' '; ++ptr);
+	return ptr;
+}
 
-	    /*
-	     * OK, that matches, now obtain some of the strings
-	     * that might be needed.
-	     */
-	    if( manufacturer != NULL && (spnt->manufacturer == NULL ||
-					 strcmp(spnt->manufacturer, manufacturer) != 0 ))
-		continue;
+/* Read a VPD page the kernel has cached in sysfs (vpd_pg80, vpd_pg83) */
+int sysfs_read_vpd (const char *dir, const char *attr, unsigned char *page, int len)
+{
+	char nm[PATH_MAX];
+	int fd, n, pglen;
+	snprintf (nm, sizeof (nm), "%s/%s", dir, attr);
+	fd = open (nm, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	memset (page, 0, len);
+	n = read (fd, page, len);
+	close (fd);
+	if (n < 4)
+		return -1;
+	/* Don't let the parsers run past what we got */
+	pglen = (page[2] << 8) + page[3];
+	if (pglen + 4 > n) {
+		pglen = n - 4;
+		page[2] = pglen >> 8; page[3] = pglen & 0xff;
+	}
+	return n;
+}
 
-	    if( model != NULL && (spnt->model == NULL ||
-				  strcmp(spnt->model, model) != 0 ))
-		continue;
+#define VPDBUFSZ 1024
 
-	    if( serial_number != NULL && (spnt->serial == NULL ||
-					  strcmp(spnt->serial, serial_number) != 0 ))
-		continue;
+/* Kernel names of the high level devices */
+struct { const char *nm; enum devtype_t devtp; } knm_devtp[] = {
+	{ "sd", SD }, { "sg", SG }, { "sr", SR }, { "scd", SR },
+	{ "st", ST }, { "nst", ST }, { "osst", OSST }, { "nosst", OSST },
+	{ "sch", SCH }, { 0, NONE },
+};
 
-	    if( rev != NULL && (spnt->rev == NULL ||
-				strcmp(spnt->rev, rev) != 0 ))
-		continue;
+/* Fill in the identity of the SCSI device (hostnum etc. set) at sysfs 
+ * dir sdevdir from its attributes and the VPD pages cached there */
+void sysfs_ident (const char *sdevdir, sname *dev)
+{
+	char buf[256];
+	unsigned char page[VPDBUFSZ];
+	char *ptr;
+
+	if ((ptr = sysfs_read_attr (sdevdir, "type", buf, sizeof (buf))))
+		dev->inq_devtp = atoi (ptr);
+	if ((ptr = sysfs_read_attr (sdevdir, "vendor", buf, sizeof (buf))) && *ptr)
+		dev->manufacturer = strdup (ptr);
+	if ((ptr = sysfs_read_attr (sdevdir, "model", buf, sizeof (buf))) && *ptr)
+		dev->model = strdup (ptr);
+	if ((ptr = sysfs_read_attr (sdevdir, "rev", buf, sizeof (buf))) && *ptr)
+		dev->rev = strdup (ptr);
+	dev->serial = no_serial;
+	if (sysfs_read_vpd (sdevdir, "vpd_pg80", page, sizeof (page)) > 4)
+		dev->serial = getstr ((char*)page, 4, 3+page[3]);
+	dev->wwid = no_wwid;
+	if (sysfs_read_vpd (sdevdir, "vpd_pg83", page, sizeof (page)) > 4) {
+		dev->wwid = extract_wwid (page);
+		dev->desigs = extract_desigs (page, sizeof (page));
+	}
+	dev->hsv_os_id = no_hsv_os_id;
+	find_host (dev);
+}
 
-	    if( host != NULL 
-		&& (spnt->hostname == NULL ||
-				 strncmp(spnt->hostname, host, strlen(host)) != 0)
-		&& (spnt->shorthostname == NULL ||
-		    strncmp(spnt->shorthostname, host, strlen(host)) != 0) )
-			continue;
+/*
+ * udev callout: Print the names (relative to /dev) that scsidev would
+ * give the device at sysfs devpath: The scsiname () followed by the 
+ * aliases matching it. Only sysfs is used, no SCSI commands are sent,
+ * so hsvosid= aliases are not supported here and uniqueness can't be
+ * checked.
+ */
+int callout (const char *devpath)
+{
+	char syspath[PATH_MAX], path[PATH_MAX], sdevdir[PATH_MAX];
+	char buf[256];
+	sname dev, master;
+	struct alias_rule * rule;
+	char *ptr, *knm;
+	int ln, i, sub;
+
+	if (memcmp (devpath, "/sys/", 5))
+		snprintf (syspath, sizeof (syspath), "/sys%s", devpath);
+	else
+		snprintf (syspath, sizeof (syspath), "%s", devpath);
+	if (!realpath (syspath, path)) {
+		fprintf (stderr, "scsidev: %s: %s\n", syspath, strerror (errno));
+		return -1;
+	}
+	memset (&dev, 0, sizeof (sname));
+	ln = sysfs_path_hctl (path, &dev.hostnum, &dev.chan, &dev.id, &dev.lun);
+	if (!ln) {
+		fprintf (stderr, "scsidev: %s is no SCSI device\n", devpath);
+		return -1;
+	}
+	memcpy (sdevdir, path, ln); sdevdir[ln] = 0;
 
-	    /*
-	     * We have a match.  Record it and keep looking just in
-	     * case we find a duplicate.
-	     */
-	    if( match != NULL ) {
-		if (!supp_multi) {
-		    fprintf (stderr, "Line %d not matched uniquely\n", line);
-		    fprintf (stderr, " Prev. match: %s\n", match->name);
-		    fprintf (stderr, " Curr. match: %s\n", spnt->name);
-		    break;
-		} else {
-		    if (!quiet) 
-			fprintf (stderr, "Line %d: %s <=> %s\n",
-				 line, match->name, spnt->name);
+	/* The dev node */
+	knm = strrchr (path, '/') + 1;
+	for (i = 0; knm_devtp[i].nm; ++i) {
+		int l = strlen (knm_devtp[i].nm);
+		if (!memcmp (knm, knm_devtp[i].nm, l) && !!isalpha (knm[l]) == (knm_devtp[i].devtp == SD))
+			break;
+	}
+	dev.devtp = knm_devtp[i].devtp;
+	ptr = sysfs_read_attr (path, "dev", buf, sizeof (buf));
+	if (dev.devtp == NONE || !ptr || 
+	    sscanf (ptr, "%d:%d", &dev.major, &dev.minor) != 2) {
+		fprintf (stderr, "scsidev: %s is no SCSI dev node\n", devpath);
+		return -1;
+	}
+	dev.partition = -1;
+	if (dev.devtp == SD && (ptr = sysfs_read_attr (path, "partition", buf, sizeof (buf))))
+		dev.partition = atoi (ptr);
+
+	sysfs_ident (sdevdir, &dev);
+	scsiname (&dev);
+	printf ("scsi/%s", reg_key (&dev));
+
+	/* Aliases are matched against the whole disk or the rewinding tape */
+	master = dev; sub = 0;
+	if (dev.devtp == SD && dev.partition != -1)
+		master.partition = -1, sub = 1;
+	else if ((dev.devtp == ST || dev.devtp == OSST) && (dev.minor & 0x80))
+		master.minor &= ~0x80, sub = 1;
+
+	read_alias_rules ();
+	for (rule = alias_rules_tp[dev.devtp]; rule; rule = rule->next_tp) {
+		const sname *match = NULL;
+		if (rule_matches (rule, &dev))
+			match = &dev;
+		else if (sub && rule_matches (rule, &master))
+			match = &master;
+		if (!match || alias_name (rule, match, buf, sizeof (buf)))
+			continue;
+		if (match == &dev)
+			printf (" scsi/%s", buf);
+		else if (dev.devtp == SD)
+			printf (" scsi/%s-p%d", buf, dev.partition);
+		else {
+			ptr = strrchr (buf, '/');
+			ptr = ptr? ptr + 1: buf;
+			printf (" scsi/%.*sn%s", (int) (ptr - buf), buf, ptr);
 		}
-	    } else
-		match = spnt;
 	}
+	printf ("\n");
+	return 0;
+}
 
-	/*
-	 * See if there was a non-unique mapping.  If so, then
-	 * don't do anything for this one.
-	 */
-	    
-	// detect break
-	if( spnt != NULL )
-	    continue;
-
-	if( match != NULL ) {
-	    /*
-	     * OK, we have a unique match.  Create the device entries,
-	     * as requested.
-	     */
-	    if (!quiet) {
-		fprintf (stderr, "Alias device %s: %s (%s)", name,
-			 strrchr (match->name, '/') + 1,
-			 match->oldname);
-		if (match->related)
-		    fprintf (stderr, " -> (%s, %s)\n",
-			     strrchr (match->related->name, '/') + 1,
-			     match->related->oldname);
-		else 
-		    fprintf (stderr, "\n");
-	    }
-
-	    /*
-	     * If this is just an ordinary single device type,
-	     * Just create it.
-	     */
-	    sprintf (scsidev, DEVSCSI "/%s", name);
-	    spnt1 = register_dev (scsidev, match->major, match->minor,
-				  match->devtp, match->hostnum, match->hostid,
-				  match->chan, match->id, match->lun, 0,
-				  match->hostname, match->name, match, 0);
-	    create_dev (spnt1, symlink_alias);
-
-	    if( devtype_i == ST || devtype_i == OSST ) {
-		char nm2[64]; char * ptr; 
-		ptr = strrchr (match->name, '/');
-		strcpy (nm2, "scsi/n");
-		strcat (nm2, ptr? ptr+1: match->name);
-		sprintf (scsidev, DEVSCSI "/n%s", name);
-
-		spnt1 = register_dev (scsidev, match->major, match->minor | 0x80,
-				      match->devtp, match->hostnum, match->hostid,
-				      match->chan, match->id, match->lun, 0,
-				      match->hostname, nm2, match, spnt1);
-		create_dev (spnt1, symlink_alias);
-	    }
+/* Could rule match (a high level device of) the SCSI device dev, 
+ * as far as we know it from sysfs? */
+static int rule_prematch (const struct alias_rule *rule, const sname *dev)
+{
+	sname tmp = *dev;
+	tmp.devtp = rule->devtp; tmp.partition = rule->part;
+	tmp.minor = 0;
+	/* Not in sysfs, needs a SCSI command */
+	tmp.hsv_os_id = rule->hsv_os_id;
+	return rule_matches (rule, &tmp);
+}
 
-	    if ( devtype_i == SD 
-		 && match->partition == -1 ) {
-		/*
-		 * This is the master entry for a disk.
-		 * we need to go through and generate entries
-		 * for each partition.  The trick is to find
-		 * all of the related entries so we know which
-		 * ones we actually need to create.
-		 */
-		for( spnt = reglist; spnt; spnt = spnt->next ) {
-		    sname * spnt2;
-		    if( spnt->alias != NULL ) continue;
-		    if( spnt->partition == -1 ) continue;
-		    if( spnt->devtp != devtype_i ) continue;
-		    if( spnt->id != match->id ) continue;
-		    if( spnt->lun != match->lun ) continue;
-		    if( spnt->chan != match->chan ) continue;
-		    if( spnt->hostnum != match->hostnum ) continue;
-		    if( spnt->hostid != match->hostid ) continue;
-
-		    sprintf(scsidev, DEVSCSI "/%s-p%d", name, 
-			    spnt->partition);
-		    spnt2 = register_dev (scsidev, match->major, spnt->minor,
-					  match->devtp, match->hostnum, match->hostid,
-					  match->chan, match->id, match->lun, spnt->partition,
-					  match->hostname, spnt->name, spnt, spnt1);
-		    create_dev (spnt2, symlink_alias);
+/*
+ * --early: Before the full scan, find the SCSI devices in sysfs that
+ * alias rules refer to, by what sysfs knows about them (as the udev
+ * callout does). Only those are identified and get their nodes and
+ * aliases, then READYFILE is created. The registrations are dropped
+ * again, the full scan that follows handles the devices like any 
+ * others (their nodes are there already). Returns the no of devices.
+ */
+int prio_scan ()
+{
+	char sdevdir[PATH_MAX];
+	struct dirent *de;
+	struct hctl *prio = NULL;
+	struct alias_rule *rule;
+	sname *dev, *list;
+	int nprio = 0, i, fd, pm;
+	char *sel;
+	DIR *dir;
+
+	unlink (READYFILE);
+	if (read_alias_rules () <= 0)
+		return 0;
+	dir = opendir (SYSSCSIDEV);
+	if (!dir) {
+		if (!quiet)
+			fprintf (stderr, "scsidev: --early needs sysfs\n");
+		return 0;
+	}
+	/* The rules that may match a device found early */
+	sel = calloc (n_alias_rules, 1);
+	while ((de = readdir (dir)) != NULL) {
+		dev = malloc (sizeof (sname));
+		memset (dev, 0, sizeof (sname));
+		if (sscanf (de->d_name, "%d:%d:%d:%d", &dev->hostnum, &dev->chan,
+			    &dev->id, &dev->lun) != 4) {
+			free (dev);
+			continue;
 		}
-	    }
-	} else {
-	    if (!quiet) 
-		fprintf (stderr, "Unable to match device for line %d (alias %s)\n", 
-			 line, name);
+		snprintf (sdevdir, sizeof (sdevdir), SYSSCSIDEV "/%s/device",
+			  de->d_name);
+		sysfs_ident (sdevdir, dev);
+		for (pm = 0, rule = alias_rules; rule < alias_rules + n_alias_rules; ++rule)
+			if (rule_prematch (rule, dev))
+				sel[rule - alias_rules] = pm = 1;
+		if (pm) {
+			prio = realloc (prio, (nprio + 1) * sizeof (struct hctl));
+			prio[nprio].hnum = dev->hostnum; prio[nprio].chan = dev->chan;
+			prio[nprio].id = dev->id; prio[nprio++].lun = dev->lun;
+		}
+		free_snames (dev);
 	}
-    }
-
-    fclose (configfile);
+	closedir (dir);
+	if (verbose)
+		printf ("%i devices referred to by %s\n", nprio, scsialias);
+
+	for (i = 0; i < nprio; ++i)
+		sysfs_scan_dev (prio[i].hnum, prio[i].chan, prio[i].id, prio[i].lun);
+	free (prio);
+	/* Only those rules, the others would not match anything yet */
+	devindex_build ();
+	alias_partial = 1;
+	for (i = 0; i < n_alias_rules; ++i)
+		if (sel[i])
+			eval_rule (alias_rules + i);
+	alias_partial = 0;
+	free (sel);
+	group_save ();
+	explain_summary ();
+	plan_apply ();
+	if (!dry_run) {
+		fd = open (READYFILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			perror ("scsidev: can't create " READYFILE);
+		else
+			close (fd);
+	}
+	if (!quiet)
+		printf ("Named %i devices early\n", nprio);
+
+	list = reglist;
+	reglist = NULL;
+	hash_clear (&regnames, NULL);
+	free_snames (list);
+	/* The full scan may not want them any more */
+	node_unclaim_all ();
+	return nprio;
 }
 
 /****************************** INQUIRY ***************************/
@@ -3062,6 +7600,57 @@ unsigned long long extract_wwid (unsigned char* page)
 	return no_wwid;
 }
 
+/* All designators of the LU in page (of at most buflen bytes) as
+ * "type:value" list (see sname.desigs), binary ones in hex.
+ * NULL if there are none */
+char * extract_desigs (unsigned char* page, int buflen)
+{
+	int len = 4 + ((page[2] << 8) | page[3]);
+	unsigned char *pid = page + 4;
+	char *desigs = NULL, val[16 + 2*255];
+	int dlen = 0, vlen, i;
+	const char *tp;
+
+	if (page[1] != 0x83 || page[6] != 0)
+		return NULL;
+	if (len > buflen)
+		len = buflen;
+	for (; pid + 4 <= page + len && pid + 4 + pid[3] <= page + len;
+	     pid += 4 + pid[3]) {
+		unsigned char code  =  pid[0] & 0x0f;
+		unsigned char assoc = (pid[1] & 0x30) >> 4;
+		switch (pid[1] & 0x0f) {
+		case 1: tp = "t10"; break;
+		case 2: tp = "eui64"; break;
+		case 3: tp = "naa"; break;
+		case 8: tp = "scsiname"; break;
+		default: continue;
+		}
+		/* Only the LU, not the ports */
+		if (assoc != 0 || !pid[3])
+			continue;
+		vlen = sprintf (val, "%s:", tp);
+		if (code == 1) {
+			for (i = 0; i < pid[3]; ++i)
+				vlen += sprintf (val + vlen, "%02x", pid[4+i]);
+		} else {
+			/* ASCII or UTF-8, NUL padded */
+			for (i = 0; i < pid[3] && pid[4+i]; ++i)
+				val[vlen++] = pid[4+i] < 0x20? '_': pid[4+i];
+			while (val[vlen-1] == ' ')
+				--vlen;
+			val[vlen] = 0;
+		}
+		if (val[vlen-1] == ':' || desigs_has (desigs, val))
+			continue;
+		desigs = realloc (desigs, dlen + vlen + 2);
+		memcpy (desigs + dlen, val, vlen + 1);
+		dlen += vlen + 1;
+		desigs[dlen] = 0;
+	}
+	return desigs;
+}
+
 #ifndef SG_IO
 void my_memmove(unsigned char* dst, unsigned char* src, unsigned int ln)
 {
@@ -3152,6 +7741,7 @@ int inquiry (int infile, sname * spnt)
     int lun; int ansi;
 	
     spnt->wwid = no_wwid; spnt->serial = no_serial;
+    spnt->desigs = NULL;
     //infile = open(spnt->name, O_RDWR);
     if (infile == -1) {
 	fprintf(stderr,"No input file for inquiry!\n");
@@ -3219,6 +7809,7 @@ int inquiry (int infile, sname * spnt)
 	    dumppage_83(pagestart);
 	}
 	spnt->wwid = extract_wwid (pagestart);
+	spnt->desigs = extract_desigs (pagestart, 0xfc);
 
 	if (verbose >= 2)
 	    printf ("WWID for %s: %Lx\n", spnt->name, spnt->wwid);